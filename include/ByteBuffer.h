@@ -0,0 +1,45 @@
+#ifndef BYTEBUFFER_H
+#define BYTEBUFFER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/***************************************************************************************
+ * ByteBuffer - a growable byte buffer with separate read and write positions, used as a
+ *              connection's receive buffer. Data is read off the socket straight into the
+ *              free space at the tail (writePtr/commit) and parsed from the head
+ *              (data/consume). Consumed space is reclaimed by sliding the unread bytes
+ *              back to the front, so once the buffer has grown to fit the largest message
+ *              it never allocates again.
+ ***************************************************************************************/
+class ByteBuffer
+{
+public:
+   ByteBuffer(size_t initial_size = 16384);
+   ~ByteBuffer();
+
+   // The unread data
+   uint8_t *data() { return _buf.data() + _rpos; };
+   size_t size() { return _wpos - _rpos; };
+   bool empty() { return _wpos == _rpos; };
+
+   // Free space at the tail, made at least min_free bytes. Write into it, then commit
+   uint8_t *writePtr(size_t min_free);
+   size_t writable() { return _buf.size() - _wpos; };
+   void commit(size_t n) { _wpos += n; };
+
+   // Drops n bytes from the front of the unread data
+   void consume(size_t n);
+
+   void append(const uint8_t *src, size_t len);
+   void clear() { _rpos = _wpos = 0; };
+
+private:
+   std::vector<uint8_t> _buf;
+
+   size_t _rpos;     // First unread byte
+   size_t _wpos;     // One past the last byte written
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef CSVCONVERTER_H
+#define CSVCONVERTER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+
+class DronePlot;
+
+// The input is cut into pieces of about this many bytes, each ending at a newline, and
+// parse threads take them one at a time
+const size_t csv_piece_bytes = 8 << 20;
+
+// Most parse threads used, and how many pieces each may be ahead of the writer
+const unsigned int csv_max_threads = 16;
+const unsigned int csv_pieces_per_thread = 2;
+
+/***************************************************************************************
+ * CSVConverter - converts a CSV file of drone plots (drone_id,node_id,timestamp,latitude,
+ *                longitude per line) into a PlotFile without holding either in memory.
+ *
+ *                The input is mapped and cut into pieces at line ends. Parse threads take
+ *                pieces in order and parse them with from_chars, keeping only the plots of
+ *                the node being filtered for. The calling thread writes each piece's plots
+ *                out, in input order, as soon as that piece is parsed, and drops the pages
+ *                of input it has finished with. Only a few pieces per thread are ever in
+ *                flight, so memory use doesn't depend on the size of the input.
+ ***************************************************************************************/
+class CSVConverter
+{
+public:
+   CSVConverter(const char *in_file, const char *out_file, unsigned int verbosity = 0);
+   ~CSVConverter();
+
+   // Keep only this node's plots (default: keep everything)
+   void setNodeFilter(unsigned int node_id);
+
+   // Runs the conversion across up to max_threads parse threads (0 = one per core).
+   // Returns the number of plots written. Throws runtime_error if a file can't be opened
+   // or written, or a line can't be parsed (the output is then incomplete)
+   size_t convert(unsigned int max_threads = 0);
+
+   // Plots read from the input by the last convert, before filtering
+   size_t getPlotsRead() { return _plots_read; };
+
+   // Parses one line (no line end) into plot. Returns false if it isn't a valid plot
+   static bool parseLine(const char *line, const char *end, DronePlot &plot);
+
+private:
+   // One piece of the input and what came of parsing it
+   struct piece
+   {
+      size_t begin, end;            // Byte range of the input
+      std::vector<DronePlot> plots; // Plots kept
+      size_t read;                  // Plots read, before filtering
+      std::string error;
+      bool done;
+   };
+
+   static void *t_parse(void *data);
+   void parseLoop();
+   void parsePiece(piece &p);
+
+   void stopThreads();
+
+   std::string _in_file;
+   std::string _out_file;
+   unsigned int _verbosity;
+
+   bool _filter;
+   unsigned int _node_id;
+
+   size_t _plots_read;
+
+   const uint8_t *_data;            // The mapped input
+   size_t _len;
+
+   // Pieces ahead of the writer, piece n in slot n % _pieces.size()
+   std::vector<piece> _pieces;
+   std::vector<size_t> _cuts;       // Piece n is [_cuts[n], _cuts[n + 1])
+   size_t _next_piece;              // Next for a parse thread to take
+   size_t _written;                 // Pieces the writer has finished with
+   bool _stop;
+
+   std::vector<pthread_t> _threads;
+   pthread_mutex_t _mutex;
+   pthread_cond_t _parsed;          // A piece was parsed
+   pthread_cond_t _freed;           // The writer freed a slot
+};
+
+#endif
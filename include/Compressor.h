@@ -0,0 +1,57 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+// First bytes of a compressed batch, followed by the compressor ID and the uncompressed
+// length (4 bytes, network order). Read as a raw batch's 32-bit count, all four bytes make
+// it over a billion plots, where a max_frame_payload frame holds under three million
+const uint8_t compress_magic[] = { 'C', 'Z', 'P', 'K' };
+const size_t compress_header_size = sizeof(compress_magic) + 1 + 4;
+
+/******************************************************************************************
+ * Compressor - Parent class for the replication batch compression stage. Each child class
+ *              is one algorithm with a fixed ID that goes on the wire, so the receiver can
+ *              pick the matching decompressor.
+ *
+ *              pack/unpack wrap and unwrap the compressed data with the batch header.
+ *              create returns the built-in compressor for an ID (NULL if unknown).
+ *****************************************************************************************/
+
+class Compressor {
+   public:
+      enum compressor_id { c_lz = 1 };
+
+      virtual ~Compressor();
+
+      virtual uint8_t getID() = 0;
+      virtual const char *getName() = 0;
+
+      // Appends the compressed form of data to out
+      virtual void compress(const uint8_t *data, size_t len, std::vector<uint8_t> &out) = 0;
+
+      // Decompresses data into out, which is already sized to the original length. Returns
+      // false if the data is corrupt or doesn't fill out exactly
+      virtual bool decompress(const uint8_t *data, size_t len, std::vector<uint8_t> &out) = 0;
+
+      // Compresses a batch with the header in front
+      void pack(const uint8_t *data, size_t len, std::vector<uint8_t> &out);
+
+      // True if the data starts with the compressed batch header
+      static bool isPacked(const uint8_t *data, size_t len);
+
+      // Decompresses a packed batch with whichever built-in compressor it names. Throws
+      // runtime_error if the compressor is unknown or the data is corrupt
+      static void unpack(const uint8_t *data, size_t len, std::vector<uint8_t> &out);
+
+      static std::unique_ptr<Compressor> create(uint8_t id);
+
+   protected:
+
+      Compressor();
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef DECONFLICTINDEX_H
+#define DECONFLICTINDEX_H
+
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include <ctime>
+#include <cmath>
+
+// Two plots of a drone from different nodes are the same sighting if their positions are
+// within this many degrees of each other (~1m) and their timestamps within this many
+// seconds (the most two servers' clocks can disagree by)
+const double deconflict_tolerance = 0.00001;
+const time_t deconflict_secs = 5;
+
+// Plots are kept in the index this long (sim seconds) past the newest timestamp seen, long
+// enough for the other nodes' copies to come in through replication
+const time_t deconflict_retain_secs = 600;
+
+/***************************************************************************************
+ * DeconflictIndex - finds the plot another antenna already reported for the same
+ *                   sighting, in expected constant time, over a sliding time window.
+ *
+ *                   Plots are hashed on (drone_id, position cell), with cells twice the
+ *                   tolerance across, so a match is always in one of the four cells
+ *                   around a plot. Each cell holds the few plots kept from it recently.
+ *                   Plots fall out of the index, oldest first, once they are more than
+ *                   deconflict_retain_secs older than the newest one added.
+ *
+ *                   Plots are identified by LSN, which doesn't change when the database
+ *                   moves them. What to do about a match is up to the caller (see
+ *                   DronePlotDB::setDeconflict).
+ ***************************************************************************************/
+class DeconflictIndex
+{
+public:
+   // What DronePlotDB does with a duplicate:
+   //    dc_off - nothing, every plot is kept as it is
+   //    dc_drop - a peer's plot (DBFLAG_SYNCD) that matches one already held is not
+   //              added. Our own plots are always kept, so every plot reaches every
+   //              server and the dropped ones can be counted as seen in the hash tree.
+   //              Which copy survives depends on arrival order, so servers can keep
+   //              different ones
+   //    dc_keep_lowest - both are kept, and a plot is flagged DBFLAG_DUP if it matches one
+   //                     from a lower node ID. That doesn't depend on the order plots
+   //                     arrive in, so every server flags the same ones and their
+   //                     databases (and hash trees) still match
+   enum policy { dc_off, dc_drop, dc_keep_lowest };
+
+   // A plot in the index
+   struct entry
+   {
+      uint64_t lsn;
+      unsigned int node_id;
+      time_t timestamp;
+      float latitude, longitude;
+   };
+
+   DeconflictIndex(double tolerance = deconflict_tolerance, time_t secs = deconflict_secs,
+                                            time_t retain_secs = deconflict_retain_secs);
+
+   // Appends every plot of the drone from another node that matches. Returns how many
+   size_t find(unsigned int drone_id, unsigned int node_id, time_t timestamp, float latitude,
+                                      float longitude, std::vector<entry> &matches);
+
+   // Adds a plot, then drops the plots that have aged out of the window
+   void add(unsigned int drone_id, unsigned int node_id, time_t timestamp, float latitude,
+                                                    float longitude, uint64_t lsn);
+
+   // Takes a plot out (it was removed from the database)
+   void remove(unsigned int drone_id, float latitude, float longitude, uint64_t lsn);
+
+   void clear();
+
+   // Plots in the index
+   size_t size() { return _size; };
+
+   // Parses "off", "drop" or "lowest". Returns false for anything else
+   static bool parsePolicy(const char *name, policy &p);
+
+private:
+   struct cell_key
+   {
+      unsigned int drone_id;
+      int64_t lat_cell, lon_cell;
+
+      bool operator==(const cell_key &other) const {
+         return (drone_id == other.drone_id) && (lat_cell == other.lat_cell) &&
+                                                (lon_cell == other.lon_cell);
+      };
+   };
+
+   struct cell_hash
+   {
+      size_t operator()(const cell_key &key) const;
+   };
+
+   int64_t toCell(double degrees) { return (int64_t) floor(degrees / _cell); };
+   cell_key keyFor(unsigned int drone_id, float latitude, float longitude);
+
+   void eraseEntry(const cell_key &key, uint64_t lsn);
+   void expire();
+
+   double _tolerance;
+   double _cell;
+   time_t _secs;
+   time_t _retain_secs;
+
+   std::unordered_map<cell_key, std::vector<entry>, cell_hash> _cells;
+   size_t _size;
+
+   // Plots in the order they were added, for aging them out
+   struct aging
+   {
+      time_t timestamp;
+      cell_key key;
+      uint64_t lsn;
+   };
+   std::deque<aging> _order;
+   time_t _newest;
+};
+
+#endif
@@ -1,12 +1,18 @@
 #ifndef DRONEPLOTDB_H
 #define DRONEPLOTDB_H
 
-#include <list>
 #include <vector>
+#include <map>
+#include <unordered_map>
 #include <unistd.h>
 #include <pthread.h>
 #include "exceptions.h"
+#include "PlotStore.h"
+#include "PlotHashTree.h"
+#include "DeconflictIndex.h"
+#include "PlotFile.h"
 
+class PlotWAL;
 
 // Flags for the DronePlot object. The first two are already coded in and
 // you can define more. It's based off bitwise and/or operations so just
@@ -17,6 +23,7 @@
 #define DBFLAG_USER2    0x8   // Change as needed
 #define DBFLAG_USER3    0x16  // Change as needed
 #define DBFLAG_USER4    0x32
+#define DBFLAG_DUP      0x40  // Another node's plot of the same sighting is the one kept
 
 // Manages the drone plot database for a particular node.
 class DronePlot
@@ -40,6 +47,7 @@ public:
    void setFlags(unsigned short flags);
    void clrFlags(unsigned short flags);
    bool isFlagSet(unsigned short flags); 
+   unsigned short getFlags() { return _flags; };
 
    // attributes - freely accessible to modify as needed 
    unsigned int drone_id;
@@ -58,22 +66,68 @@ private:
  * DronePlotDB - class to manage a database of DronePlot objects, which manage drone GPS plots that
  *               are "received" by the antenna or another replication server
  *
+ *               Plots are kept in a columnar PlotStore. The iterators hand back PlotRef handles that
+ *               read and write the columns in place, so they can be used like DronePlot pointers.
+ *
+ *               A per-drone index (drone_id -> time-ordered slots) answers queryDrone in log time.
+ *               It is built on the first query and then kept current as plots are added. Changing
+ *               a timestamp through an iterator is not seen by the index--call reindex() after.
+ *
+ *               Every plot added is given the next log sequence number (LSN) and recorded in an
+ *               append-only change log, so getPlotsSince can hand back only what was added after
+ *               a given LSN without scanning the rest of the database.
+ *
+ *               A PlotHashTree over (drone_id, time bucket) is kept current as plots are added
+ *               and removed, so two servers can find where their databases differ by comparing
+ *               sums instead of plots (see ReplServer's anti-entropy sync).
+ *
+ *               With a PlotWAL attached, every plot added is also appended to the write-ahead
+ *               log, and plots removed ask the WAL for a checkpoint.
+ *
+ *               With deconfliction on, every plot added one at a time is checked against a
+ *               DeconflictIndex of the recent plots from other nodes, and a duplicate is
+ *               dropped or flagged DBFLAG_DUP depending on the policy. A dropped plot is
+ *               remembered and still counted in the hash tree, so servers that turned away
+ *               different copies of a sighting still have matching sums, and a copy a peer
+ *               offers again is recognized and skipped.
+ *
  **************************************************************************************************/
 class DronePlotDB 
 {
 public:
+   typedef PlotStore::iterator iterator;
+
    DronePlotDB();
    virtual ~DronePlotDB();
 
-   // Add a plot to the database with the given attributes (mutex'd)
-   void addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude);
+   // Add a plot to the database with the given attributes (mutex'd). A plot without
+   // DBFLAG_SYNCD is one of ours and has the clock adjustment added to its timestamp
+   void addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude,
+                                                                  unsigned short flags = 0);
+
+   // Adds a batch of plots, each with its own flags, as addPlot would one at a time but
+   // locking once, so readers see all of the batch or none of it. Returns how many were
+   // stored (deconfliction can drop some) (mutex'd)
+   size_t addPlots(std::vector<DronePlot> &plots);
 
    // Load or write the database to/from a CSV file, 
    int loadCSVFile(const char *filename);
-   int writeCSVFile(const char *filename);
+   int writeCSVFile(const char *filename, unsigned short excl_flags = 0);
+
+   // Direct binary load/write to/from the specified file. Files are written as PlotFiles;
+   // both PlotFiles and the older headerless files load, decoded in bulk
+   int loadBinaryFile(const char *filename, bool sequential = true, unsigned int max_threads = 0);
 
-   // Direct binary load/write to/from the specified file
-   int loadBinaryFile(const char *filename);
+   // Adds only the plots with t_begin <= timestamp <= t_end (of one drone, or all_drones).
+   // PlotFiles have just the blocks the index says could match decoded; older headerless
+   // files are read through
+   int loadBinaryRange(const char *filename, time_t t_begin, time_t t_end,
+                          unsigned int drone_id = all_drones, unsigned int max_threads = 0);
+
+   // Adds count plots stored back to back in the headerless binary layout, with an optional
+   // flags column, decoding across up to max_threads threads (0 = one per core) (mutex'd)
+   size_t loadBinaryData(const uint8_t *data, size_t count, const uint8_t *flags = NULL,
+                                                                unsigned int max_threads = 0);
    int writeBinaryFile(const char *filename);
    
    // Sort the database in order of timestamp 
@@ -82,15 +136,64 @@ public:
    // Remove all plotpoints of a particular node (used to generate binary, not for student use)
    void removeNodeID(unsigned int node_id);
 
+   // Gets the plots of one drone with t_begin <= timestamp <= t_end in time order (mutex'd)
+   size_t queryDrone(unsigned int drone_id, time_t t_begin, time_t t_end,
+                                                         std::vector<DronePlot> &plots);
+
+   // Adds the plots of a replicated batch that aren't stored yet, as addPlot would with the
+   // given flags, locking once. The lookups and indexing are split by drone across up to
+   // max_threads jobs (0 = one per core). is_new[i] is set unless plots[i] was already held
+   // (or earlier in the batch). Returns how many were stored (mutex'd)
+   size_t mergePlots(std::vector<DronePlot> &plots, unsigned short flags,
+                           std::vector<bool> &is_new, unsigned int max_threads = 0);
+
+   // True if a plot with the same drone, node, timestamp and coordinates is stored, without
+   // any of excl_flags set (mutex'd)
+   bool hasPlot(DronePlot &plot, unsigned short excl_flags = 0);
+
+   // Forces the per-drone index to be rebuilt on the next query and rebuilds the hash tree
+   // (mutex'd). Needed after plot attributes are changed through the iterators
+   void reindex();
+
+   // The hash tree's per-drone sums and one drone's per-bucket sums, over the buckets that
+   // start before the given time (mutex'd)
+   void getSyncDrones(std::vector<sync_entry> &entries, time_t before);
+   void getSyncBuckets(unsigned int drone_id, std::vector<sync_entry> &entries, time_t before);
+
+   // Gets plots added after the given LSN (and up to through_lsn, 0 = no limit), skipping any
+   // with excl_flags set (mutex'd)
+   uint64_t getPlotsSince(uint64_t after_lsn, std::vector<DronePlot> &plots,
+                                    unsigned short excl_flags = 0, size_t max_plots = 0,
+                                    uint64_t through_lsn = 0);
+
+   // Logs every plot added from now on to the WAL (NULL stops logging) (mutex'd)
+   void attachWAL(PlotWAL *wal);
+
+   // Deconflicts the plots added from now on with the given policy (mutex'd), and how many
+   // duplicates have been dropped or flagged so far
+   void setDeconflict(DeconflictIndex::policy policy);
+   void getDeconflictStats(uint64_t &dropped, uint64_t &flagged);
+
+   // Seconds added to the timestamps of our own plots added from now on, to line our clock
+   // up with the other nodes' (mutex'd). Returns the LSN of the last plot added before
+   uint64_t setClockAdjust(time_t secs);
+
+   // Copies out every plot with its flags for a checkpoint and, while still locked, rotates
+   // the attached WAL to a new segment. Returns the new segment (mutex'd)
+   uint64_t checkpointPlots(std::vector<DronePlot> &plots);
+
+   // The LSN given to the most recently added plot (0 if none yet)
+   uint64_t getLastLSN() { return _next_lsn - 1; };
+
    // Iterators for simple access to the database. Can use these to modify drone plot points
    // but won't be able to add/delete PlotObjects. Use erase (below) for that as it is mutex'd
-   std::list<DronePlot>::iterator begin() { return _dbdata.begin(); };
-   std::list<DronePlot>::iterator end() { return _dbdata.end(); };
+   iterator begin() { return _dbdata.begin(); };
+   iterator end() { return _dbdata.end(); };
    
    // Manipulate database entries (mutex'd functions)
    void popFront();
    void erase(unsigned int i);
-   std::list<DronePlot>::iterator erase(std::list<DronePlot>::iterator dptr);
+   iterator erase(iterator dptr);
 
 
    // Return the number of plot points stored
@@ -100,7 +203,53 @@ public:
    void clear();
 
 private:
-   std::list<DronePlot> _dbdata;
+   // Per-drone index maintenance (call with the mutex locked)
+   void indexPlot(size_t slot);
+   void unindexPlot(size_t slot);
+   void buildIndex();
+
+   // Adds the plot at slot to the hash tree or takes it out
+   void hashPlot(size_t slot);
+   void unhashPlot(size_t slot);
+
+   // Adds a plot to the store, assigning an LSN and updating the change log, index, hash
+   // tree and WAL. With index false, the caller indexes it
+   size_t appendPlot(DronePlot &plot, bool index = true);
+
+   // Records rows a bulk load filled in directly in the change log, index, hash tree and WAL
+   void addLoaded(size_t first_slot, size_t count);
+
+   // Applies the deconfliction policy to a plot about to be added. Returns false if it
+   // should be dropped
+   bool deconflict(DronePlot &plot);
+
+   // Points the change log at the new slots after the store has been reordered
+   void remapChangeLog();
+
+   PlotStore _dbdata;
+
+   // drone_id -> (timestamp -> slot). multimap keeps equal timestamps in insert order
+   std::map<unsigned int, std::multimap<time_t, size_t>> _drone_index;
+   bool _index_valid;
+
+   PlotHashTree _hashtree;
+
+   // Change log, _changelog[lsn-1] is the slot holding that plot (or no_slot if removed)
+   std::vector<size_t> _changelog;
+   uint64_t _next_lsn;
+
+   PlotWAL *_wal;
+
+   DeconflictIndex _deconflict;
+   DeconflictIndex::policy _dc_policy;
+   uint64_t _dc_dropped;
+   uint64_t _dc_flagged;
+
+   // dc_drop: plot hash -> (drone_id, timestamp) of every plot turned away, which stay in
+   // the hash tree
+   std::unordered_map<uint64_t, std::pair<unsigned int, time_t>> _dc_seen;
+
+   time_t _clock_adjust;
 
    pthread_mutex_t _mutex; 
 };
@@ -3,10 +3,15 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
 #include <unistd.h>
 #include "exceptions.h"
+#include "ByteBuffer.h"
 
 // Manages File Descriptors by largely simplfying their interfaces for specific purposes.
 // FileDesc provides some limited functionality and could be instantiated, but child
@@ -30,6 +35,10 @@ public:
    ssize_t writeFD(const char *data);
    ssize_t writeFD(const char *data, unsigned int len);
 
+   // Gathers the buffers into a single write (writev), so a header and payload kept in
+   // separate buffers go out without being copied together. Returns bytes written or -1
+   ssize_t writevFD(const struct iovec *iov, int iovcnt);
+
    // Basic read function to read all string data off the FD
    ssize_t readFD(std::string &buf);
 
@@ -69,60 +78,52 @@ public:
       int datasize = sizeof(T);
       int bufsize = datasize * n;
 
-      unsigned char *bytebuf = new unsigned char[bufsize];
-
-      buf.clear();
+      // Read straight into the vector's storage (keeps its capacity between calls)
+      buf.resize(n);
 
       int results;
-      if ((results = read(_fd, bytebuf, bufsize)) < 0)
+      if ((results = read(_fd, buf.data(), bufsize)) < 0)
       {
-         delete bytebuf;
+         buf.clear();
          return -1;
       }
 
-      if (results < bufsize) {
-         if (results % datasize != 0) {
-            delete bytebuf;
-            return -2;
-         }
-      }
-
-      unsigned int read_units = results / datasize;
-      buf.reserve(read_units);
-      for (unsigned int i=0; i< read_units; i++) {
-         buf.push_back((T) bytebuf[i*datasize]);
+      if (results % datasize != 0) {
+         buf.clear();
+         return -2;
       }
 
-      delete bytebuf;
+      buf.resize(results / datasize);
       return buf.size();
    }
 
    /*****************************************************************************************
     * writeBytes - Template method--takes a STL vector object of type T and writes raw bytes to
-    *              the FD
+    *              the FD. Keeps writing after a short write until the whole vector is out
     *
     *    Params:  buf - the STL vector to store the bytes
     *
-    *    Returns: number of bytes read, or -1 for read error, -2 if not enough bytes
-    *             were available to fill a complete set of size T variables
+    *    Returns: number of bytes written, or -1 for write error (including EAGAIN on a
+    *             non-blocking FD--use an outbound queue for those)
     *
     *****************************************************************************************/
 
    template <typename T>
    int writeBytes(std::vector<T> &buf) {
-      int datasize = sizeof(T);
-      int bufsize = datasize * buf.size();
-
-      unsigned char *bytebuf = new unsigned char[bufsize];
-      for (unsigned int i=0; i<buf.size(); i++) {
-         memcpy(&bytebuf[i*datasize], &buf[i], sizeof(T));
+      size_t bufsize = sizeof(T) * buf.size();
+      const uint8_t *ptr = (const uint8_t *) buf.data();
+      size_t written = 0;
+
+      while (written < bufsize) {
+         ssize_t results = write(_fd, ptr + written, bufsize - written);
+         if (results < 0) {
+            if (errno == EINTR)
+               continue;
+            return -1;
+         }
+         written += results;
       }
-
-      int results;
-      results = write(_fd, bytebuf, bufsize);
-      delete bytebuf;
-      return results;
-
+      return written;
    }
 
 
@@ -152,6 +153,14 @@ public:
    // Sets this address to reusable to prevent problems when sockets don't shut down properly
    void setReusable();
 
+   // Reads up to max bytes that are already waiting straight into the free space of buf.
+   // Never blocks, even on a blocking socket. Returns bytes read, 0 if the other side
+   // closed, -1 on error (errno EAGAIN/EWOULDBLOCK if nothing was waiting)
+   ssize_t readInto(ByteBuffer &buf, size_t max);
+
+   // writevFD for sockets, but a closed connection returns EPIPE instead of raising SIGPIPE
+   ssize_t sendvFD(const struct iovec *iov, int iovcnt);
+
    unsigned long getIPAddr();  // Gets IP in big endian (network) format
    void getIPAddrStr(std::string &buf); // The IP string associated with this socket
    unsigned short getPort();   // Port in little-endian (host) format
@@ -193,6 +202,16 @@ public:
 
    bool openFile(fd_file_type ftype, bool create = false);
 
+   // Maps the whole open file read-only. With sequential, the kernel is told it will be
+   // read front to back (read ahead further, drop pages behind). Returns NULL if the file
+   // is empty (len = 0) or can't be mapped (len = its size)
+   const uint8_t *mapFile(size_t &len, bool sequential = true);
+   static void unmapFile(const uint8_t *data, size_t len);
+
+   // Tells the kernel a part of a mapping won't be read again, so its pages can go. Only
+   // whole pages inside [data, data + len) are released
+   static void releaseMapped(const uint8_t *data, size_t len);
+
 private:
    std::string _filename; 
 };
@@ -0,0 +1,79 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Wire format version. Frames with any other version are rejected
+const uint8_t frame_version = 1;
+
+// Size of the fixed header in front of every payload
+const size_t frame_header_size = 12;
+
+// Largest payload a peer will accept in one frame
+const uint32_t max_frame_payload = 64 * 1024 * 1024;
+
+// Any frame type: the checksum field is unused (0) because the payload carries its own
+// integrity check. Lets a payload be sent while it is still being produced
+const uint16_t frame_flag_nocrc = 0x8000;
+
+// f_rep flags: the payload is <IV><AES-GCM ciphertext><tag>
+const uint16_t frame_flag_gcm = 0x0001;
+
+// f_sid flags: what the sending server can handle. Each side only uses what both support
+const uint16_t cap_plot_codec = 0x0001;      // PlotCodec encoded batches
+const uint16_t cap_compress = 0x0002;        // Compressor packed batches (built-in IDs)
+const uint16_t cap_sync = 0x0004;            // SyncMsg anti-entropy exchange
+const uint16_t cap_snapshot = 0x0008;        // SyncMsg snapshot bootstrap
+const uint16_t local_caps = cap_plot_codec | cap_compress | cap_sync | cap_snapshot;
+
+/***************************************************************************************
+ * Frame - the message format between replication servers. Every message is a fixed
+ *         12-byte header followed by the payload. Multi-byte fields are network order.
+ *
+ *            offset 0  version  (1 byte)
+ *                   1  type     (1 byte)  - one of frame_type
+ *                   2  flags    (2 bytes) - per type (frame_flag_gcm on f_rep, capability
+ *                                                bits on f_sid), else 0
+ *                   4  length   (4 bytes) - payload bytes following the header
+ *                   8  checksum (4 bytes) - CRC32 of the payload (0 with frame_flag_nocrc)
+ *
+ *         The header is enough to tell how much more data is needed, so a receive buffer
+ *         can be parsed one frame at a time as data arrives, without scanning the payload.
+ ***************************************************************************************/
+class Frame
+{
+public:
+   enum frame_type { f_sid = 1, f_auth = 2, f_rep = 3, f_ack = 4 };
+
+   Frame();
+
+   // Fills in a frame_header_size header for the payload, for sending header and payload
+   // from separate buffers. With frame_flag_nocrc the payload isn't read and can be NULL
+   static void encodeHeader(uint8_t *hdr, uint8_t type, const uint8_t *payload, size_t len,
+                                                                       uint16_t flags = 0);
+
+   // Appends a complete frame (header + payload) to the end of out
+   static void append(std::vector<uint8_t> &out, uint8_t type, const uint8_t *payload,
+                                                   size_t len, uint16_t flags = 0);
+   static void append(std::vector<uint8_t> &out, uint8_t type,
+                                    const std::vector<uint8_t> &payload, uint16_t flags = 0);
+
+   // Reads the header at the front of data. Returns 1 if the whole frame is there (and the
+   // checksum matches), 0 if more data is needed, -1 if the data is not a valid frame
+   int parse(const uint8_t *data, size_t len);
+
+   // Header + payload size of the parsed frame
+   size_t getSize() { return frame_header_size + length; };
+
+   static uint32_t crc32(const uint8_t *data, size_t len);
+
+   uint8_t version;
+   uint8_t type;
+   uint16_t flags;
+   uint32_t length;
+   uint32_t checksum;
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef LZCOMPRESSOR_H
+#define LZCOMPRESSOR_H
+
+#include "Compressor.h"
+
+/******************************************************************************************
+ * LZCompressor - built-in LZ77 compressor in the style of an LZ4 block. Fast enough to run
+ *                on every batch, with no library dependency.
+ *
+ *                The output is a series of sequences:
+ *
+ *                   token     (1 byte)  - high nibble literal count, low nibble match
+ *                                         length - 4 (15 in a nibble = more length bytes
+ *                                         follow, each added on until one is < 255)
+ *                   literals
+ *                   offset    (2 bytes, little endian) - how far back the match starts
+ *
+ *                The last sequence is literals only and has no offset.
+ *****************************************************************************************/
+
+class LZCompressor : public Compressor {
+   public:
+      LZCompressor();
+      virtual ~LZCompressor();
+
+      virtual uint8_t getID() { return c_lz; };
+      virtual const char *getName() { return "lz"; };
+
+      virtual void compress(const uint8_t *data, size_t len, std::vector<uint8_t> &out);
+      virtual bool decompress(const uint8_t *data, size_t len, std::vector<uint8_t> &out);
+
+   private:
+
+      static void putLength(std::vector<uint8_t> &out, size_t len);
+      static bool getLength(const uint8_t *&ptr, const uint8_t *end, size_t &len);
+
+      // Positions of recently seen 4-byte sequences, indexed by their hash
+      std::vector<uint32_t> _table;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef PLOTCODEC_H
+#define PLOTCODEC_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "DronePlotDB.h"
+
+// First bytes of an encoded batch. Read as the little-endian plot count of a raw batch it
+// would be over 20 million plots, more than a frame can hold, so the formats can't be confused
+const uint8_t plot_codec_magic[] = { 'D', 'P', 'C' };
+const uint8_t plot_codec_version = 1;
+
+// Coordinates are sent as integer multiples of this (degrees) when that is lossless
+const double plot_codec_scale = 1e7;
+
+/***************************************************************************************
+ * PlotCodec - compact encoding for a batch of replicated plots. The plots are sorted by
+ *             (drone_id, timestamp) so neighbouring rows are close together, then each
+ *             column is written in turn as deltas from the row before:
+ *
+ *                "DPC" version  (4 bytes)
+ *                flags          (1 byte)  - codec_fixed_coords
+ *                count          (varint)
+ *                drone_id, node_id, timestamp columns  (zigzag varint deltas)
+ *                latitude, longitude columns           (zigzag varint deltas of the value
+ *                                                       times plot_codec_scale, or the raw
+ *                                                       4-byte floats if any value in the
+ *                                                       batch would not survive the trip)
+ *
+ *             A drone reporting once a second turns 28 bytes a plot into roughly 6.
+ ***************************************************************************************/
+class PlotCodec
+{
+public:
+   enum codec_flags { codec_fixed_coords = 0x01 };
+
+   // Encodes the plots onto the end of out. Sorts plots by (drone_id, timestamp)
+   static void encode(std::vector<DronePlot> &plots, std::vector<uint8_t> &out);
+
+   // Decodes an encoded batch, appending the plots. Throws runtime_error if the data is
+   // truncated or not an encoded batch
+   static void decode(const uint8_t *data, size_t len, std::vector<DronePlot> &plots);
+
+   // True if the data starts with the codec's magic bytes and version
+   static bool isEncoded(const uint8_t *data, size_t len);
+
+private:
+   static void putVarint(std::vector<uint8_t> &out, uint64_t val);
+   static uint64_t getVarint(const uint8_t *&ptr, const uint8_t *end);
+
+   static uint64_t zigzag(int64_t val) { return ((uint64_t) val << 1) ^ (uint64_t) (val >> 63); };
+   static int64_t unzigzag(uint64_t val) { return (int64_t) (val >> 1) ^ -(int64_t) (val & 1); };
+
+   // Fixed-point form of a coordinate, false if it would not decode to the same float
+   static bool toFixed(float coord, int64_t &fixed);
+   static float fromFixed(int64_t fixed) { return (float) (fixed / plot_codec_scale); };
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef PLOTFILE_H
+#define PLOTFILE_H
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <ctime>
+#include "FileDesc.h"
+
+class DronePlot;
+class PlotStore;
+
+// Plots per block unless the writer asks for something else
+const size_t plot_file_block = 4096;
+
+// Pass as the drone to query for every drone
+const unsigned int all_drones = std::numeric_limits<unsigned int>::max();
+
+/***************************************************************************************
+ * PlotFile - the self-describing container format for files of drone plots (.bin).
+ *
+ *            Plots are written in blocks of up to block_plots, each block laid out in
+ *            columns. An index of the blocks--where each one is, its CRC, and the range
+ *            of timestamps and drone_ids in it--goes at the end, found through a fixed-
+ *            size footer. A reader maps the file, reads the index and only touches the
+ *            blocks a query could match, so a time or drone range can be pulled out of a
+ *            large archive without loading the rest, and blocks can be decoded in
+ *            parallel. Everything is little-endian with a fixed-width timestamp, so files
+ *            move between hosts.
+ *
+ *            Layout:
+ *
+ *               header   "DPLT" (4), version (2), field count (2), block plots (4),
+ *                        reserved (4)
+ *               schema   per field: name (6, NUL padded), type (1), width (1)
+ *               blocks   per block, each field's column in schema order
+ *               index    per block: offset (8), count (4), CRC32 (4), min/max timestamp
+ *                        (8 each), min/max drone_id (4 each)
+ *               footer   index offset (8), block count (4), CRC32 of the index (4),
+ *                        "DPLE" (4)
+ *
+ *            Readers find the columns they know by name and skip any they don't, so
+ *            fields can be added later without breaking old readers.
+ *
+ *            Files from before this format (plots back to back in DronePlot::serialize
+ *            order) don't start with the magic; open returns false for them and
+ *            DronePlotDB::loadBinaryFile falls back to reading them the old way.
+ ***************************************************************************************/
+class PlotFile
+{
+public:
+   // What the index knows about one block
+   struct block_info
+   {
+      uint64_t offset;
+      uint32_t count;
+      uint32_t crc;
+      time_t min_time, max_time;
+      unsigned int min_drone, max_drone;
+   };
+
+   PlotFile(const char *filename);
+   ~PlotFile();
+
+   // Writing: create the file, add the plots, then finish to write the last block, the
+   // index and the footer. create returns false if the file can't be opened; addPlot and
+   // finish throw runtime_error if a write fails
+   bool create(size_t block_plots = plot_file_block);
+   void addPlot(DronePlot &plot);
+   void finish();
+
+   // Reading: maps the file and reads the index. Returns false if the file can't be
+   // opened or isn't in this format. Throws runtime_error if it is, but is damaged
+   bool open(bool sequential = false);
+   void close();
+
+   // Quick check for the magic bytes
+   static bool isPlotFile(const uint8_t *data, size_t len);
+
+   size_t numBlocks() { return _blocks.size(); };
+   const block_info &getBlock(size_t i) { return _blocks[i]; };
+   uint64_t numPlots() { return _num_plots; };
+
+   // Decodes one block, appending its plots. Throws runtime_error if its CRC doesn't match
+   void readBlock(size_t i, std::vector<DronePlot> &plots);
+
+   // Appends the numbers of the blocks whose ranges overlap the query to blocks, from the
+   // index alone. Returns how many plots they hold
+   size_t findBlocks(time_t t_begin, time_t t_end, std::vector<size_t> &blocks,
+                                                      unsigned int drone_id = all_drones);
+
+   // Appends the plots with t_begin <= timestamp <= t_end (of one drone, or all_drones) in
+   // file order, decoding only the blocks whose ranges overlap, across up to max_threads
+   // threads (0 = one per core). Returns the number of plots found
+   size_t query(time_t t_begin, time_t t_end, std::vector<DronePlot> &plots,
+                      unsigned int drone_id = all_drones, unsigned int max_threads = 0);
+
+   // Decodes every plot straight into numPlots() store rows from first_slot on (set aside
+   // with PlotStore::extend), numbering their LSNs from first_lsn, without building
+   // DronePlots. Throws runtime_error if a block is corrupt
+   void loadInto(PlotStore &store, size_t first_slot, uint64_t first_lsn,
+                                                              unsigned int max_threads = 0);
+
+private:
+   // One column of the schema as found in the file
+   struct field_info
+   {
+      std::string name;
+      uint8_t type;
+      uint8_t width;
+      size_t column;       // Offset of the column within a block, per plot of the block
+   };
+
+   struct decode_job;
+
+   void flushBlock();
+   const uint8_t *checkBlock(size_t i);
+   void decodeBlock(size_t i, std::vector<DronePlot> &plots, time_t t_begin, time_t t_end,
+                                                             unsigned int drone_id);
+   void fillBlock(size_t i, PlotStore &store, size_t first_slot, uint64_t first_lsn);
+
+   void runJobs(std::vector<decode_job> &jobs, const std::vector<size_t> &blocks);
+   static void *t_decode(void *data);
+
+   std::string _filename;
+   FileFD _file;
+
+   // Writing
+   bool _writing;
+   size_t _block_plots;
+   std::vector<DronePlot> _block;
+   std::vector<uint8_t> _index;
+   uint64_t _write_pos;
+
+   // Reading
+   const uint8_t *_data;
+   size_t _len;
+   size_t _row_width;
+   std::vector<field_info> _fields;
+   int _drone_col, _node_col, _time_col, _lat_col, _lon_col;   // Index into _fields
+
+   std::vector<block_info> _blocks;
+   uint64_t _num_plots;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef PLOTHASHTREE_H
+#define PLOTHASHTREE_H
+
+#include <vector>
+#include <map>
+#include <limits>
+#include <cstdint>
+#include <ctime>
+
+// Width of the time buckets the tree's leaves cover, in plot timestamp seconds
+const time_t sync_bucket_secs = 300;
+
+// One node of the tree: the sum of the hashes of the plots under it, and how many there are.
+// At the drone level bucket is unused (0)
+struct sync_entry
+{
+   unsigned int drone_id;
+   time_t bucket;          // First timestamp in the bucket
+   uint64_t hash;
+   uint32_t count;
+};
+
+/***************************************************************************************
+ * PlotHashTree - a three-level hash tree over a plot database for anti-entropy sync:
+ *
+ *                   root -> drone_id -> time bucket (sync_bucket_secs wide) -> plots
+ *
+ *                Each node holds the sum (mod 2^64) of the hashes of the plots beneath
+ *                it, plus a count. Sums don't depend on the order plots arrived in, and
+ *                adding or removing a plot is an update of three sums instead of a rehash,
+ *                so the tree is kept current as the database changes.
+ *
+ *                Two databases holding the same plots have the same root. Where they
+ *                differ, comparing the drone sums and then the bucket sums of the drones
+ *                that differ narrows it down to the buckets that need to be exchanged.
+ *                The sums can be limited to buckets that start before a given time, to
+ *                leave out ones that are still filling up.
+ *
+ *                Not thread-safe--DronePlotDB is responsible for locking.
+ ***************************************************************************************/
+class PlotHashTree
+{
+public:
+   PlotHashTree();
+   ~PlotHashTree();
+
+   // Hash of one plot's contents (not its flags or LSN)
+   static uint64_t plotHash(unsigned int drone_id, unsigned int node_id, time_t timestamp,
+                                                            float latitude, float longitude);
+
+   // The bucket a timestamp falls in
+   static time_t getBucket(time_t timestamp);
+
+   // Adds or subtracts a plot, given its drone, timestamp and plotHash
+   void add(unsigned int drone_id, time_t timestamp, uint64_t hash);
+   void remove(unsigned int drone_id, time_t timestamp, uint64_t hash);
+
+   uint64_t getRootHash() { return _root_hash; };
+   uint32_t getRootCount() { return _root_count; };
+
+   // Appends the per-drone sums over the buckets that start before the given time, in
+   // drone_id order. Drones with no plots that old are left out
+   void getDroneSums(std::vector<sync_entry> &entries,
+                           time_t before = std::numeric_limits<time_t>::max());
+
+   // Appends the per-bucket sums of one drone, in bucket order
+   void getBucketSums(unsigned int drone_id, std::vector<sync_entry> &entries,
+                           time_t before = std::numeric_limits<time_t>::max());
+
+   void clear();
+
+private:
+   struct bucket_sum {
+      uint64_t hash = 0;
+      uint32_t count = 0;
+   };
+
+   struct drone_sum {
+      uint64_t hash = 0;
+      uint32_t count = 0;
+      std::map<time_t, bucket_sum> buckets;
+   };
+
+   uint64_t _root_hash;
+   uint32_t _root_count;
+
+   std::map<unsigned int, drone_sum> _drones;
+};
+
+#endif
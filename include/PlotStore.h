@@ -0,0 +1,209 @@
+#ifndef PLOTSTORE_H
+#define PLOTSTORE_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <iterator>
+#include <cstdint>
+#include <ctime>
+
+class DronePlot;
+
+// Number of plots stored in each fixed-size column chunk. Chunks are never reallocated
+// once created, so references into a chunk stay valid while new plots are appended.
+const size_t plot_chunk_size = 4096;
+
+/***************************************************************************************
+ * PlotChunk - a fixed-size block of drone plots stored as separate columns, so a scan
+ *             over one attribute (timestamps, flags) walks contiguous memory
+ ***************************************************************************************/
+struct PlotChunk
+{
+   unsigned int drone_id[plot_chunk_size];
+   unsigned int node_id[plot_chunk_size];
+   time_t timestamp[plot_chunk_size];
+   float latitude[plot_chunk_size];
+   float longitude[plot_chunk_size];
+   unsigned short flags[plot_chunk_size];
+   uint64_t lsn[plot_chunk_size];
+};
+
+/***************************************************************************************
+ * PlotRef - a handle to one row in a PlotStore. The attributes are references into the
+ *           column chunk, so code written against a DronePlot (ptr->timestamp += 3,
+ *           ptr->setFlags(DBFLAG_NEW)) modifies the stored plot directly.
+ ***************************************************************************************/
+class PlotRef
+{
+public:
+   PlotRef(PlotChunk &chunk, size_t offset);
+
+   // Same flag interface as DronePlot
+   void setFlags(unsigned short flags) { _flags |= flags; };
+   void clrFlags(unsigned short flags) { _flags &= ~flags; };
+   bool isFlagSet(unsigned short flags) { return (bool) (_flags & flags); };
+   unsigned short getFlags() { return _flags; };
+
+   // Log sequence number assigned when the plot was added to the database
+   uint64_t getLSN() { return _lsn; };
+
+   // Convenience functions that go through a DronePlot copy of this row
+   void serialize(std::vector<uint8_t> &buf);
+   void writeCSV(std::string &buf);
+
+   // Copies this row out to a DronePlot object or overwrites the row from one
+   void getPlot(DronePlot &plot);
+   void assign(DronePlot &plot);
+
+   unsigned int &drone_id;
+   unsigned int &node_id;
+   time_t &timestamp;
+   float &latitude;
+   float &longitude;
+
+private:
+   unsigned short &_flags;
+   uint64_t &_lsn;
+};
+
+/***************************************************************************************
+ * PlotStore - columnar storage engine for drone plots. Plots live in a list of fixed-size
+ *             PlotChunk blocks and are addressed by an absolute slot number that does not
+ *             change when plots are removed from the front (popFront). Functions that
+ *             reorder or compact the rows (sortByTime, erase, removeIf) do renumber slots.
+ *
+ *             Not thread-safe--DronePlotDB is responsible for locking.
+ ***************************************************************************************/
+class PlotStore
+{
+public:
+   PlotStore();
+   ~PlotStore();
+
+   /************************************************************************************
+    * iterator - random-access iterator over the live rows of the store. Dereferencing
+    *            returns a PlotRef by value and operator-> hands back a proxy, so it can
+    *            be used like the std::list<DronePlot>::iterator it replaces.
+    ************************************************************************************/
+   class iterator
+   {
+   public:
+      typedef std::random_access_iterator_tag iterator_category;
+      typedef PlotRef value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef PlotRef reference;
+
+      // Keeps the PlotRef alive long enough for the -> chain to resolve
+      class pointer
+      {
+      public:
+         pointer(PlotRef ref):_ref(ref) {};
+         PlotRef *operator->() { return &_ref; };
+      private:
+         PlotRef _ref;
+      };
+
+      iterator():_store(NULL), _slot(0) {};
+      iterator(PlotStore *store, size_t slot):_store(store), _slot(slot) {};
+
+      PlotRef operator*() const { return _store->at(_slot); };
+      pointer operator->() const { return pointer(_store->at(_slot)); };
+
+      iterator &operator++() { _slot++; return *this; };
+      iterator operator++(int) { iterator tmp = *this; _slot++; return tmp; };
+      iterator &operator--() { _slot--; return *this; };
+      iterator operator--(int) { iterator tmp = *this; _slot--; return tmp; };
+      iterator &operator+=(difference_type n) { _slot += n; return *this; };
+      iterator &operator-=(difference_type n) { _slot -= n; return *this; };
+      iterator operator+(difference_type n) const { return iterator(_store, _slot + n); };
+      iterator operator-(difference_type n) const { return iterator(_store, _slot - n); };
+      difference_type operator-(const iterator &other) const { return _slot - other._slot; };
+
+      bool operator==(const iterator &other) const { return _slot == other._slot; };
+      bool operator!=(const iterator &other) const { return _slot != other._slot; };
+      bool operator<(const iterator &other) const { return _slot < other._slot; };
+
+      // The absolute slot this iterator points to
+      size_t getSlot() const { return _slot; };
+
+   private:
+      PlotStore *_store;
+      size_t _slot;
+   };
+
+   // Adds a plot at the end of the store, returns the slot it was placed in
+   size_t append(unsigned int drone_id, unsigned int node_id, time_t timestamp, float latitude,
+                           float longitude, unsigned short flags = 0, uint64_t lsn = 0);
+   size_t append(DronePlot &plot, uint64_t lsn = 0);
+
+   // Adds count rows at the end for the caller to fill in through the columns (bulk loads).
+   // Returns the slot of the first one
+   size_t extend(size_t count);
+
+   // Drops every row from new_tail on, e.g. rows from extend that couldn't be filled
+   void truncate(size_t new_tail);
+
+   // Access a single row by absolute slot number
+   PlotRef at(size_t slot);
+
+   // Iterators over the live rows
+   iterator begin() { return iterator(this, _head); };
+   iterator end() { return iterator(this, _tail); };
+
+   // Slot numbers of the first live row and one past the last row
+   size_t firstSlot() { return _head; };
+   size_t endSlot() { return _tail; };
+
+   // Removes the oldest row. Releases its chunk once the chunk has been fully consumed
+   void popFront();
+
+   // Removes the row at the slot, shifting all later rows down by one (linear time)
+   void erase(size_t slot);
+
+   // Removes every row the predicate returns true for in a single compacting pass
+   template <typename Pred>
+   size_t removeIf(Pred pred) {
+      size_t dst = _head;
+      for (size_t src = _head; src < _tail; src++) {
+         PlotRef row = at(src);
+         if (pred(row))
+            continue;
+         if (dst != src)
+            copySlot(src, dst);
+         dst++;
+      }
+      size_t removed = _tail - dst;
+      truncate(dst);
+      return removed;
+   }
+
+   // Stable sort of all rows by timestamp
+   void sortByTime();
+
+   // Number of plots stored
+   size_t size() { return _tail - _head; };
+
+   void clear();
+
+   // Chunk-level access for scans that want to run straight down the columns. The
+   // begin/end offsets are the range of live rows within chunk i
+   size_t numChunks() { return _chunks.size(); };
+   PlotChunk &getChunk(size_t i) { return *_chunks[i]; };
+   void getChunkRange(size_t i, size_t &begin_off, size_t &end_off);
+
+   // The chunk holding a slot. The row is at offset slot % plot_chunk_size within it
+   PlotChunk &chunkFor(size_t slot) { return *_chunks[(slot - _base) / plot_chunk_size]; };
+
+private:
+
+   void copySlot(size_t src, size_t dst);
+
+   std::vector<std::unique_ptr<PlotChunk>> _chunks;
+
+   size_t _base;   // Absolute slot of the first row of _chunks[0]
+   size_t _head;   // Absolute slot of the first live row
+   size_t _tail;   // One past the last live row
+};
+
+#endif
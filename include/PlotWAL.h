@@ -0,0 +1,132 @@
+#ifndef PLOTWAL_H
+#define PLOTWAL_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include <pthread.h>
+
+class DronePlot;
+class DronePlotDB;
+
+// Group commit: plots waiting to be logged are written and fsync'd together at most this
+// often, or as soon as this many bytes are waiting
+const unsigned int wal_commit_ms = 20;
+const size_t wal_commit_bytes = 1 << 20;
+
+// A checkpoint is taken once this many plots have been logged since the last one, or this
+// long after the last one if any have
+const uint64_t wal_checkpoint_plots = 1000000;
+const time_t wal_checkpoint_secs = 300;
+
+// After a failed write, a checkpoint is tried at most this often until one succeeds
+const time_t wal_retry_secs = 1;
+
+/***************************************************************************************
+ * PlotWAL - write-ahead log and checkpoints that make a DronePlotDB durable, so a server
+ *           that crashes or is restarted comes back up with the plots it had.
+ *
+ *           Every plot added to the attached database is appended to the log. Appends
+ *           only queue the plot; a commit thread writes everything queued as one block
+ *           and fsyncs it (group commit), so the cost of the sync is shared by all the
+ *           plots that arrived in the meantime. If a commit fails, a checkpoint is taken
+ *           in its place, since it writes out everything; until one succeeds, nothing
+ *           after the failed block counts as being on disk.
+ *
+ *           The log is split into numbered segments. A checkpoint copies the whole
+ *           database out and, while it is still locked, starts a new segment, then
+ *           writes the copy to checkpoint.<segment>. Recovery loads the newest good
+ *           checkpoint and replays only the segments from its number on, so restart time
+ *           depends on how much was logged since the last checkpoint, not on how many
+ *           plots there are. Older segments and checkpoints are deleted once a newer
+ *           checkpoint is on disk.
+ *
+ *           Files (multi-byte fields in host order, like the old headerless .bin files):
+ *
+ *              wal.<segment>          "PWAL" version (8 bytes), then blocks of:
+ *                                        length (4), CRC32 of the plots (4), plots
+ *              checkpoint.<segment>   "PCKP" version (8 bytes), segment (8), count (8),
+ *                                     the plots in DronePlot::serialize order, their flags
+ *                                     (2 bytes each), CRC32 of everything before it (4)
+ *
+ *           A log plot is the same serialize order followed by its flags. A block cut
+ *           short by a crash fails its length or CRC check and ends the replay of that
+ *           segment.
+ *
+ *           Only additions are logged. Removals take effect on disk at the next
+ *           checkpoint, which DronePlotDB asks for whenever it removes plots.
+ ***************************************************************************************/
+class PlotWAL
+{
+public:
+   PlotWAL(const char *dir, unsigned int verbosity = 0);
+   ~PlotWAL();
+
+   // Loads the newest checkpoint and replays the log after it into the db. Call before
+   // start. Returns the number of plots recovered. Throws runtime_error if the directory
+   // can't be created or read
+   size_t recover(DronePlotDB &db);
+
+   // Opens a new segment, attaches to the db and starts the commit thread
+   void start(DronePlotDB &db);
+
+   // Commits what is waiting, takes a final checkpoint, stops the commit thread and
+   // detaches from the db. Call once nothing else is adding plots
+   void stop();
+
+   // Queues a plot for the next commit. Called by DronePlotDB with its mutex locked
+   void append(DronePlot &plot);
+
+   // Has the commit thread take a checkpoint soon
+   void requestCheckpoint();
+
+   // Ends the current segment and returns the number of the next one. Called by
+   // DronePlotDB::checkpointPlots with its mutex locked, so the copy it makes holds
+   // exactly the plots logged to the earlier segments
+   uint64_t rotate();
+
+private:
+   static void *t_commit(void *data);
+   void commitLoop();
+
+   void checkpoint();
+
+   // File helpers. writeBlock and writeCheckpoint throw runtime_error if the disk write fails
+   bool openSegment(uint64_t segment);
+   void writeBlock(std::vector<uint8_t> &plots);
+   void writeCheckpoint(uint64_t segment, std::vector<DronePlot> &plots);
+   bool loadCheckpoint(uint64_t segment, DronePlotDB &db, size_t &count);
+   size_t replaySegment(uint64_t segment, DronePlotDB &db);
+   void listFiles(std::vector<uint64_t> &segments, std::vector<uint64_t> &checkpoints);
+   void removeBefore(uint64_t segment);
+   std::string getPath(const char *prefix, uint64_t segment);
+   void syncDir();
+
+   std::string _dir;
+   unsigned int _verbosity;
+
+   DronePlotDB *_db;
+
+   int _fd;                         // Current segment
+   uint64_t _segment;
+
+   std::vector<uint8_t> _pending;   // Plots waiting for the next commit
+   std::vector<uint8_t> _carry;     // Plots appended before a rotate, still for the old segment
+   uint64_t _appended;              // Plots appended since start
+   uint64_t _carry_through;         // _appended when rotate was called
+   uint64_t _durable;               // Plots appended since start that are on disk
+   bool _write_failed;              // A commit failed and no checkpoint has covered it yet
+
+   uint64_t _since_checkpoint;      // Plots committed since the last checkpoint
+   time_t _last_checkpoint;
+   bool _checkpoint_wanted;
+   bool _stop;
+
+   bool _running;
+   pthread_t _thread;
+   pthread_mutex_t _mutex;
+   pthread_cond_t _wake;            // Wakes the commit thread early
+};
+
+#endif
@@ -3,8 +3,23 @@
 
 #include <queue>
 #include <vector>
+#include <map>
 #include <crypto++/secblock.h>
 #include "TCPServer.h"
+#include "Compressor.h"
+
+// A peer whose connection has this many bytes queued that the socket hasn't taken yet gets
+// no new batches until it drains
+const size_t max_pending_output = 4 * 1024 * 1024;
+
+// Batches smaller than this aren't worth compressing, and a compressed batch has to come in
+// under this fraction of the original to be sent compressed
+const size_t compress_min_bytes = 256;
+const double compress_max_ratio = 0.9;
+
+// After this many poor results in a row, compression is skipped for compress_backoff batches
+const unsigned int compress_poor_limit = 4;
+const unsigned int compress_backoff = 16;
 
 /*******************************************************************************************
  * QueueMgr - Child class of the TCPServer object, manages a Queue for a middleware/app
@@ -35,9 +50,45 @@ public:
    // Pops a received queue element off the queue
    bool pop(std::string &sid, std::vector<uint8_t> &data);
 
-   // Loads replication information into the Queue to transmit to servers
-   void sendToAll(std::vector<uint8_t> &data);
-   void sendToServer(const char *server_id, std::vector<uint8_t> &data);
+   // Loads replication information into the Queue to transmit to servers. A non-zero
+   // batch_lsn puts the peer's cursor on hold until the batch is acknowledged. sendToAll
+   // compresses once for all the peers that take compressed batches. A shared_batch is queued
+   // as-is, so one batch sent to several peers is held in memory once. The vector forms take
+   // the data over rather than copying it
+   void sendToAll(std::vector<uint8_t> &&data);
+   void sendToServer(const char *server_id, shared_batch data, uint64_t batch_lsn = 0);
+   void sendToServer(const char *server_id, std::vector<uint8_t> &&data, uint64_t batch_lsn = 0);
+
+   // Per-peer replication cursors. getPeerCursor returns false while a batch is still in
+   // flight to that peer. skipToLSN moves the cursor past LSNs with nothing to send,
+   // rewindCursor moves it back to re-send from an earlier LSN (both no-ops while in flight)
+   const char *getPeerID(unsigned int i) { return std::get<0>(_server_list[i]).c_str(); };
+   bool getPeerCursor(const char *server_id, uint64_t &lsn);
+   void skipToLSN(const char *server_id, uint64_t lsn);
+   bool rewindCursor(const char *server_id, uint64_t lsn);
+
+   // True if the connection to the peer is backed up past max_pending_output
+   bool isBackpressured(const char *server_id);
+
+   // Capability bits (cap_*) both we and the peer support, learned from the last
+   // authenticated connection with it. 0 until we've talked to the peer
+   uint16_t getPeerCaps(const char *server_id) { return _cursors[server_id].caps; };
+
+   // Records batch acks and failures, then calls the parent function
+   virtual void handleConnections();
+
+   // Keep one authenticated connection open per peer and send batches over it
+   void setPersistent(bool persistent) { _persistent = persistent; };
+
+   // Compression stage for outgoing batches (built-in LZ by default, NULL turns it off).
+   // packBatch replaces data with the compressed batch and returns true, or leaves it
+   // alone if it is small or doesn't compress well. The two-buffer form leaves data as it
+   // is and fills packed instead, for when both forms get sent. Call it once per batch,
+   // before sendToServer for each peer whose caps include cap_compress
+   void setCompressor(std::unique_ptr<Compressor> comp) { _compressor = std::move(comp); };
+   bool packBatch(std::vector<uint8_t> &data);
+   bool packBatch(const std::vector<uint8_t> &data, std::vector<uint8_t> &packed);
+   void logCompressionStats();
    
    // Overload simply to remove this server from _server_list. Calls parent funct
    void bindSvr(const char *ip_addr, unsigned short port);
@@ -58,21 +109,41 @@ public:
 private:
 
    // Launches a connection to the other server from queue data
-   void launchDataConn(const char *sid, std::vector<uint8_t> &data);
+   void launchDataConn(const char *sid, shared_batch data, uint64_t batch_lsn);
 
    // Loads server information from servers.txt
    int loadServerList(const char *filename);
 
-   // Set up our types for managing our queue
+   // Set up our types for managing our queue. Received data is moved in and out, outgoing
+   // batches are shared, and elements can't be copied so neither is by accident
    enum qe_type {send, recv};
    struct queue_element {
 
-      queue_element(qe_type in_type, const char *in_sid, std::vector<uint8_t> &in_data)
-                  : type(in_type), server_id(in_sid), data(in_data) {}
+      queue_element(qe_type in_type, const char *in_sid, std::vector<uint8_t> &&in_data)
+                  : type(in_type), server_id(in_sid), data(std::move(in_data)), batch_lsn(0) {}
+      queue_element(qe_type in_type, const char *in_sid, shared_batch in_batch,
+                    uint64_t in_lsn = 0)
+                  : type(in_type), server_id(in_sid), batch(std::move(in_batch)),
+                    batch_lsn(in_lsn) {}
+
+      queue_element(const queue_element &) = delete;
+      queue_element &operator=(const queue_element &) = delete;
+      queue_element(queue_element &&) = default;
+      queue_element &operator=(queue_element &&) = default;
 
       qe_type type;
       std::string server_id;
-      std::vector<uint8_t> data;
+      std::vector<uint8_t> data;    // recv
+      shared_batch batch;           // send
+      uint64_t batch_lsn;
+   };
+
+   // How far replication to one peer has gotten
+   struct peer_cursor {
+      uint64_t acked_lsn = 0;    // The peer has ACK'd every plot up to this LSN
+      uint64_t sent_lsn = 0;     // Highest LSN in the batch waiting on an ACK
+      bool in_flight = false;
+      uint16_t caps = 0;         // Negotiated capabilities
    };
 
    std::string _server_ID;
@@ -81,6 +152,18 @@ private:
    std::queue<queue_element> _queue;
 
    std::vector<std::tuple<std::string, unsigned long, unsigned short>> _server_list;  
+
+   // Replication cursors by server ID
+   std::map<std::string, peer_cursor> _cursors;
+
+   bool _persistent = false;
+
+   std::unique_ptr<Compressor> _compressor;
+   unsigned int _compress_poor = 0;   // Poor results in a row
+   unsigned int _compress_skip = 0;   // Batches left to send without trying
+   uint64_t _compress_in = 0;         // Bytes before and after compression, for the stats
+   uint64_t _compress_out = 0;
+   unsigned int _compress_skipped = 0;
 };
 
 
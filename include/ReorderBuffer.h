@@ -0,0 +1,79 @@
+#ifndef REORDERBUFFER_H
+#define REORDERBUFFER_H
+
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include "DronePlotDB.h"
+
+/***************************************************************************************
+ * ReorderBuffer - turns plots that arrive out of order (our own as they are sighted,
+ *                 peers' whenever their batches get here) into one time-ordered stream
+ *                 per drone.
+ *
+ *                 Each node's plots arrive in about the order it stamped them, since
+ *                 batches go out in LSN order, however far behind they run. So the event-
+ *                 time watermark is the oldest of the nodes' newest timestamps, less the
+ *                 lateness (how far out of order a node's own plots can be, e.g. from skew).
+ *                 Held plots at or below it can't be overtaken by anything still on the
+ *                 way, and release hands them out in time order. A node nothing has arrived
+ *                 from in idle_secs stops holding the watermark back until it is heard from
+ *                 again. Nodes not heard from yet might still be, so nothing is released
+ *                 until idle_secs after the first plot.
+ *
+ *                 A plot older than what has already been released for its drone is late.
+ *                 It is counted and left out, so the stream never goes back in time.
+ ***************************************************************************************/
+class ReorderBuffer
+{
+public:
+   ReorderBuffer(time_t lateness, time_t idle_secs);
+
+   // How far (seconds of plot time) a node's plots can arrive behind its newest
+   void setLateness(time_t secs) { _lateness = secs; };
+   time_t getLateness() { return _lateness; };
+
+   // Buffers a plot that arrived at time now. Returns false if it was late
+   bool add(const DronePlot &plot, time_t now);
+
+   // Appends the plots that are ready (or all of them, for flush) to plots, each drone's in
+   // time order. Returns how many
+   size_t release(time_t now, std::vector<DronePlot> &plots);
+   size_t flush(std::vector<DronePlot> &plots);
+
+   // Plots being held, and plots left out for being late
+   size_t size() { return _size; };
+   uint64_t getLate() { return _late; };
+
+private:
+   struct drone_buf
+   {
+      // timestamp -> plot. multimap keeps equal timestamps in arrival order
+      std::multimap<time_t, DronePlot> plots;
+      time_t released;           // Newest timestamp released
+   };
+
+   struct node_progress
+   {
+      time_t newest;             // Newest timestamp from the node
+      time_t last_arrival;       // When its last plot came in
+   };
+
+   size_t releaseThrough(time_t through, std::vector<DronePlot> &plots);
+
+   std::map<unsigned int, drone_buf> _drones;
+   std::map<unsigned int, node_progress> _nodes;
+
+   time_t _lateness;
+   time_t _idle_secs;
+
+   // When the first plot arrived
+   bool _started;
+   time_t _start;
+
+   size_t _size;
+   uint64_t _late;
+};
+
+#endif
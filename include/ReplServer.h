@@ -3,8 +3,12 @@
 
 #include <map>
 #include <memory>
+#include <fstream>
 #include "QueueMgr.h"
 #include "DronePlotDB.h"
+#include "SyncMsg.h"
+#include "SkewEstimator.h"
+#include "ReorderBuffer.h"
 
 /***************************************************************************************
  * ReplServer - class that manages replication between servers. The data is automatically
@@ -13,6 +17,23 @@
  *              the communications. This object simply runs management loops and should
  *              do deconfliction of nodes
  *
+ *              Besides pushing new plots, it periodically runs an anti-entropy sync with
+ *              each peer (see SyncMsg) so a server that missed batches, or restarted,
+ *              converges by exchanging only the time buckets that differ.
+ *
+ *              On startup it also asks one peer for a snapshot of its database, streamed
+ *              as fast as the peer's ACKs come back, so a node joining mid-flight is caught
+ *              up without waiting on replication windows.
+ *
+ *              It also estimates each peer's clock skew from sightings both of us reported
+ *              (see SkewEstimator). Once the skew to the lowest node ID is known, our own
+ *              plots are stamped corrected to that node's clock, so every server stores the
+ *              same timestamps and duplicate sightings line up.
+ *
+ *              Optionally, every drone's plots (ours and replicated) are streamed to a track
+ *              file in time order as they settle, through a ReorderBuffer whose watermark
+ *              follows each node's replicated plots and allows for the skew estimates.
+ *
  ***************************************************************************************/
 class ReplServer 
 {
@@ -29,6 +50,22 @@ public:
    // Call this to shutdown the loop 
    void shutdown();
 
+   // Replicate over long-lived peer connections instead of one connection per batch
+   void setPersistentConns(bool persistent) { _queue.setPersistent(persistent); };
+
+   // Keeps the skew estimates and clock correction in this file, loading them now if it
+   // exists
+   void setSkewFile(const char *filename);
+
+   // Streams each drone's plots to this CSV file in time order once they settle, and the
+   // rest at shutdown. Throws runtime_error if it can't be opened
+   void setTrackFile(const char *filename);
+
+   // The database was brought back from the WAL through last_lsn, so no snapshot is needed
+   // and the peers aren't sent those plots again: anti-entropy sync fills in what was missed
+   // while we were down
+   void setRecovered(uint64_t last_lsn);
+
    // An adjusted time that accounts for "time_mult", which speeds up the clock. Any
    // attempts to check "simulator time" should use this function
    time_t getAdjustedTime();
@@ -36,10 +73,39 @@ public:
 private:
 
    void addReplDronePlots(std::vector<uint8_t> &data);
-   void addSingleDronePlot(std::vector<uint8_t> &data);
+
+   // Adds the replicated plots that aren't already there, as one batch. Returns how many
+   // were new
+   unsigned int addReplPlots(std::vector<DronePlot> &plots);
+
+   // Anti-entropy sync: startSync sends our digest to the peers that support it,
+   // handleSync answers a sync message from a peer, sendSync queues one to a peer
+   void startSync();
+   void handleSync(const std::string &sid, std::vector<uint8_t> &data);
+   void sendSync(const char *sid, SyncMsg &msg);
+
+   // Snapshot bootstrap: requestSnapshot asks a peer for its database until one has been
+   // received, pumpSnapshots sends the next chunk of each snapshot we are serving
+   void requestSnapshot();
+   void pumpSnapshots();
 
    unsigned int queueNewPlots();
 
+   // Clock skew: indexLocalPlots and observeSkew match our new plots and peers' against the
+   // other side's in _skew_index, adjustClock corrects our clock once the reference node's
+   // skew is known
+   void indexLocalPlots();
+   void observeSkew(DronePlot &plot);
+   void adjustClock();
+   void saveSkew();
+
+   // Feeds the plots added since the last call to _tracks and writes out what it releases
+   // (everything, if flush is set)
+   void streamTracks(bool flush = false);
+
+   // How long the replication loop can sleep waiting for events
+   int getWaitTimeout();
+
 
    QueueMgr _queue;    
 
@@ -57,6 +123,45 @@ private:
    // When the last replication happened so we can know when to do another one
    time_t _last_repl;
 
+   // When the last anti-entropy sync was started, and what syncs have moved
+   time_t _last_sync;
+   unsigned int _sync_rounds = 0;
+   unsigned int _sync_plots_in = 0;
+   unsigned int _sync_plots_out = 0;
+
+   // Snapshots we are sending, by peer. The position is the peer's replication cursor,
+   // which each chunk's ACK moves up to end_lsn
+   struct snapshot_send {
+      uint64_t end_lsn = 0;      // Our last LSN when the snapshot was requested
+      bool started = false;      // The cursor has been rewound to the start
+      size_t plots = 0;
+   };
+   std::map<std::string, snapshot_send> _snap_out;
+
+   // Our own bootstrap: who we asked, when (adjusted time, for the retry), when we started
+   // (system time, for the report)
+   bool _bootstrapped = false;
+   std::string _snap_source;
+   time_t _snap_requested = 0;
+   time_t _snap_start = 0;
+
+   // Clock skew estimates, recent plots (ours up to _skew_lsn, and peers') to match each
+   // other, our node ID (0 until we have a plot) and the seconds we add to our timestamps
+   SkewEstimator _skew;
+   DeconflictIndex _skew_index;
+   uint64_t _skew_lsn = 0;
+   uint64_t _skew_entries = 0;
+   unsigned int _node_id = 0;
+   time_t _clock_adjust = 0;
+   std::string _skew_file;
+
+   // Track stream: the reorder buffer, how far into the change log it has been fed and the
+   // file it is written to
+   ReorderBuffer _tracks;
+   uint64_t _track_lsn = 0;
+   std::ofstream _track_file;
+   uint64_t _track_plots = 0;
+
    // How much to spam stdout with server status
    unsigned int _verbosity;
 
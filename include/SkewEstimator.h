@@ -0,0 +1,60 @@
+#ifndef SKEWESTIMATOR_H
+#define SKEWESTIMATOR_H
+
+#include <map>
+#include <string>
+#include <cstdint>
+#include <ctime>
+
+// Residuals more than this many times the typical deviation from the estimate are clipped
+// (Huber), so a false match can only move the estimate a little
+const double skew_huber_k = 2.0;
+const double skew_min_scale = 0.5;
+
+// The gain starts at 1/matches (a running mean) and bottoms out here, after which the
+// estimate is an EWMA that can follow slow drift
+const double skew_min_gain = 0.05;
+
+/***************************************************************************************
+ * SkewEstimator - robust online estimates of how far each node's clock is ahead of ours,
+ *                 from the timestamp differences of sightings both of us reported.
+ *
+ *                 Each node keeps an estimate, a scale (the EWMA of the absolute residual)
+ *                 and a match count, so an update is O(1): the residual is clipped to
+ *                 skew_huber_k scales, then added in with a gain of 1/count, floored at
+ *                 skew_min_gain.
+ *
+ *                 Estimates can be saved to and loaded from a small text file so a
+ *                 restarted server doesn't start over.
+ ***************************************************************************************/
+class SkewEstimator
+{
+public:
+   struct estimate
+   {
+      double skew = 0.0;         // Seconds the node's clock is ahead of ours
+      double scale = 0.0;        // Typical size of a residual
+      uint64_t matches = 0;
+   };
+
+   // Adds one match: the node's timestamp minus ours for the same sighting
+   void update(unsigned int node_id, double diff);
+
+   // Moves every estimate by secs, after our own clock correction changes by -secs
+   void shift(double secs);
+
+   // Returns false if there have been no matches with the node
+   bool getEstimate(unsigned int node_id, estimate &est);
+
+   const std::map<unsigned int, estimate> &getEstimates() { return _nodes; };
+
+   // Our clock correction is saved along with the estimates. save returns false if the
+   // file can't be written; load returns false if it can't be read (nothing is changed)
+   bool save(const char *filename, time_t correction);
+   bool load(const char *filename, time_t &correction);
+
+private:
+   std::map<unsigned int, estimate> _nodes;
+};
+
+#endif
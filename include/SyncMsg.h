@@ -0,0 +1,80 @@
+#ifndef SYNCMSG_H
+#define SYNCMSG_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "DronePlotDB.h"
+
+// First bytes of an anti-entropy sync message. Like the PlotCodec magic, read as the plot
+// count of a raw batch it would be more plots than fit in a frame
+const uint8_t sync_msg_magic[] = { 'S', 'Y', 'N' };
+const uint8_t sync_msg_version = 1;
+
+/***************************************************************************************
+ * SyncMsg - the messages of the anti-entropy exchange between replication servers. They
+ *           travel as replication batches, so they are compressed and encrypted like any
+ *           other batch, and are told apart from plot batches by the magic bytes.
+ *
+ *           An exchange goes:
+ *
+ *              sm_digest   A -> B  A's root sum and per-drone sums
+ *              sm_buckets  B -> A  B's per-bucket sums for the drones whose sums differ
+ *              sm_plots    A -> B  A's plots in the buckets whose sums differ, and the
+ *                                  list of those buckets (want)
+ *              sm_plots    B -> A  B's plots in the wanted buckets that A didn't send
+ *
+ *           so only buckets that actually differ are ever sent. The sums only cover
+ *           buckets that start before A's horizon (carried in sm_digest and echoed in
+ *           sm_buckets), leaving out the ones normal replication is still filling in.
+ *
+ *           A server that has just started bootstraps from one peer instead:
+ *
+ *              sm_snap_request  A -> B  send me your whole database
+ *              (plot batches)   B -> A  everything up to B's LSN at the time of the
+ *                                       request, in chunks, each ACK'd like a batch
+ *              sm_snap_done     B -> A  the last chunk has been ACK'd (root_count is the
+ *                                       number of plots sent)
+ *
+ *           Layout (multi-byte fields network order):
+ *
+ *              "SYN" version  (4 bytes)
+ *              type           (1 byte)  - one of msg_type
+ *              horizon        (8 bytes)
+ *              root hash      (8 bytes), root count (4 bytes)
+ *              drones         (4-byte count, then 4 bytes each)
+ *              entries        (4-byte count, then drone 4, bucket 8, hash 8, count 4)
+ *              plots          (PlotCodec batch, to the end of the message)
+ *
+ *           Each type fills in only the fields it needs: sm_digest the horizon, root and
+ *           entries (drone level), sm_buckets the horizon, drones (every drone compared)
+ *           and entries (bucket level), sm_plots entries (the wanted buckets, hash and
+ *           count 0) and plots.
+ ***************************************************************************************/
+class SyncMsg
+{
+public:
+   enum msg_type { sm_digest = 1, sm_buckets = 2, sm_plots = 3, sm_snap_request = 4,
+                   sm_snap_done = 5 };
+
+   SyncMsg(msg_type in_type = sm_digest);
+
+   // Writes the message onto the end of out
+   void encode(std::vector<uint8_t> &out);
+
+   // Reads a message. Throws runtime_error if it is truncated, corrupt or not a sync message
+   void decode(const uint8_t *data, size_t len);
+
+   // True if the data starts with the sync magic bytes and a version this code can read
+   static bool isSync(const uint8_t *data, size_t len);
+
+   msg_type type;
+   time_t horizon = 0;
+   uint64_t root_hash = 0;
+   uint32_t root_count = 0;
+   std::vector<unsigned int> drones;
+   std::vector<sync_entry> entries;
+   std::vector<DronePlot> plots;
+};
+
+#endif
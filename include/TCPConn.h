@@ -1,23 +1,57 @@
 #ifndef TCPCONN_H
 #define TCPCONN_H
 
+#include <deque>
+#include <memory>
 #include <crypto++/secblock.h>
+#include <crypto++/osrng.h>
+#include <crypto++/aes.h>
+#include <crypto++/gcm.h>
 #include "FileDesc.h"
+#include "ByteBuffer.h"
+#include "Frame.h"
 #include "LogMgr.h"
 
 const int max_attempts = 2;
 
+// Persistent connections: how long (seconds) a client keeps an idle connection open waiting
+// for the next batch. The receiving side waits twice as long so the client closes first.
+const time_t idle_timeout = 60;
+
+// AES-GCM sizes for replication data: 96-bit IV in front of the ciphertext, 128-bit tag after.
+// The IV is a per-session 4-byte prefix and an 8-byte message counter
+const unsigned int gcm_iv_size = 12;
+const unsigned int gcm_tag_size = 16;
+const unsigned int nonce_prefix_size = 4;
+
+// Replication data is encrypted this much at a time as the socket drains
+const size_t stream_chunk_size = 64 * 1024;
+
+// An outgoing batch. Immutable once built, so every peer's connection can share the one copy
+typedef std::shared_ptr<const std::vector<uint8_t>> shared_batch;
+
+// Running totals for replication data encryption, shared by all of a server's connections
+struct cipher_stats
+{
+   uint64_t enc_bytes = 0;
+   uint64_t dec_bytes = 0;
+   double enc_secs = 0.0;
+   double dec_secs = 0.0;
+   unsigned int auth_failures = 0;   // Frames whose GCM tag did not verify
+};
+
 // Methods and attributes to manage a network connection, including tracking the username
 // and a buffer for user input. Status tracks what "phase" of login the user is currently in
 class TCPConn 
 {
 public:
-   TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int verbosity);
+   TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, cipher_stats &stats,
+                                                             unsigned int verbosity);
    ~TCPConn();
 
    // The current status of the connection
    enum statustype { s_none, s_connecting, s_connected, s_C_waitR_B, s_C_sendR_A, s_C_waitKR_A, s_S_sendR_B,
-       s_S_waitKR_B, s_S_waitR_A, s_datatx, s_datarx, s_waitack, s_hasdata };
+       s_S_waitKR_B, s_S_waitR_A, s_datatx, s_datarx, s_waitack, s_hasdata, s_idle };
 
    statustype getStatus() { return _status; };
 
@@ -32,9 +66,14 @@ public:
    void connect(unsigned long ip_addr, unsigned short port);
 
    // Send data to the other end of the connection without encryption
-   bool getData(std::vector<uint8_t> &buf);
+   bool getData(ByteBuffer &buf);
    bool sendData(std::vector<uint8_t> &buf);
 
+   // Send or receive one Frame (header + payload) of the given Frame::frame_type. Payloads
+   // flagged frame_flag_gcm are decrypted and verified on the way out of the receive buffer
+   int getFrame(uint8_t type, std::vector<uint8_t> &buf, uint16_t *flags = NULL);
+   bool sendFrame(uint8_t type, std::vector<uint8_t> &payload, uint16_t flags = 0);
+
    // Calls encryptData or decryptData before send or after receive
    bool getEncryptedData(std::vector<uint8_t> &buf);
    bool sendEncryptedData(std::vector<uint8_t> &buf);
@@ -43,6 +82,16 @@ public:
    void encryptData(std::vector<uint8_t> &buf);
    void decryptData(std::vector<uint8_t> &buf);
 
+   // AES-GCM for replication data under the session keys, as <IV><ciphertext><tag>. Sealing
+   // is done in pieces so a batch can be encrypted as it is sent: startSeal writes the IV,
+   // sealChunk encrypts len bytes into out, finishSeal writes the tag. openPayload decrypts
+   // a whole payload into out, false if the tag doesn't match or the message counter didn't
+   // move forward (a replay)
+   void startSeal(uint8_t *iv);
+   void sealChunk(const uint8_t *data, size_t len, uint8_t *out);
+   void finishSeal(uint8_t *tag);
+   bool openPayload(const uint8_t *data, size_t len, std::vector<uint8_t> &out);
+
    // Input data received on the socket
    bool isInputDataReady() { return _data_ready; };
    void getInputData(std::vector<uint8_t> &buf);
@@ -53,6 +102,10 @@ public:
    unsigned short getPort() { return _connfd.getPort(); }; // host format
    const char *getNodeID() { return _node_id.c_str(); };
 
+   // Capability bits (cap_*) the other end sent with its SID once authenticated
+   bool hasPeerCaps() { return _peer_caps_known; };
+   uint16_t getPeerCaps() { return _peer_caps; };
+
    // Connections can set the node or server ID of this connection
    void setNodeID(const char *new_id) { _node_id = new_id; };
    void setSvrID(const char *new_id) { _svr_id = new_id; };
@@ -63,11 +116,41 @@ public:
    // Checks if the socket FD is marked as open
    bool isConnected();
 
+   // Event loop support. The server marks the connection readable when epoll reports its
+   // socket. needsService is true if handleConnection has work to do without new input, and
+   // getDeadline is when a timer (reconnect, idle) next needs it (0 = none)
+   int getFD() { return _connfd.getFD(); };
+   void setReadable() { _readable = true; };
+   bool needsService();
+   time_t getDeadline();
+   bool isWatched() { return _watched; };
+   void setWatched() { _watched = true; };
+
+   // Outgoing data the non-blocking socket hasn't taken yet. The server watches for the
+   // socket to become writable (EPOLLOUT) while there is any
+   bool hasPendingOutput() { return !_txqueue.empty() || _streambatch; };
+   size_t getPendingOutput();
+   void setWritable() { _writable = true; };
+   bool isWatchingOut() { return _watching_out; };
+   void setWatchingOut(bool watching) { _watching_out = watching; };
+
    // When should we try to reconnect (prevents spam)
    time_t reconnect;
 
    // Assign outgoing data and sets up the socket to manage the transmission
-   void assignOutgoingData(std::vector<uint8_t> &data);
+   void assignOutgoingData(shared_batch data, uint64_t batch_lsn = 0);
+
+   // Keep the connection open between batches instead of closing after each ACK. A client
+   // connection waits in s_idle for its next batch, the receiver stays in s_datarx. It isn't
+   // idle once a batch has been assigned, even before handleConnection starts sending it
+   void setPersistent(bool persistent) { _persistent = persistent; };
+   bool isIdle() { return (_status == s_idle) && _connected && !_outbatch; };
+
+   // Tracks the database LSN of the outgoing batch until the peer's ACK arrives
+   bool hasBatch() { return _has_batch; };
+   bool isBatchAcked() { return _batch_acked; };
+   uint64_t getBatchLSN() { return _batch_lsn; };
+   void clearBatch();
 
    //Shared key authentication
    void sendRand_B(); // 2 - Server sends R_B
@@ -86,27 +169,36 @@ protected:
    void transmitData();
    void waitForData();
    void awaitAck();
+   void waitForBatch();
+
+   // Data waiting on the socket or left over from the last read
+   bool hasInput();
+
+   // Adds data to the end of the outbound queue and sends as much of the queue as the
+   // socket will take
+   void queueOutput(std::vector<uint8_t> &&data);
+   bool flushOutput();
 
-   // Looks for commands in the data stream
-   std::vector<uint8_t>::iterator findCmd(std::vector<uint8_t> &buf,
-                                                   std::vector<uint8_t> &cmd);
-   bool hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd);
+   // Disconnects once everything queued has been sent
+   void closeWhenFlushed();
 
-   // Gets the data between startcmd and endcmd strings and places in buf
-   bool getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd);
+   // Starts the REP frame set up by assignOutgoingData. The payload is encrypted and queued
+   // a chunk at a time by nextChunk as the queue drains
+   void sendOutput();
+   void nextChunk();
 
-   // Places startcmd and endcmd strings around the data in buf and returns it in buf
-   void wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd);
+   // Random challenge strings for the handshake, from the connection's RNG
+   void genChallenge(std::string &buf);
+
+   // Once both challenges are through, derives this session's keys and nonce prefixes
+   // from the shared key and R_A||R_B
+   void deriveSessionKeys(const std::string &r_a, const std::string &r_b, bool client);
 
 
 private:
 
    bool _connected = false;
 
-   std::vector<uint8_t> c_rep, c_endrep, c_auth, c_endauth, c_ack, c_sid, c_endsid;
-
    statustype _status = s_none;
 
    SocketFD _connfd;
@@ -118,11 +210,57 @@ private:
    std::vector<uint8_t> _inputbuf;
    bool _data_ready;    // Is the input buffer full and data ready to be read?
 
-   // Store outgoing data to be sent over the network
-   std::vector<uint8_t> _outputbuf;
+   // Data read off the socket that hasn't been taken as a frame yet
+   ByteBuffer _rxbuf;
+
+   // Outgoing batch waiting to be sent, shared with the other peers' connections. Once
+   // sendOutput starts it, it moves to _streambatch until the last chunk is queued
+   shared_batch _outbatch;
+   shared_batch _streambatch;
+   size_t _stream_pos = 0;
+   std::vector<uint8_t> _scratch;   // Recycled chunk buffer
+
+   // LSN tracking for the outgoing batch
+   bool _has_batch = false;
+   bool _batch_acked = false;
+   uint64_t _batch_lsn = 0;
+
+   bool _authenticated = false;  // Server side: the challenge/response has completed
+
+   bool _peer_caps_known = false;
+   uint16_t _peer_caps = 0;
+
+   bool _persistent = false;
+   time_t _last_activity = 0;    // When the last batch went out or came in
+
+   bool _readable = false;       // epoll reported data (or a close) on the socket
+   bool _rx_pending = false;     // _rxbuf may hold another complete frame
+   bool _watched = false;        // Socket is registered with the server's epoll set
+
+   // Outbound queue. _txoff is how much of the front buffer has already been sent
+   std::deque<std::vector<uint8_t>> _txqueue;
+   size_t _txoff = 0;
+   size_t _tx_pending = 0;       // Bytes queued and not yet sent
+   bool _writable = false;       // epoll reported the socket writable
+   bool _watching_out = false;   // Registered for EPOLLOUT
+   bool _close_pending = false;
 
    CryptoPP::SecByteBlock &_aes_key; // Read from a file, our shared key
+   cipher_stats &_stats;
    std::string _authstr;   // remembers the random authorization string sent
+   std::string _peerstr;   // Client: the server's R_B, for the session key derivation
+
+   // Seeded from the OS once per connection, used for challenges and handshake IVs
+   CryptoPP::AutoSeededRandomPool _rng;
+
+   // Session state from deriveSessionKeys. Keyed once, then each message only changes the IV
+   bool _has_session = false;
+   CryptoPP::GCM<CryptoPP::AES>::Encryption _tx_gcm;
+   CryptoPP::GCM<CryptoPP::AES>::Decryption _rx_gcm;
+   uint8_t _tx_prefix[nonce_prefix_size];
+   uint8_t _rx_prefix[nonce_prefix_size];
+   uint64_t _tx_seq = 0;         // Counter of the last message sent
+   uint64_t _rx_seq = 0;         // Counter of the last message accepted
 
    unsigned int _verbosity;
 
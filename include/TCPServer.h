@@ -19,6 +19,9 @@
 
 const time_t reconnect_delay = 5;
 
+// Longest the event loop sleeps without a socket event or timer (ms)
+const int max_wait_ms = 1000;
+
 class TCPServer : public Server 
 {
 public:
@@ -34,12 +37,26 @@ public:
    TCPConn *handleSocket();
    virtual void handleConnections();
 
+   // Sleeps until epoll reports a socket ready or timeout_ms passes, then marks the ready
+   // connections (and the listening socket) so the handlers know to read
+   void waitForEvents(int timeout_ms);
+
+   // How long waitForEvents can sleep before a connection needs attention
+   int getWaitTimeout(int max_ms = max_wait_ms);
+
+   // Makes a waitForEvents in another thread return right away
+   void wakeUp();
+
    unsigned long getIPAddr() { return _sockfd.getIPAddr(); };
    unsigned short getPort() { return _sockfd.getPort(); };
 
    // Change where the log file is writing to
    void changeLogfile(const char *newfile);
 
+   // Encryption throughput of the replication data, all connections combined
+   cipher_stats &getCipherStats() { return _cipher_stats; };
+   void logCipherStats();
+
 protected:
 
    void loadAESKey(const char *filename);
@@ -48,15 +65,23 @@ protected:
    std::list<std::unique_ptr<TCPConn>> _connlist;
 
    CryptoPP::SecByteBlock _aes_key;
+   cipher_stats _cipher_stats;
 
    LogMgr _server_log;
 
    unsigned int _verbosity;
 
 private:
+   // Adds the connection's socket to the epoll set
+   void watchConn(TCPConn &conn);
+
    // Class to manage the server socket
    SocketFD _sockfd;
 
+   int _epoll_fd;
+   int _wake_fd;              // eventfd used by wakeUp
+   bool _listen_ready;        // epoll reported a pending connection
+
 };
 
 
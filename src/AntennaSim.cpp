@@ -97,7 +97,7 @@ void AntennaSim::simulate() {
    _start_time = time(NULL) + _time_offset - 3;
 
    timespec sleeptime;
-   std::list<DronePlot>::iterator diter;
+   DronePlotDB::iterator diter;
 
    // Change all the inject timestamps to the offset time
    for (diter = _source_db.begin(); diter != _source_db.end(); diter++) {
@@ -0,0 +1,72 @@
+#include <cstring>
+#include <stdexcept>
+#include "ByteBuffer.h"
+
+/*****************************************************************************************
+ * ByteBuffer (constructor) - allocates the initial space, which is reused from then on
+ *****************************************************************************************/
+ByteBuffer::ByteBuffer(size_t initial_size):
+               _buf(initial_size),
+               _rpos(0),
+               _wpos(0)
+{
+
+}
+
+ByteBuffer::~ByteBuffer() {
+
+}
+
+/*****************************************************************************************
+ * writePtr - gets a pointer to the free space at the tail of the buffer. If there isn't
+ *            min_free bytes there, first slides the unread data to the front and then, if
+ *            still needed, doubles the buffer until it fits.
+ *
+ *    Params:  min_free - bytes the caller needs to be able to write
+ *
+ *    Returns: pointer to write at; writable() bytes are available
+ *****************************************************************************************/
+uint8_t *ByteBuffer::writePtr(size_t min_free) {
+   if (writable() >= min_free)
+      return _buf.data() + _wpos;
+
+   // Reclaim the consumed space at the front
+   if (_rpos > 0) {
+      size_t unread = size();
+      memmove(_buf.data(), _buf.data() + _rpos, unread);
+      _rpos = 0;
+      _wpos = unread;
+   }
+
+   if (writable() < min_free) {
+      size_t new_size = (_buf.size() > 0) ? _buf.size() : 1;
+      while (new_size - _wpos < min_free)
+         new_size *= 2;
+      _buf.resize(new_size);
+   }
+
+   return _buf.data() + _wpos;
+}
+
+/*****************************************************************************************
+ * consume - marks n bytes at the front as read. Resets both positions when the buffer
+ *           empties so the next read starts at the front again without a memmove.
+ *
+ *    Throws: runtime_error if n is more than the unread data
+ *****************************************************************************************/
+void ByteBuffer::consume(size_t n) {
+   if (n > size())
+      throw std::runtime_error("ByteBuffer consume past the end of the data.");
+
+   _rpos += n;
+   if (_rpos == _wpos)
+      _rpos = _wpos = 0;
+}
+
+/*****************************************************************************************
+ * append - copies len bytes onto the end of the data
+ *****************************************************************************************/
+void ByteBuffer::append(const uint8_t *src, size_t len) {
+   memcpy(writePtr(len), src, len);
+   commit(len);
+}
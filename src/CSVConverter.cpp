@@ -0,0 +1,279 @@
+#include <stdexcept>
+#include <algorithm>
+#include <iostream>
+#include <charconv>
+#include <cstring>
+#include <unistd.h>
+#include "CSVConverter.h"
+#include "DronePlotDB.h"
+#include "PlotFile.h"
+#include "FileDesc.h"
+
+CSVConverter::CSVConverter(const char *in_file, const char *out_file, unsigned int verbosity):
+                                 _in_file(in_file),
+                                 _out_file(out_file),
+                                 _verbosity(verbosity),
+                                 _filter(false),
+                                 _node_id(0),
+                                 _plots_read(0),
+                                 _data(NULL),
+                                 _len(0),
+                                 _next_piece(0),
+                                 _written(0),
+                                 _stop(false)
+{
+   pthread_mutex_init(&_mutex, NULL);
+   pthread_cond_init(&_parsed, NULL);
+   pthread_cond_init(&_freed, NULL);
+}
+
+CSVConverter::~CSVConverter() {
+   stopThreads();
+   FileFD::unmapFile(_data, _len);
+
+   pthread_cond_destroy(&_freed);
+   pthread_cond_destroy(&_parsed);
+   pthread_mutex_destroy(&_mutex);
+}
+
+void CSVConverter::setNodeFilter(unsigned int node_id) {
+   _filter = true;
+   _node_id = node_id;
+}
+
+/*****************************************************************************************
+ * parseField - parses one field with from_chars, allowing spaces (and a CR at the end of
+ *              the line) around it, and steps past the separator that follows it
+ *
+ *    Params:  pos - the start of the field, left just past its separator
+ *             last - true for the last field of the line, which runs to end
+ *
+ *    Returns: false if the field isn't a number of the right type followed by its separator
+ *****************************************************************************************/
+template <typename T>
+static bool parseField(const char *&pos, const char *end, T &val, bool last) {
+   while ((pos < end) && (*pos == ' '))
+      pos++;
+
+   std::from_chars_result result = std::from_chars(pos, end, val);
+   if (result.ec != std::errc())
+      return false;
+
+   pos = result.ptr;
+   while ((pos < end) && ((*pos == ' ') || (*pos == '\r')))
+      pos++;
+
+   if (last)
+      return pos == end;
+   if ((pos == end) || (*pos != ','))
+      return false;
+   pos++;
+   return true;
+}
+
+/*****************************************************************************************
+ * parseLine - parses drone_id,node_id,timestamp,latitude,longitude into plot
+ *
+ *    Returns: false if the line isn't a valid plot
+ *****************************************************************************************/
+bool CSVConverter::parseLine(const char *line, const char *end, DronePlot &plot) {
+   return parseField(line, end, plot.drone_id, false) &&
+          parseField(line, end, plot.node_id, false) &&
+          parseField(line, end, plot.timestamp, false) &&
+          parseField(line, end, plot.latitude, false) &&
+          parseField(line, end, plot.longitude, true);
+}
+
+/*****************************************************************************************
+ * parsePiece - parses the lines of one piece, keeping the plots that pass the node filter.
+ *              Blank lines are skipped. A bad line stops the piece with an error giving
+ *              its byte offset
+ *****************************************************************************************/
+void CSVConverter::parsePiece(piece &p) {
+   const char *pos = (const char *) _data + p.begin;
+   const char *end = (const char *) _data + p.end;
+   DronePlot plot;
+
+   p.plots.clear();
+   p.read = 0;
+   p.error.clear();
+
+   while (pos < end) {
+      const char *eol = (const char *) memchr(pos, '\n', end - pos);
+      if (eol == NULL)
+         eol = end;
+
+      const char *last = eol;
+      while ((last > pos) && ((last[-1] == '\r') || (last[-1] == ' ')))
+         last--;
+
+      if (last > pos) {
+         if (!parseLine(pos, last, plot)) {
+            p.error = "Bad plot in " + _in_file + " at byte " +
+                                       std::to_string(pos - (const char *) _data) + ".";
+            return;
+         }
+
+         p.read++;
+         if (!_filter || (plot.node_id == _node_id))
+            p.plots.push_back(plot);
+      }
+      pos = eol + 1;
+   }
+}
+
+void *CSVConverter::t_parse(void *data) {
+   static_cast<CSVConverter *>(data)->parseLoop();
+   return NULL;
+}
+
+/*****************************************************************************************
+ * parseLoop - a parse thread's loop: takes the next piece once its slot is free, parses
+ *             it and hands it to the writer, until there are no pieces left or stop is set
+ *****************************************************************************************/
+void CSVConverter::parseLoop() {
+   size_t window = _pieces.size();
+   size_t num_pieces = _cuts.size() - 1;
+
+   pthread_mutex_lock(&_mutex);
+   while (!_stop && (_next_piece < num_pieces)) {
+      if (_next_piece >= _written + window) {
+         pthread_cond_wait(&_freed, &_mutex);
+         continue;
+      }
+
+      size_t n = _next_piece++;
+      piece &p = _pieces[n % window];
+      p.begin = _cuts[n];
+      p.end = _cuts[n + 1];
+      pthread_mutex_unlock(&_mutex);
+
+      parsePiece(p);
+
+      pthread_mutex_lock(&_mutex);
+      p.done = true;
+      pthread_cond_broadcast(&_parsed);
+   }
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * stopThreads - tells the parse threads to finish and waits for them
+ *****************************************************************************************/
+void CSVConverter::stopThreads() {
+   pthread_mutex_lock(&_mutex);
+   _stop = true;
+   pthread_cond_broadcast(&_freed);
+   pthread_mutex_unlock(&_mutex);
+
+   for (auto &tid : _threads)
+      pthread_join(tid, NULL);
+   _threads.clear();
+}
+
+/*****************************************************************************************
+ * convert - maps the input, cuts it into pieces at line ends, starts the parse threads and
+ *           writes each piece's plots to the output PlotFile in input order as it comes
+ *           ready, releasing the input pages behind it
+ *
+ *    Params:  max_threads - most parse threads (0 = one per core). Small inputs use fewer
+ *
+ *    Returns: the number of plots written
+ *
+ *    Throws: runtime_error if the input can't be read, a line can't be parsed, or the output
+ *            can't be written
+ *****************************************************************************************/
+size_t CSVConverter::convert(unsigned int max_threads) {
+   _plots_read = 0;
+
+   FileFD infile(_in_file.c_str());
+   if (!infile.openFile(FileFD::readfd))
+      throw std::runtime_error("Unable to open " + _in_file + " for reading.");
+
+   _data = infile.mapFile(_len, true);
+   infile.closeFD();
+   if ((_data == NULL) && (_len > 0))
+      throw std::runtime_error("Unable to map " + _in_file + ".");
+
+   // Cut at the first line end at or after every csv_piece_bytes
+   _cuts.assign(1, 0);
+   while (_cuts.back() < _len) {
+      size_t cut = _cuts.back() + csv_piece_bytes;
+      if (cut >= _len) {
+         cut = _len;
+      } else {
+         const uint8_t *eol = (const uint8_t *) memchr(_data + cut, '\n', _len - cut);
+         cut = (eol == NULL) ? _len : (eol - _data) + 1;
+      }
+      _cuts.push_back(cut);
+   }
+   size_t num_pieces = _cuts.size() - 1;
+
+   unsigned int threads = (max_threads > 0) ? max_threads : sysconf(_SC_NPROCESSORS_ONLN);
+   threads = std::max(1u, std::min({threads, csv_max_threads, (unsigned int) num_pieces}));
+
+   PlotFile outfile(_out_file.c_str());
+   if (!outfile.create())
+      throw std::runtime_error("Unable to open " + _out_file + " for writing.");
+
+   _pieces.assign(threads * csv_pieces_per_thread, piece());
+   for (auto &p : _pieces)
+      p.done = false;
+   _next_piece = 0;
+   _written = 0;
+   _stop = false;
+
+   for (unsigned int i = 0; i < threads; i++) {
+      pthread_t tid;
+      if (pthread_create(&tid, NULL, t_parse, (void *) this) == 0)
+         _threads.push_back(tid);
+   }
+   if (_threads.empty() && (num_pieces > 0)) {
+      FileFD::unmapFile(_data, _len);
+      _data = NULL;
+      throw std::runtime_error("Unable to start CSV parse threads.");
+   }
+
+   size_t written = 0;
+   try {
+      for (size_t n = 0; n < num_pieces; n++) {
+         piece &p = _pieces[n % _pieces.size()];
+
+         pthread_mutex_lock(&_mutex);
+         while (!p.done)
+            pthread_cond_wait(&_parsed, &_mutex);
+         pthread_mutex_unlock(&_mutex);
+
+         if (!p.error.empty())
+            throw std::runtime_error(p.error);
+
+         for (auto &plot : p.plots)
+            outfile.addPlot(plot);
+         written += p.plots.size();
+         _plots_read += p.read;
+
+         FileFD::releaseMapped(_data + p.begin, p.end - p.begin);
+
+         if ((_verbosity >= 2) && ((n + 1) % 64 == 0))
+            std::cout << "Converted " << _cuts[n + 1] << " of " << _len << " bytes.\n";
+
+         pthread_mutex_lock(&_mutex);
+         p.done = false;
+         _written++;
+         pthread_cond_broadcast(&_freed);
+         pthread_mutex_unlock(&_mutex);
+      }
+
+      outfile.finish();
+   } catch (std::runtime_error &e) {
+      stopThreads();
+      FileFD::unmapFile(_data, _len);
+      _data = NULL;
+      throw;
+   }
+
+   stopThreads();
+   FileFD::unmapFile(_data, _len);
+   _data = NULL;
+   return written;
+}
@@ -0,0 +1,79 @@
+#include <arpa/inet.h>
+#include <stdexcept>
+#include <cstring>
+#include "Compressor.h"
+#include "LZCompressor.h"
+#include "Frame.h"
+
+Compressor::Compressor() {
+
+}
+
+Compressor::~Compressor() {
+}
+
+/*****************************************************************************************
+ * pack - writes the batch header (magic, compressor ID, original length) and then the
+ *        compressed data onto the end of out
+ *
+ *    Params:  data, len - the batch to compress
+ *             out - the packed batch is appended here
+ *****************************************************************************************/
+void Compressor::pack(const uint8_t *data, size_t len, std::vector<uint8_t> &out) {
+   uint32_t n_len = htonl((uint32_t) len);
+
+   out.insert(out.end(), compress_magic, compress_magic + sizeof(compress_magic));
+   out.push_back(getID());
+   out.insert(out.end(), (uint8_t *) &n_len, (uint8_t *) &n_len + sizeof(n_len));
+
+   compress(data, len, out);
+}
+
+/*****************************************************************************************
+ * isPacked - checks for the compressed batch magic bytes
+ *****************************************************************************************/
+bool Compressor::isPacked(const uint8_t *data, size_t len) {
+   return (len >= compress_header_size) &&
+          (memcmp(data, compress_magic, sizeof(compress_magic)) == 0);
+}
+
+/*****************************************************************************************
+ * unpack - decompresses a packed batch
+ *
+ *    Params:  data, len - the packed batch
+ *             out - replaced with the original batch
+ *
+ *    Throws: runtime_error if the compressor ID is unknown, the original length is more than
+ *            a frame could have carried, or the compressed data is corrupt
+ *****************************************************************************************/
+void Compressor::unpack(const uint8_t *data, size_t len, std::vector<uint8_t> &out) {
+   if (!isPacked(data, len))
+      throw std::runtime_error("Compressor unpack called on data that is not a compressed batch.");
+
+   std::unique_ptr<Compressor> comp = create(data[sizeof(compress_magic)]);
+   if (!comp)
+      throw std::runtime_error("Compressed batch uses an unknown compressor.");
+
+   uint32_t n_len;
+   memcpy(&n_len, data + sizeof(compress_magic) + 1, sizeof(n_len));
+   size_t orig_len = ntohl(n_len);
+   if (orig_len > 4 * (size_t) max_frame_payload)
+      throw std::runtime_error("Compressed batch claims an impossibly large original size.");
+
+   out.resize(orig_len);
+   if (!comp->decompress(data + compress_header_size, len - compress_header_size, out))
+      throw std::runtime_error("Compressed batch is corrupt.");
+}
+
+/*****************************************************************************************
+ * create - returns a new built-in compressor for the ID, or NULL if there isn't one
+ *****************************************************************************************/
+std::unique_ptr<Compressor> Compressor::create(uint8_t id) {
+   switch (id) {
+   case c_lz:
+      return std::unique_ptr<Compressor>(new LZCompressor);
+
+   default:
+      return std::unique_ptr<Compressor>();
+   }
+}
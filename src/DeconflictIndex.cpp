@@ -0,0 +1,138 @@
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "DeconflictIndex.h"
+
+DeconflictIndex::DeconflictIndex(double tolerance, time_t secs, time_t retain_secs):
+                                 _tolerance(tolerance),
+                                 _cell(tolerance * 2),
+                                 _secs(secs),
+                                 _retain_secs(retain_secs),
+                                 _size(0),
+                                 _newest(std::numeric_limits<time_t>::min())
+{
+
+}
+
+size_t DeconflictIndex::cell_hash::operator()(const cell_key &key) const {
+   uint64_t h = key.drone_id;
+   h = h * 0x9E3779B97F4A7C15ULL ^ (uint64_t) key.lat_cell;
+   h = h * 0x9E3779B97F4A7C15ULL ^ (uint64_t) key.lon_cell;
+   return (size_t) (h ^ (h >> 29));
+}
+
+DeconflictIndex::cell_key DeconflictIndex::keyFor(unsigned int drone_id, float latitude,
+                                                                        float longitude) {
+   return {drone_id, toCell(latitude), toCell(longitude)};
+}
+
+/*****************************************************************************************
+ * find - looks for plots of the same drone from other nodes within the position and time
+ *        tolerances. A plot can only match plots in the cells its tolerance box touches,
+ *        which is at most two cells each way
+ *
+ *    Params:  matches - the matches are appended here
+ *
+ *    Returns: the number of matches found
+ *****************************************************************************************/
+size_t DeconflictIndex::find(unsigned int drone_id, unsigned int node_id, time_t timestamp,
+                         float latitude, float longitude, std::vector<entry> &matches) {
+   int64_t lat_lo = toCell(latitude - _tolerance), lat_hi = toCell(latitude + _tolerance);
+   int64_t lon_lo = toCell(longitude - _tolerance), lon_hi = toCell(longitude + _tolerance);
+
+   size_t found = 0;
+   for (int64_t lat_cell = lat_lo; lat_cell <= lat_hi; lat_cell++) {
+      for (int64_t lon_cell = lon_lo; lon_cell <= lon_hi; lon_cell++) {
+         auto cell_it = _cells.find({drone_id, lat_cell, lon_cell});
+         if (cell_it == _cells.end())
+            continue;
+
+         for (auto &e : cell_it->second) {
+            if ((e.node_id == node_id) || (fabs(e.latitude - latitude) > _tolerance) ||
+                                          (fabs(e.longitude - longitude) > _tolerance))
+               continue;
+
+            time_t diff = (e.timestamp > timestamp) ? e.timestamp - timestamp :
+                                                      timestamp - e.timestamp;
+            if (diff <= _secs) {
+               matches.push_back(e);
+               found++;
+            }
+         }
+      }
+   }
+   return found;
+}
+
+/*****************************************************************************************
+ * add - adds a plot to its cell and to the back of the aging queue
+ *****************************************************************************************/
+void DeconflictIndex::add(unsigned int drone_id, unsigned int node_id, time_t timestamp,
+                                      float latitude, float longitude, uint64_t lsn) {
+   cell_key key = keyFor(drone_id, latitude, longitude);
+   _cells[key].push_back({lsn, node_id, timestamp, latitude, longitude});
+   _order.push_back({timestamp, key, lsn});
+   _size++;
+
+   if (timestamp > _newest)
+      _newest = timestamp;
+   expire();
+}
+
+/*****************************************************************************************
+ * remove - takes the plot with this LSN out of its cell. Its aging queue entry is left to
+ *          find nothing when it comes up
+ *****************************************************************************************/
+void DeconflictIndex::remove(unsigned int drone_id, float latitude, float longitude,
+                                                                           uint64_t lsn) {
+   eraseEntry(keyFor(drone_id, latitude, longitude), lsn);
+}
+
+void DeconflictIndex::eraseEntry(const cell_key &key, uint64_t lsn) {
+   auto cell_it = _cells.find(key);
+   if (cell_it == _cells.end())
+      return;
+
+   std::vector<entry> &entries = cell_it->second;
+   for (size_t i = 0; i < entries.size(); i++) {
+      if (entries[i].lsn == lsn) {
+         entries[i] = entries.back();
+         entries.pop_back();
+         _size--;
+         break;
+      }
+   }
+
+   if (entries.empty())
+      _cells.erase(cell_it);
+}
+
+/*****************************************************************************************
+ * expire - drops plots from the front of the aging queue while they are older than the
+ *          window. A plot added out of order stays until the ones before it have gone
+ *****************************************************************************************/
+void DeconflictIndex::expire() {
+   while (!_order.empty() && (_order.front().timestamp < _newest - _retain_secs)) {
+      eraseEntry(_order.front().key, _order.front().lsn);
+      _order.pop_front();
+   }
+}
+
+void DeconflictIndex::clear() {
+   _cells.clear();
+   _order.clear();
+   _size = 0;
+   _newest = std::numeric_limits<time_t>::min();
+}
+
+bool DeconflictIndex::parsePolicy(const char *name, policy &p) {
+   if (strcmp(name, "off") == 0)
+      p = dc_off;
+   else if (strcmp(name, "drop") == 0)
+      p = dc_drop;
+   else if (strcmp(name, "lowest") == 0)
+      p = dc_keep_lowest;
+   else
+      return false;
+   return true;
+}
@@ -1,4 +1,5 @@
 #include <stdexcept>
+#include <algorithm>
 #include <strings.h>
 #include <cstring>
 #include <unistd.h>
@@ -10,12 +11,23 @@
 #include "DronePlotDB.h"
 #include "strfuncts.h"
 #include "FileDesc.h"
+#include "PlotWAL.h"
+#include "PlotFile.h"
 
+// Marks a change log entry whose plot has been removed from the database
+const size_t no_slot = (size_t) -1;
 
-// Short compare function for database sort by timestamp
-bool compare_plot(const DronePlot &pp1, const DronePlot &pp2) {
-   return (pp1.timestamp < pp2.timestamp);
-}
+// Size of one plot in the headerless binary layout (DronePlot::serialize order)
+const size_t binary_plot_size = sizeof(unsigned int) * 2 + sizeof(time_t) + sizeof(float) * 2;
+
+// Bulk loads are split across decode threads only when each gets at least this many plots
+const size_t parallel_load_plots = 262144;
+const unsigned int max_load_threads = 16;
+
+// Replicated batches are split across merge jobs only when each gets at least this many plots,
+// so a full catch-up batch (ReplServer's max_batch_plots, 10000) can use up to four
+const size_t parallel_merge_plots = 2048;
+const unsigned int max_merge_threads = 16;
 
 /*****************************************************************************************
  * DronePlot - Constructor for a drone plot object, default initializers
@@ -209,7 +221,14 @@ bool DronePlot::isFlagSet(unsigned short flags) {
  * DronePlotDB - Constructor, currently initializes the mutex only
  *
  *****************************************************************************************/
-DronePlotDB::DronePlotDB() {
+DronePlotDB::DronePlotDB():_index_valid(false),
+                           _next_lsn(1),
+                           _wal(NULL),
+                           _dc_policy(DeconflictIndex::dc_off),
+                           _dc_dropped(0),
+                           _dc_flagged(0),
+                           _clock_adjust(0)
+{
 
    // Initialize our mutex for thread protection
    pthread_mutex_init(&_mutex, NULL);
@@ -222,26 +241,64 @@ DronePlotDB::~DronePlotDB() {
 
 
 /*****************************************************************************************
- * addPlot - Adds a plot object at the end of the doubly-linked list
+ * addPlot - Adds a plot at the end of the column store
  *
  *    Params:  drone_id - the unique integer ID of this particular drone
  *             node_id - the unique integer ID of the receiving site
  *             timestamp - the plot's time in seconds
  *             latitude - floating point latitude coordinate of this plot point
  *             longitude - floating point longitude coordinate of this plot point
+ *             flags - DBFLAG_ values the plot starts out with. Unless DBFLAG_SYNCD is
+ *                     set, the timestamp is moved by the clock adjustment
  *             
  *****************************************************************************************/
 
-void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude, float longitude) {
+void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude, float longitude,
+                                                                           unsigned short flags) {
+   DronePlot plot(drone_id, node_id, timestamp, latitude, longitude);
+   plot.setFlags(flags);
+
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
-   _dbdata.emplace_back(drone_id, node_id, timestamp, latitude, longitude);
+   if (!(flags & DBFLAG_SYNCD))
+      plot.timestamp += _clock_adjust;
+   appendPlot(plot);
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
 }
 
+/*****************************************************************************************
+ * addPlots - adds a batch of plots at the end of the column store under one lock, with the
+ *            change log grown once for all of them
+ *
+ *    Params:  plots - the batch, each with the DBFLAG_ values it starts out with. Unless a
+ *                     plot has DBFLAG_SYNCD set, the clock adjustment is added to its
+ *                     timestamp here
+ *
+ *    Returns: the number of plots stored
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *****************************************************************************************/
+
+size_t DronePlotDB::addPlots(std::vector<DronePlot> &plots) {
+   size_t added = 0;
+
+   pthread_mutex_lock(&_mutex);
+
+   _changelog.reserve(_changelog.size() + plots.size());
+   for (auto &plot : plots) {
+      if (!plot.isFlagSet(DBFLAG_SYNCD))
+         plot.timestamp += _clock_adjust;
+      if (appendPlot(plot) != no_slot)
+         added++;
+   }
+
+   pthread_mutex_unlock(&_mutex);
+   return added;
+}
+
 /*****************************************************************************************
  * loadCSVFile - loads in a CSV file containing the plot entries in the right order. The
  *               order should be (no spaces around commas):
@@ -249,7 +306,8 @@ void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float lat
  *
  *    Params:  filename - the path/filename of the CSV file to load
  *
- *    Returns: -1 if there was an issue reading the file, otherwise num read in
+ *    Returns: -1 if there was an issue reading the file (nothing is added), otherwise num
+ *             read in
  *
  *****************************************************************************************/
 
@@ -264,8 +322,8 @@ int DronePlotDB::loadCSVFile(const char *filename) {
    
    // Get line by line, parsing out our data
    std::string buf, data;
-   int count = 0;
-   std::list<DronePlot>::iterator newplot;
+   std::vector<DronePlot> plots;
+   DronePlot newplot;
   
    while (!cfile.eof()) {
       std::getline(cfile, buf);
@@ -273,19 +331,15 @@ int DronePlotDB::loadCSVFile(const char *filename) {
       if (buf.size() == 0)
          continue;
       
-      // Add this to the end and get an iterator pointing to it
-      _dbdata.emplace_back(-1, -1, 0, 0.0, 0.0);
-      newplot = _dbdata.end();
-      newplot--;
-
-      if (newplot->readCSV(buf) == -1)
+      if (newplot.readCSV(buf) == -1)
          return -1;
-
-      // Add it to the database 
-      count++;
+      plots.push_back(newplot);
    }
    cfile.close();
-   return count;
+
+   // Add them to the database in one go
+   addPlots(plots);
+   return (int) plots.size();
 }
 
 /*****************************************************************************************
@@ -293,12 +347,13 @@ int DronePlotDB::loadCSVFile(const char *filename) {
  *               drone_id,node_id,timestamp,latitude,longitude
  *
  *    Params:  filename - the path/filename of the CSV file to write to
+ *             excl_flags - plots with any of these DBFLAG_ flags set are left out
  *
  *    Returns: -1 if there was an issue reading the file, otherwise num read in
  *
  *****************************************************************************************/
 
-int DronePlotDB::writeCSVFile(const char *filename) {
+int DronePlotDB::writeCSVFile(const char *filename, unsigned short excl_flags) {
    std::ofstream cfile;
    int count = 0;
 
@@ -306,12 +361,28 @@ int DronePlotDB::writeCSVFile(const char *filename) {
    if (cfile.fail())
       return -1;
 
+   // Walk the columns chunk by chunk
    std::string buf;
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
-   for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->writeCSV(buf);
-      cfile << buf;
-      count++;
+   DronePlot plot;
+   for (size_t i = 0; i < _dbdata.numChunks(); i++) {
+      PlotChunk &chunk = _dbdata.getChunk(i);
+      size_t begin_off, end_off;
+      _dbdata.getChunkRange(i, begin_off, end_off);
+
+      for (size_t j = begin_off; j < end_off; j++) {
+         if (chunk.flags[j] & excl_flags)
+            continue;
+
+         plot.drone_id = chunk.drone_id[j];
+         plot.node_id = chunk.node_id[j];
+         plot.timestamp = chunk.timestamp[j];
+         plot.latitude = chunk.latitude[j];
+         plot.longitude = chunk.longitude[j];
+
+         plot.writeCSV(buf);
+         cfile << buf;
+         count++;
+      }
    }
 
    cfile.close();
@@ -320,82 +391,310 @@ int DronePlotDB::writeCSVFile(const char *filename) {
 
 
 /*****************************************************************************************
- * writeBinaryFile - writes the contents of the database to a file in raw binary form with
- *                   no newlines
+ * writeBinaryFile - writes the contents of the database to a PlotFile, in blocks with an
+ *                   index (see PlotFile.h)
  *
  *    Params:  filename - the path/filename of the output file
  *
- *    Returns: -1 if there was an issue opening the file, otherwise num written out
+ *    Returns: -1 if there was an issue opening or writing the file, otherwise num written out
  *
  *****************************************************************************************/
 
 int DronePlotDB::writeBinaryFile(const char *filename) {
-   FileFD outfile(filename);
+   PlotFile outfile(filename);
    int count = 0;
 
-   if (!outfile.openFile(FileFD::writefd, true))
+   if (!outfile.create())
       return -1;
 
-   // Prep our vector that will be storing our plotpt data with exactly the right size
-   std::vector<uint8_t> plot;
-   unsigned int ppsize = DronePlot::getDataSize() * _dbdata.size();
-   plot.reserve(ppsize);
-
-   // Loop through all data points and write them to our binary vector
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
-   for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->serialize(plot);
-
-      count++;
+   // Loop through all data points, the writer blocks them up
+   try {
+      DronePlot pp;
+      for (size_t i = 0; i < _dbdata.numChunks(); i++) {
+         PlotChunk &chunk = _dbdata.getChunk(i);
+         size_t begin_off, end_off;
+         _dbdata.getChunkRange(i, begin_off, end_off);
+
+         for (size_t j = begin_off; j < end_off; j++) {
+            pp.drone_id = chunk.drone_id[j];
+            pp.node_id = chunk.node_id[j];
+            pp.timestamp = chunk.timestamp[j];
+            pp.latitude = chunk.latitude[j];
+            pp.longitude = chunk.longitude[j];
+            outfile.addPlot(pp);
+
+            count++;
+         }
+      }
+      outfile.finish();
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      return -1;
    }
-   // Write it to a file
-   std::cout << "Writing count: " << plot.size() << "\n";
-   outfile.writeBytes<uint8_t>(plot);
 
    return count;
 }
 
 /*****************************************************************************************
- * loadBinaryFile - reads the contents of a binary dump of the data into the database
+ * loadBinaryFile - reads the contents of a binary dump of the data into the database.
+ *                  PlotFiles have their blocks decoded in parallel and added in one go.
+ *                  Older headerless files are mapped and decoded in place by loadBinaryData
  *
  *    Params:  filename - the path/filename of the input file
+ *             sequential - madvise the mapping for a front-to-back read
+ *             max_threads - most decode threads (0 = one per core)
  *
- *    Returns: -1 if there was an issue opening the file, otherwise num read in 
+ *    Returns: -1 if there was an issue opening the file or it is corrupt, otherwise num
+ *             read in
  *
  *****************************************************************************************/
 
-int DronePlotDB::loadBinaryFile(const char *filename) {
-   std::vector<uint8_t> buf;
-   std::list<DronePlot>::iterator dptr;
+int DronePlotDB::loadBinaryFile(const char *filename, bool sequential, unsigned int max_threads) {
+   try {
+      PlotFile plotfile(filename);
+      if (plotfile.open(sequential)) {
+         size_t count = plotfile.numPlots();
+
+         pthread_mutex_lock(&_mutex);
+
+         size_t first_slot = _dbdata.extend(count);
+         try {
+            plotfile.loadInto(_dbdata, first_slot, _next_lsn, max_threads);
+         } catch (std::runtime_error &e) {
+            _dbdata.truncate(first_slot);
+            pthread_mutex_unlock(&_mutex);
+            throw;
+         }
+         _next_lsn += count;
+         addLoaded(first_slot, count);
+
+         pthread_mutex_unlock(&_mutex);
+         return count;
+      }
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      return -1;
+   }
 
    FileFD infile(filename);
-   int count = 0;
 
    if (!infile.openFile(FileFD::readfd))
       return -1;
 
-   // Loop through grabbing the bytes of each plotpt
-   unsigned int size = 0;
-   unsigned int ppsize = DronePlot::getDataSize();
-   while ((size = infile.readBytes<uint8_t>(buf, ppsize)) == ppsize) {
-      _dbdata.emplace_back();
-      dptr = _dbdata.end();
-      dptr--;
-
-      // Deserialize
-      dptr->deserialize(buf);
-      buf.clear();
+   size_t len;
+   const uint8_t *data = infile.mapFile(len, sequential);
+   infile.closeFD();
 
-      count++;
+   // A partial plot at the end means this may be a corrupted file
+   if (((data == NULL) && (len > 0)) || (len % binary_plot_size != 0)) {
+      FileFD::unmapFile(data, len);
+      return -1;
    }
-   
-   // Final read should be size = 0 or this may be a corrupted file
-   if (size != 0) {
+
+   int count = loadBinaryData(data, len / binary_plot_size, NULL, max_threads);
+
+   FileFD::unmapFile(data, len);
+   return count;
+}
+
+/*****************************************************************************************
+ * loadBinaryRange - reads the plots in a time range (and optionally of one drone) out of a
+ *                   binary file and adds them in one batch. A PlotFile is opened for random
+ *                   access and only the blocks its index says could match are decoded
+ *
+ *    Params:  filename - the path/filename of the input file
+ *             t_begin, t_end - inclusive timestamp range to load
+ *             drone_id - the one drone wanted, or all_drones
+ *             max_threads - most decode threads (0 = one per core)
+ *
+ *    Returns: -1 if there was an issue opening the file or it is corrupt, otherwise num
+ *             read in
+ *
+ *****************************************************************************************/
+
+int DronePlotDB::loadBinaryRange(const char *filename, time_t t_begin, time_t t_end,
+                                               unsigned int drone_id, unsigned int max_threads) {
+   std::vector<DronePlot> plots;
+
+   try {
+      PlotFile plotfile(filename);
+      if (plotfile.open()) {
+         plotfile.query(t_begin, t_end, plots, drone_id, max_threads);
+         addPlots(plots);
+         return plots.size();
+      }
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
       return -1;
    }
 
+   // Older files have no index, so every plot is read and checked
+   FileFD infile(filename);
+   if (!infile.openFile(FileFD::readfd))
+      return -1;
+
+   size_t len;
+   const uint8_t *data = infile.mapFile(len, true);
    infile.closeFD();
-   return count; 
+   if (((data == NULL) && (len > 0)) || (len % binary_plot_size != 0)) {
+      FileFD::unmapFile(data, len);
+      return -1;
+   }
+
+   DronePlot plot;
+   for (const uint8_t *rec = data; rec < data + len; rec += binary_plot_size) {
+      const uint8_t *ptr = rec;
+      memcpy(&plot.drone_id, ptr, sizeof(plot.drone_id));
+      ptr += sizeof(plot.drone_id);
+      memcpy(&plot.node_id, ptr, sizeof(plot.node_id));
+      ptr += sizeof(plot.node_id);
+      memcpy(&plot.timestamp, ptr, sizeof(plot.timestamp));
+      ptr += sizeof(plot.timestamp);
+      memcpy(&plot.latitude, ptr, sizeof(plot.latitude));
+      ptr += sizeof(plot.latitude);
+      memcpy(&plot.longitude, ptr, sizeof(plot.longitude));
+
+      if ((plot.timestamp >= t_begin) && (plot.timestamp <= t_end) &&
+          ((drone_id == all_drones) || (plot.drone_id == drone_id)))
+         plots.push_back(plot);
+   }
+   FileFD::unmapFile(data, len);
+
+   addPlots(plots);
+   return plots.size();
+}
+
+// One decode thread's share of a bulk load
+struct decode_range
+{
+   PlotStore *store;
+   const uint8_t *data;       // Plots in the headerless binary layout
+   const uint8_t *flags;      // 2 bytes per plot, or NULL
+   size_t first_slot;         // Slot of plot 0
+   uint64_t first_lsn;        // LSN of plot 0
+   size_t begin, end;         // The plots this thread decodes
+};
+
+/*****************************************************************************************
+ * decodeRange - copies a range of binary plots straight into the rows PlotStore::extend
+ *               set aside, field by field into the columns
+ *****************************************************************************************/
+static void decodeRange(decode_range &range) {
+   for (size_t i = range.begin; i < range.end; i++) {
+      size_t slot = range.first_slot + i;
+      PlotChunk &chunk = range.store->chunkFor(slot);
+      size_t off = slot % plot_chunk_size;
+
+      const uint8_t *rec = range.data + i * binary_plot_size;
+      memcpy(&chunk.drone_id[off], rec, sizeof(chunk.drone_id[off]));
+      rec += sizeof(chunk.drone_id[off]);
+      memcpy(&chunk.node_id[off], rec, sizeof(chunk.node_id[off]));
+      rec += sizeof(chunk.node_id[off]);
+      memcpy(&chunk.timestamp[off], rec, sizeof(chunk.timestamp[off]));
+      rec += sizeof(chunk.timestamp[off]);
+      memcpy(&chunk.latitude[off], rec, sizeof(chunk.latitude[off]));
+      rec += sizeof(chunk.latitude[off]);
+      memcpy(&chunk.longitude[off], rec, sizeof(chunk.longitude[off]));
+
+      if (range.flags != NULL)
+         memcpy(&chunk.flags[off], range.flags + i * sizeof(chunk.flags[off]),
+                                                               sizeof(chunk.flags[off]));
+      else
+         chunk.flags[off] = 0;
+      chunk.lsn[off] = range.first_lsn + i;
+   }
+}
+
+static void *t_decode(void *data) {
+   decodeRange(*static_cast<decode_range *>(data));
+   return NULL;
+}
+
+/*****************************************************************************************
+ * loadBinaryData - bulk-adds plots in the headerless binary layout (an old .bin file or a
+ *                  checkpoint). The rows are allocated in one go and decoded straight into
+ *                  the columns--split across threads for large loads--then logged, hashed
+ *                  and indexed
+ *
+ *    Params:  data - count plots, back to back
+ *             flags - count 2-byte flag values to give the plots, or NULL for none
+ *             max_threads - most decode threads to use (0 = one per core). Loads smaller
+ *                           than parallel_load_plots per thread use fewer
+ *
+ *    Returns: the number of plots added
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *****************************************************************************************/
+
+size_t DronePlotDB::loadBinaryData(const uint8_t *data, size_t count, const uint8_t *flags,
+                                                                   unsigned int max_threads) {
+   if (count == 0)
+      return 0;
+
+   unsigned int threads = (max_threads > 0) ? max_threads : sysconf(_SC_NPROCESSORS_ONLN);
+   threads = std::max(1u, std::min({threads, max_load_threads,
+                                    (unsigned int) (count / parallel_load_plots)}));
+
+   pthread_mutex_lock(&_mutex);
+
+   size_t first_slot = _dbdata.extend(count);
+   uint64_t first_lsn = _next_lsn;
+   _next_lsn += count;
+
+   std::vector<decode_range> ranges(threads);
+   std::vector<pthread_t> tids(threads);
+   unsigned int started = 0;
+   for (unsigned int i = 0; i < threads; i++) {
+      ranges[i] = {&_dbdata, data, flags, first_slot, first_lsn, count * i / threads,
+                                                                 count * (i + 1) / threads};
+
+      // The last range, and any a thread couldn't be started for, are decoded here
+      if ((i + 1 == threads) || (pthread_create(&tids[started], NULL, t_decode,
+                                                              (void *) &ranges[i]) != 0))
+         decodeRange(ranges[i]);
+      else
+         started++;
+   }
+   for (unsigned int i = 0; i < started; i++)
+      pthread_join(tids[i], NULL);
+
+   addLoaded(first_slot, count);
+
+   pthread_mutex_unlock(&_mutex);
+   return count;
+}
+
+/*****************************************************************************************
+ * addLoaded - records rows a bulk load decoded straight into the store in the change log,
+ *             index and hash tree, and logs them to the WAL. Bulk loads aren't deconflicted,
+ *             but the plots go into the DeconflictIndex so later ones are checked against
+ *             them
+ *
+ *    Params:  first_slot, count - the rows, already holding their plots and LSNs
+ *
+ *    Note: the mutex must already be locked by the caller
+ *****************************************************************************************/
+
+void DronePlotDB::addLoaded(size_t first_slot, size_t count) {
+   _changelog.reserve(_changelog.size() + count);
+   DronePlot plot;
+   for (size_t slot = first_slot; slot < first_slot + count; slot++) {
+      _changelog.push_back(slot);
+      if (_index_valid)
+         indexPlot(slot);
+      hashPlot(slot);
+
+      if ((_dc_policy != DeconflictIndex::dc_off) || (_wal != NULL)) {
+         PlotRef row = _dbdata.at(slot);
+         if (_dc_policy != DeconflictIndex::dc_off)
+            _deconflict.add(row.drone_id, row.node_id, row.timestamp, row.latitude,
+                                                             row.longitude, row.getLSN());
+         if (_wal != NULL) {
+            row.getPlot(plot);
+            _wal->append(plot);
+         }
+      }
+   }
 }
 
 /*****************************************************************************************
@@ -409,7 +708,15 @@ void DronePlotDB::popFront() {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
-   _dbdata.pop_front();
+   if (_dbdata.size() > 0) {
+      if (_index_valid)
+         unindexPlot(_dbdata.firstSlot());
+      unhashPlot(_dbdata.firstSlot());
+      _changelog[_dbdata.at(_dbdata.firstSlot()).getLSN() - 1] = no_slot;
+      if (_wal != NULL)
+         _wal->requestCheckpoint();
+   }
+   _dbdata.popFront();
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
@@ -418,7 +725,7 @@ void DronePlotDB::popFront() {
 /*****************************************************************************************
  * erase - removes the DronePlot at the specified index
  *
- *    Warning: this has up to linear time speed--better to use iterators when possible
+ *    Warning: this has up to linear time speed as later plots are shifted down
  *
  *    Note: this locks the mutex and may block if it is already locked.
  *
@@ -428,13 +735,17 @@ void DronePlotDB::erase(unsigned int i) {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
-   if (i > _dbdata.size())
-      throw std::runtime_error("erase function called with index out of scope for std::list.");
-
-   std::list<DronePlot>::iterator diter = _dbdata.begin();
-   for (unsigned int x=0; x<i; x++, diter++);
+   if (i >= _dbdata.size()) {
+      pthread_mutex_unlock(&_mutex);
+      throw std::runtime_error("erase function called with index out of scope for the database.");
+   }
 
-   _dbdata.erase(diter);
+   unhashPlot(_dbdata.firstSlot() + i);
+   _dbdata.erase(_dbdata.firstSlot() + i);
+   _index_valid = false;
+   remapChangeLog();
+   if (_wal != NULL)
+      _wal->requestCheckpoint();
 
 
    // Unlock the mutex before we exit
@@ -444,17 +755,25 @@ void DronePlotDB::erase(unsigned int i) {
 /*****************************************************************************************
  * erase - removes the DronePlot at the location pointed to by the iterator
  *
- *    Returns: an iterator pointing to the next element in the list
+ *    Returns: an iterator pointing to the next element in the database
  *
- *    Note: this locks the mutex and may block if it is already locked.
+ *    Note: this locks the mutex and may block if it is already locked. Linear time, so
+ *          use removeNodeID-style bulk removal when deleting many plots
  *
  *****************************************************************************************/
 
-std::list<DronePlot>::iterator DronePlotDB::erase(std::list<DronePlot>::iterator dptr) {
+DronePlotDB::iterator DronePlotDB::erase(iterator dptr) {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
-   auto retptr = _dbdata.erase(dptr);
+   // Later plots shift down into this slot, so the same position is the next element
+   unhashPlot(dptr.getSlot());
+   _dbdata.erase(dptr.getSlot());
+   _index_valid = false;
+   remapChangeLog();
+   if (_wal != NULL)
+      _wal->requestCheckpoint();
+   iterator retptr = dptr;
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
@@ -467,12 +786,19 @@ std::list<DronePlot>::iterator DronePlotDB::erase(std::list<DronePlot>::iterator
 void DronePlotDB::removeNodeID(unsigned int node_id) {
    pthread_mutex_lock(&_mutex);
 
-   auto del_iter = _dbdata.begin();
-   while (del_iter != _dbdata.end()) {
-      if (del_iter->node_id == node_id)
-         del_iter = _dbdata.erase(del_iter);
-      else
-         del_iter++;
+   auto match = [this, node_id](PlotRef &plot) {
+      if (plot.node_id != node_id)
+         return false;
+      _hashtree.remove(plot.drone_id, plot.timestamp, PlotHashTree::plotHash(plot.drone_id,
+                              plot.node_id, plot.timestamp, plot.latitude, plot.longitude));
+      return true;
+   };
+
+   if (_dbdata.removeIf(match) > 0) {
+      _index_valid = false;
+      remapChangeLog();
+      if (_wal != NULL)
+         _wal->requestCheckpoint();
    }
 
    pthread_mutex_unlock(&_mutex);
@@ -486,7 +812,9 @@ void DronePlotDB::removeNodeID(unsigned int node_id) {
 void DronePlotDB::sortByTime() {
    pthread_mutex_lock(&_mutex);
 
-   _dbdata.sort(compare_plot);
+   _dbdata.sortByTime();
+   _index_valid = false;
+   remapChangeLog();
 
    pthread_mutex_unlock(&_mutex);
 }
@@ -497,6 +825,630 @@ void DronePlotDB::sortByTime() {
 
 void DronePlotDB::clear() {
    _dbdata.clear();
+   _drone_index.clear();
+   _index_valid = false;
+   _hashtree.clear();
+   _deconflict.clear();
+   _dc_seen.clear();
+
+   // LSNs are never reused, the cleared plots just no longer have a slot
+   std::fill(_changelog.begin(), _changelog.end(), no_slot);
+
+   if (_wal != NULL)
+      _wal->requestCheckpoint();
+}
+
+/*****************************************************************************************
+ * getPlotsSince - gets the plots that were added after a given LSN by walking the change
+ *                 log, so the cost depends on how many plots were added, not the db size
+ *
+ *    Params:  after_lsn - return plots with an LSN greater than this (0 = from the start)
+ *             plots - matching plots are appended here in the order they were added
+ *             excl_flags - plots with any of these DBFLAG_ flags set are skipped
+ *             max_plots - stop after this many plots (0 = no limit)
+ *             through_lsn - stop after this LSN (0 = no limit), for reading a fixed range of
+ *                           the log in pieces while plots are still being added
+ *
+ *    Returns: the LSN that was read up to. Pass it back in as after_lsn to continue
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *****************************************************************************************/
+
+uint64_t DronePlotDB::getPlotsSince(uint64_t after_lsn, std::vector<DronePlot> &plots,
+                           unsigned short excl_flags, size_t max_plots, uint64_t through_lsn) {
+   pthread_mutex_lock(&_mutex);
+
+   uint64_t lsn = after_lsn;
+   uint64_t last_lsn = _changelog.size();
+   if ((through_lsn > 0) && (through_lsn < last_lsn))
+      last_lsn = through_lsn;
+
+   size_t count = 0;
+   DronePlot plot;
+
+   while ((lsn < last_lsn) && ((max_plots == 0) || (count < max_plots))) {
+      size_t slot = _changelog[lsn++];
+      if (slot == no_slot)
+         continue;
+
+      PlotRef row = _dbdata.at(slot);
+      if (row.isFlagSet(excl_flags))
+         continue;
+
+      row.getPlot(plot);
+      plots.push_back(plot);
+      count++;
+   }
+
+   pthread_mutex_unlock(&_mutex);
+   return lsn;
+}
+
+void DronePlotDB::attachWAL(PlotWAL *wal) {
+   pthread_mutex_lock(&_mutex);
+   _wal = wal;
+   pthread_mutex_unlock(&_mutex);
+}
+
+void DronePlotDB::setDeconflict(DeconflictIndex::policy policy) {
+   pthread_mutex_lock(&_mutex);
+   _dc_policy = policy;
+   if (policy == DeconflictIndex::dc_off)
+      _deconflict.clear();
+   pthread_mutex_unlock(&_mutex);
+}
+
+void DronePlotDB::getDeconflictStats(uint64_t &dropped, uint64_t &flagged) {
+   pthread_mutex_lock(&_mutex);
+   dropped = _dc_dropped;
+   flagged = _dc_flagged;
+   pthread_mutex_unlock(&_mutex);
+}
+
+uint64_t DronePlotDB::setClockAdjust(time_t secs) {
+   pthread_mutex_lock(&_mutex);
+   _clock_adjust = secs;
+   uint64_t lsn = _next_lsn - 1;
+   pthread_mutex_unlock(&_mutex);
+   return lsn;
+}
+
+/*****************************************************************************************
+ * deconflict - looks the plot up in the DeconflictIndex and applies the policy to the
+ *              matches: dc_drop turns a peer's plot away if there are any (and remembers
+ *              it, counted in the hash tree as if it were held), dc_keep_lowest flags it
+ *              DBFLAG_DUP if one is from a lower node ID and flags the ones from higher
+ *              node IDs. Matches whose plot has since been removed from the database are
+ *              taken out of the index
+ *
+ *    Returns: false if the plot should not be added
+ *
+ *    Note: the mutex must already be locked by the caller
+ *****************************************************************************************/
+
+bool DronePlotDB::deconflict(DronePlot &plot) {
+   bool droppable = (_dc_policy == DeconflictIndex::dc_drop) && plot.isFlagSet(DBFLAG_SYNCD);
+   uint64_t hash = 0;
+   if (droppable) {
+      hash = PlotHashTree::plotHash(plot.drone_id, plot.node_id, plot.timestamp,
+                                                       plot.latitude, plot.longitude);
+      if (_dc_seen.count(hash) > 0)
+         return false;
+   }
+
+   std::vector<DeconflictIndex::entry> matches;
+   _deconflict.find(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude,
+                                                             plot.longitude, matches);
+
+   for (auto &match : matches) {
+      size_t slot = _changelog[match.lsn - 1];
+      if (slot == no_slot) {
+         _deconflict.remove(plot.drone_id, match.latitude, match.longitude, match.lsn);
+         continue;
+      }
+
+      if (_dc_policy == DeconflictIndex::dc_drop) {
+         if (!droppable)
+            continue;
+
+         _dc_dropped++;
+         _dc_seen.emplace(hash, std::make_pair(plot.drone_id, plot.timestamp));
+         _hashtree.add(plot.drone_id, plot.timestamp, hash);
+         return false;
+      }
+
+      if (match.node_id < plot.node_id) {
+         if (!plot.isFlagSet(DBFLAG_DUP)) {
+            plot.setFlags(DBFLAG_DUP);
+            _dc_flagged++;
+         }
+      } else {
+         PlotRef row = _dbdata.at(slot);
+         if (!row.isFlagSet(DBFLAG_DUP)) {
+            row.setFlags(DBFLAG_DUP);
+            _dc_flagged++;
+         }
+      }
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * checkpointPlots - copies every plot out, flags included, for PlotWAL to write as a
+ *                   checkpoint. The WAL is rotated before the mutex is released, so no plot
+ *                   can be added between the copy and the start of the new segment
+ *
+ *    Params:  plots - the plots are appended here in store order
+ *
+ *    Returns: the WAL segment that holds everything added after the copy (0 if no WAL)
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *****************************************************************************************/
+
+uint64_t DronePlotDB::checkpointPlots(std::vector<DronePlot> &plots) {
+   pthread_mutex_lock(&_mutex);
+
+   plots.reserve(plots.size() + _dbdata.size());
+
+   DronePlot plot;
+   for (size_t i = 0; i < _dbdata.numChunks(); i++) {
+      PlotChunk &chunk = _dbdata.getChunk(i);
+      size_t begin_off, end_off;
+      _dbdata.getChunkRange(i, begin_off, end_off);
+
+      for (size_t j = begin_off; j < end_off; j++) {
+         plot.drone_id = chunk.drone_id[j];
+         plot.node_id = chunk.node_id[j];
+         plot.timestamp = chunk.timestamp[j];
+         plot.latitude = chunk.latitude[j];
+         plot.longitude = chunk.longitude[j];
+         plot.clrFlags(0xFFFF);
+         plot.setFlags(chunk.flags[j]);
+         plots.push_back(plot);
+      }
+   }
+
+   uint64_t segment = (_wal != NULL) ? _wal->rotate() : 0;
+
+   pthread_mutex_unlock(&_mutex);
+   return segment;
+}
+
+/*****************************************************************************************
+ * appendPlot - adds the plot to the end of the store with the next LSN, records it in the
+ *              change log, the per-drone index, the hash tree and the WAL. Deconflicts it
+ *              first if that is on
+ *
+ *    Params:  index - false if the caller indexes the plot itself. Its drone's run of the
+ *                     index is still created, so that needs only adding to
+ *
+ *    Returns: the slot the plot was stored in, or no_slot if it was dropped as a duplicate
+ *
+ *    Note: the mutex must already be locked by the caller (or the db not yet shared)
+ *****************************************************************************************/
+
+size_t DronePlotDB::appendPlot(DronePlot &plot, bool index) {
+   if ((_dc_policy != DeconflictIndex::dc_off) && !deconflict(plot))
+      return no_slot;
+
+   size_t slot = _dbdata.append(plot, _next_lsn++);
+   _changelog.push_back(slot);
+
+   if (_dc_policy != DeconflictIndex::dc_off)
+      _deconflict.add(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude,
+                                                        plot.longitude, _next_lsn - 1);
+
+   if (!index)
+      _drone_index[plot.drone_id];
+   else if (_index_valid)
+      indexPlot(slot);
+   hashPlot(slot);
+
+   if (_wal != NULL)
+      _wal->append(plot);
+   return slot;
+}
+
+/*****************************************************************************************
+ * remapChangeLog - after the store's rows have been moved (sort, erase), points every
+ *                  change log entry at the new slot of its plot. Linear time.
+ *
+ *    Note: the mutex must already be locked by the caller
+ *****************************************************************************************/
+
+void DronePlotDB::remapChangeLog() {
+   std::fill(_changelog.begin(), _changelog.end(), no_slot);
+
+   for (size_t i = _dbdata.firstSlot(); i < _dbdata.endSlot(); i++)
+      _changelog[_dbdata.at(i).getLSN() - 1] = i;
+}
+
+/*****************************************************************************************
+ * queryDrone - gets the flight path of a drone over a time range from the per-drone index.
+ *              Builds the index first if this is the first query since it was invalidated.
+ *
+ *    Params:  drone_id - the drone to look up
+ *             t_begin, t_end - inclusive timestamp range to return
+ *             plots - the matching plots are appended here in timestamp order
+ *
+ *    Returns: number of plots found
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *****************************************************************************************/
+
+size_t DronePlotDB::queryDrone(unsigned int drone_id, time_t t_begin, time_t t_end,
+                                                         std::vector<DronePlot> &plots) {
+   size_t count = 0;
+
+   pthread_mutex_lock(&_mutex);
+
+   if (!_index_valid)
+      buildIndex();
+
+   auto drone_it = _drone_index.find(drone_id);
+   if (drone_it != _drone_index.end()) {
+      auto run_it = drone_it->second.lower_bound(t_begin);
+      auto run_end = drone_it->second.upper_bound(t_end);
+
+      DronePlot plot;
+      for ( ; run_it != run_end; run_it++) {
+         _dbdata.at(run_it->second).getPlot(plot);
+         plots.push_back(plot);
+         count++;
+      }
+   }
+
+   pthread_mutex_unlock(&_mutex);
+   return count;
+}
+
+struct merge_crew;
+
+// One merge job: the plots of a batch whose drone IDs fall in its partition, so no two jobs
+// touch the same drone's run of the index
+struct merge_job
+{
+   std::vector<DronePlot> *plots;
+   std::vector<size_t> members;           // The job's positions in the batch, in order
+   std::map<unsigned int, std::multimap<time_t, size_t>> *index;
+   PlotStore *store;
+   std::vector<uint64_t> *hashes;         // plotHash of each batch plot
+   std::vector<uint8_t> *fresh;           // Not already stored or earlier in the batch
+   std::vector<size_t> *slots;            // Where each batch plot was stored, or no_slot
+   merge_crew *crew;                      // The threads the jobs are run on
+};
+
+// The threads a large batch's jobs are run on. They are started before the database is
+// locked and then kept in step with the merging thread at the barrier
+struct merge_crew
+{
+   pthread_mutex_t gate;                  // Held until the barrier is set up
+   pthread_barrier_t barrier;             // The workers and the merging thread
+};
+
+/*****************************************************************************************
+ * findNew - hashes a job's plots and marks the ones that are neither in the store (looked
+ *           up in their drone's run of the index) nor earlier in the batch. Copies within the
+ *           batch are found by sorting the rest on their hashes. Only reads the database
+ *****************************************************************************************/
+static void *t_findNew(void *data) {
+   merge_job &job = *static_cast<merge_job *>(data);
+   std::vector<DronePlot> &plots = *job.plots;
+   std::vector<std::pair<uint64_t, size_t>> unheld;
+
+   for (size_t i : job.members) {
+      DronePlot &plot = plots[i];
+      uint64_t hash = PlotHashTree::plotHash(plot.drone_id, plot.node_id, plot.timestamp,
+                                                         plot.latitude, plot.longitude);
+      (*job.hashes)[i] = hash;
+
+      bool held = false;
+      auto drone_it = job.index->find(plot.drone_id);
+      if (drone_it != job.index->end()) {
+         auto range = drone_it->second.equal_range(plot.timestamp);
+         for (auto run_it = range.first; !held && (run_it != range.second); run_it++) {
+            PlotRef row = job.store->at(run_it->second);
+            held = (row.node_id == plot.node_id) && (row.latitude == plot.latitude) &&
+                                                    (row.longitude == plot.longitude);
+         }
+      }
+
+      (*job.fresh)[i] = !held;
+      if (!held)
+         unheld.emplace_back(hash, i);
+   }
+
+   // Equal plots have equal hashes, and sort together with the first in the batch leading
+   std::sort(unheld.begin(), unheld.end());
+   for (size_t run = 0, end = 0; run < unheld.size(); run = end) {
+      for (end = run + 1; (end < unheld.size()) && (unheld[end].first == unheld[run].first); end++) {
+         DronePlot &plot = plots[unheld[end].second];
+         for (size_t j = run; j < end; j++) {
+            DronePlot &other = plots[unheld[j].second];
+            if ((*job.fresh)[unheld[j].second] && (other.node_id == plot.node_id) &&
+                     (other.timestamp == plot.timestamp) && (other.latitude == plot.latitude) &&
+                     (other.longitude == plot.longitude)) {
+               (*job.fresh)[unheld[end].second] = false;
+               break;
+            }
+         }
+      }
+   }
+   return NULL;
+}
+
+/*****************************************************************************************
+ * indexNew - adds a job's stored plots to their drones' runs of the index. The runs already
+ *            exist, so the index's map of drones isn't changed
+ *****************************************************************************************/
+static void *t_indexNew(void *data) {
+   merge_job &job = *static_cast<merge_job *>(data);
+
+   for (size_t i : job.members) {
+      size_t slot = (*job.slots)[i];
+      if (slot != no_slot) {
+         DronePlot &plot = (*job.plots)[i];
+         job.index->find(plot.drone_id)->second.emplace(plot.timestamp, slot);
+      }
+   }
+   return NULL;
+}
+
+/*****************************************************************************************
+ * mergeJob - a merge job's worker thread. Waits at the barrier for the batch to be
+ *            partitioned, finds the job's new plots, waits while the merging thread stores
+ *            them, then indexes them
+ *****************************************************************************************/
+static void *t_mergeJob(void *data) {
+   merge_crew &crew = *static_cast<merge_job *>(data)->crew;
+
+   pthread_mutex_lock(&crew.gate);
+   pthread_mutex_unlock(&crew.gate);
+
+   pthread_barrier_wait(&crew.barrier);
+   t_findNew(data);
+   pthread_barrier_wait(&crew.barrier);
+   pthread_barrier_wait(&crew.barrier);
+   t_indexNew(data);
+   return NULL;
+}
+
+/*****************************************************************************************
+ * mergePlots - applies a replicated batch under one lock. The batch is partitioned by
+ *              drone_id across the merge jobs, which find the plots that are new and, once
+ *              those are stored, index them. In between, one pass in batch order hands each
+ *              new plot to appendPlot, as the store, change log, hash tree and WAL are shared
+ *              by every drone
+ *
+ *    Params:  plots - the batch. Their flags are set to flags and, unless that includes
+ *                     DBFLAG_SYNCD, the clock adjustment is added, as addPlot does
+ *             is_new - set for each plot that wasn't already held or dropped before (a
+ *                      plot deconfliction drops now is still new)
+ *             max_threads - most merge jobs (0 = one per core). Batches smaller than
+ *                           parallel_merge_plots per job use fewer, and a batch with one
+ *                           job is merged on this thread alone
+ *
+ *    Returns: the number of plots stored
+ *
+ *    Note: this locks the mutex and may block if it is already locked. The worker threads
+ *          are started before it is locked
+ *****************************************************************************************/
+
+size_t DronePlotDB::mergePlots(std::vector<DronePlot> &plots, unsigned short flags,
+                                    std::vector<bool> &is_new, unsigned int max_threads) {
+   size_t count = plots.size();
+   is_new.assign(count, false);
+   if (count == 0)
+      return 0;
+
+   unsigned int threads = (max_threads > 0) ? max_threads : sysconf(_SC_NPROCESSORS_ONLN);
+   threads = std::max(1u, std::min({threads, max_merge_threads,
+                                    (unsigned int) (count / parallel_merge_plots)}));
+
+   std::vector<uint64_t> hashes(count);
+   std::vector<uint8_t> fresh(count);
+   std::vector<size_t> slots(count, no_slot);
+
+   merge_crew crew;
+   std::vector<merge_job> jobs(threads);
+   for (auto &job : jobs)
+      job = {&plots, {}, &_drone_index, &_dbdata, &hashes, &fresh, &slots, &crew};
+
+   // Every job but the last gets a worker if one can be started. The rest run here
+   std::vector<pthread_t> tids(threads);
+   unsigned int started = 0;
+   if (threads > 1) {
+      pthread_mutex_init(&crew.gate, NULL);
+      pthread_mutex_lock(&crew.gate);
+      while ((started + 1 < threads) && (pthread_create(&tids[started], NULL, t_mergeJob,
+                                                           (void *) &jobs[started]) == 0))
+         started++;
+      pthread_barrier_init(&crew.barrier, NULL, started + 1);
+      pthread_mutex_unlock(&crew.gate);
+   }
+
+   pthread_mutex_lock(&_mutex);
+
+   for (size_t i = 0; i < count; i++) {
+      plots[i].clrFlags(plots[i].getFlags());
+      plots[i].setFlags(flags);
+      if (!(flags & DBFLAG_SYNCD))
+         plots[i].timestamp += _clock_adjust;
+      jobs[plots[i].drone_id % threads].members.push_back(i);
+   }
+
+   if (!_index_valid)
+      buildIndex();
+
+   if (started > 0)
+      pthread_barrier_wait(&crew.barrier);
+   for (unsigned int i = started; i < threads; i++)
+      t_findNew((void *) &jobs[i]);
+   if (started > 0)
+      pthread_barrier_wait(&crew.barrier);
+
+   size_t added = 0;
+   _changelog.reserve(_changelog.size() + count);
+   for (size_t i = 0; i < count; i++) {
+      if (!fresh[i] || (_dc_seen.count(hashes[i]) > 0))
+         continue;
+      is_new[i] = true;
+
+      slots[i] = appendPlot(plots[i], false);
+      if (slots[i] != no_slot)
+         added++;
+   }
+
+   if (started > 0)
+      pthread_barrier_wait(&crew.barrier);
+   for (unsigned int i = started; i < threads; i++)
+      t_indexNew((void *) &jobs[i]);
+   for (unsigned int i = 0; i < started; i++)
+      pthread_join(tids[i], NULL);
+
+   pthread_mutex_unlock(&_mutex);
+
+   if (threads > 1) {
+      pthread_barrier_destroy(&crew.barrier);
+      pthread_mutex_destroy(&crew.gate);
+   }
+   return added;
+}
+
+/*****************************************************************************************
+ * hasPlot - looks the plot up in the per-drone index by timestamp and compares the rest of
+ *           its attributes. Used to make applying replicated plots idempotent
+ *
+ *    Params:  excl_flags - a match with any of these DBFLAG_ flags set doesn't count
+ *
+ *    Returns: true if an identical plot (flags aside) is already in the database
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *****************************************************************************************/
+
+bool DronePlotDB::hasPlot(DronePlot &plot, unsigned short excl_flags) {
+   bool found = false;
+
+   pthread_mutex_lock(&_mutex);
+
+   if (!_index_valid)
+      buildIndex();
+
+   auto drone_it = _drone_index.find(plot.drone_id);
+   if (drone_it != _drone_index.end()) {
+      auto range = drone_it->second.equal_range(plot.timestamp);
+      for (auto run_it = range.first; !found && (run_it != range.second); run_it++) {
+         PlotRef row = _dbdata.at(run_it->second);
+         found = (row.node_id == plot.node_id) && (row.latitude == plot.latitude) &&
+                  (row.longitude == plot.longitude) && !row.isFlagSet(excl_flags);
+      }
+   }
+
+   pthread_mutex_unlock(&_mutex);
+   return found;
+}
+
+/*****************************************************************************************
+ * reindex - marks the per-drone index stale so it gets rebuilt by the next query, and
+ *           rebuilds the hash tree. Needed after plot attributes are changed through the
+ *           iterators.
+ *****************************************************************************************/
+
+void DronePlotDB::reindex() {
+   pthread_mutex_lock(&_mutex);
+
+   _drone_index.clear();
+   _index_valid = false;
+
+   _hashtree.clear();
+   for (size_t i = _dbdata.firstSlot(); i < _dbdata.endSlot(); i++)
+      hashPlot(i);
+   for (auto &seen : _dc_seen)
+      _hashtree.add(seen.second.first, seen.second.second, seen.first);
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * getSyncDrones - appends the hash tree's per-drone sums
+ * getSyncBuckets - appends the hash tree's per-bucket sums for one drone
+ *
+ *    Params:  before - only count buckets that start before this timestamp
+ *
+ *    Note: these lock the mutex and may block if it is already locked.
+ *****************************************************************************************/
+
+void DronePlotDB::getSyncDrones(std::vector<sync_entry> &entries, time_t before) {
+   pthread_mutex_lock(&_mutex);
+   _hashtree.getDroneSums(entries, before);
+   pthread_mutex_unlock(&_mutex);
+}
+
+void DronePlotDB::getSyncBuckets(unsigned int drone_id, std::vector<sync_entry> &entries,
+                                                                           time_t before) {
+   pthread_mutex_lock(&_mutex);
+   _hashtree.getBucketSums(drone_id, entries, before);
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * hashPlot - adds the plot at slot to the hash tree
+ * unhashPlot - takes the plot at slot out of the hash tree
+ *
+ *    Note: the mutex must already be locked by the caller
+ *****************************************************************************************/
+
+void DronePlotDB::hashPlot(size_t slot) {
+   PlotRef plot = _dbdata.at(slot);
+   _hashtree.add(plot.drone_id, plot.timestamp, PlotHashTree::plotHash(plot.drone_id,
+                              plot.node_id, plot.timestamp, plot.latitude, plot.longitude));
+}
+
+void DronePlotDB::unhashPlot(size_t slot) {
+   PlotRef plot = _dbdata.at(slot);
+   _hashtree.remove(plot.drone_id, plot.timestamp, PlotHashTree::plotHash(plot.drone_id,
+                              plot.node_id, plot.timestamp, plot.latitude, plot.longitude));
+}
+
+/*****************************************************************************************
+ * indexPlot - adds the plot at slot to its drone's time-ordered run
+ * unindexPlot - removes the plot at slot from its drone's run
+ * buildIndex - rebuilds the whole per-drone index from the store
+ *
+ *    Note: the mutex must already be locked by the caller
+ *****************************************************************************************/
+
+void DronePlotDB::indexPlot(size_t slot) {
+   PlotRef plot = _dbdata.at(slot);
+   _drone_index[plot.drone_id].emplace(plot.timestamp, slot);
+}
+
+void DronePlotDB::unindexPlot(size_t slot) {
+   PlotRef plot = _dbdata.at(slot);
+
+   auto drone_it = _drone_index.find(plot.drone_id);
+   if (drone_it == _drone_index.end())
+      return;
+
+   auto range = drone_it->second.equal_range(plot.timestamp);
+   for (auto run_it = range.first; run_it != range.second; run_it++) {
+      if (run_it->second == slot) {
+         drone_it->second.erase(run_it);
+         break;
+      }
+   }
+
+   if (drone_it->second.empty())
+      _drone_index.erase(drone_it);
+}
+
+void DronePlotDB::buildIndex() {
+   _drone_index.clear();
+
+   for (size_t i = _dbdata.firstSlot(); i < _dbdata.endSlot(); i++)
+      indexPlot(i);
+
+   _index_valid = true;
 }
 
 
@@ -6,6 +6,8 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "FileDesc.h"
 #include "strfuncts.h"
@@ -130,6 +132,19 @@ ssize_t FileDesc::writeFD(const char *data, unsigned int len) {
    return write(_fd, data, len);
 }
 
+/*****************************************************************************************
+ * writevFD - writes the list of buffers to the FD in one system call
+ *
+ *    Params: iov - array of buffers (base pointer, length)
+ *            iovcnt - number of buffers in the array
+ *
+ *    Returns: returns the amount written for success, -1 for failure
+ *****************************************************************************************/
+
+ssize_t FileDesc::writevFD(const struct iovec *iov, int iovcnt) {
+   return writev(_fd, iov, iovcnt);
+}
+
 /*************************************************************************************
  * isOpen - determines if the file descriptor is open for both reading and writing
  *          
@@ -274,6 +289,45 @@ bool SocketFD::acceptFD(SocketFD &server) {
    return true;
 }
 
+/*****************************************************************************************
+ * readInto - reads what is already waiting on the socket (MSG_DONTWAIT) directly into the
+ *            free space at the end of buf, with no intermediate copy
+ *
+ *    Params:  buf - the read data is committed to the end of this buffer
+ *             max - the most bytes to read in this call (buf grows to fit if needed)
+ *
+ *    Returns: number of bytes read, 0 if the connection was closed, -1 for an error
+ *****************************************************************************************/
+
+ssize_t SocketFD::readInto(ByteBuffer &buf, size_t max) {
+   uint8_t *dst = buf.writePtr(max);
+
+   ssize_t results = recv(_fd, dst, buf.writable(), MSG_DONTWAIT);
+   if (results > 0)
+      buf.commit(results);
+   return results;
+}
+
+/*****************************************************************************************
+ * sendvFD - gathers the buffers into one send (sendmsg). MSG_NOSIGNAL keeps a write to a
+ *           connection the other side has closed from killing the process with SIGPIPE.
+ *
+ *    Params: iov - array of buffers (base pointer, length)
+ *            iovcnt - number of buffers in the array
+ *
+ *    Returns: bytes sent, or -1 for failure (errno EAGAIN/EWOULDBLOCK if the socket is
+ *             non-blocking and its send buffer is full)
+ *****************************************************************************************/
+
+ssize_t SocketFD::sendvFD(const struct iovec *iov, int iovcnt) {
+   msghdr msg;
+   bzero(&msg, sizeof(msg));
+   msg.msg_iov = const_cast<struct iovec *>(iov);
+   msg.msg_iovlen = iovcnt;
+
+   return sendmsg(_fd, &msg, MSG_NOSIGNAL);
+}
+
 /*****************************************************************************************
  * getIPAddr - returns the IP address of this FD in big endian format
  *
@@ -395,3 +449,47 @@ ssize_t FileDesc::readStr(std::string &buf) {
    return buf.size();
 }
 
+/******************************************************************************************
+ * mapFile - maps the file into memory so it can be read in place, without a read() or a
+ *           copy per record
+ *
+ *    Params:  len - set to the file's size
+ *             sequential - madvise(MADV_SEQUENTIAL) the mapping
+ *
+ *    Returns: the start of the mapping, or NULL if the file is empty or mmap failed
+ *
+ ******************************************************************************************/
+
+const uint8_t *FileFD::mapFile(size_t &len, bool sequential) {
+   struct stat st;
+
+   len = 0;
+   if (fstat(_fd, &st) == -1)
+      return NULL;
+
+   len = st.st_size;
+   if (len == 0)
+      return NULL;
+
+   void *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, _fd, 0);
+   if (addr == MAP_FAILED)
+      return NULL;
+
+   if (sequential)
+      madvise(addr, len, MADV_SEQUENTIAL);
+   return (const uint8_t *) addr;
+}
+
+void FileFD::unmapFile(const uint8_t *data, size_t len) {
+   if (data != NULL)
+      munmap((void *) data, len);
+}
+
+void FileFD::releaseMapped(const uint8_t *data, size_t len) {
+   uintptr_t page = sysconf(_SC_PAGESIZE);
+   uintptr_t begin = ((uintptr_t) data + page - 1) / page * page;
+   uintptr_t end = ((uintptr_t) data + len) / page * page;
+
+   if ((data != NULL) && (end > begin))
+      madvise((void *) begin, end - begin, MADV_DONTNEED);
+}
@@ -0,0 +1,128 @@
+#include <arpa/inet.h>
+#include <cstring>
+#include "Frame.h"
+
+/*****************************************************************************************
+ * Frame (constructor) - empty header, filled in by parse
+ *****************************************************************************************/
+Frame::Frame():
+               version(0),
+               type(0),
+               flags(0),
+               length(0),
+               checksum(0)
+{
+
+}
+
+/*****************************************************************************************
+ * encodeHeader - writes the header for a payload into hdr
+ *
+ *    Params:  hdr - at least frame_header_size bytes
+ *             type - frame_type of the message
+ *             payload, len - the message data (used for the length and checksum, payload
+ *                            only if the checksum is used)
+ *             flags - per-type flags
+ *****************************************************************************************/
+void Frame::encodeHeader(uint8_t *hdr, uint8_t type, const uint8_t *payload, size_t len,
+                                                                           uint16_t flags) {
+   uint16_t n_flags = htons(flags);
+   uint32_t n_length = htonl((uint32_t) len);
+   uint32_t n_checksum = (flags & frame_flag_nocrc) ? 0 : htonl(crc32(payload, len));
+
+   hdr[0] = frame_version;
+   hdr[1] = type;
+   memcpy(&hdr[2], &n_flags, sizeof(n_flags));
+   memcpy(&hdr[4], &n_length, sizeof(n_length));
+   memcpy(&hdr[8], &n_checksum, sizeof(n_checksum));
+}
+
+/*****************************************************************************************
+ * append - adds the header and payload to the end of out
+ *
+ *    Params:  out - the buffer the frame is appended to
+ *             type - frame_type of the message
+ *             payload, len - the message data
+ *             flags - per-type flags
+ *****************************************************************************************/
+void Frame::append(std::vector<uint8_t> &out, uint8_t type, const uint8_t *payload, size_t len,
+                                                                           uint16_t flags) {
+   uint8_t hdr[frame_header_size];
+   encodeHeader(hdr, type, payload, len, flags);
+
+   out.reserve(out.size() + frame_header_size + len);
+   out.insert(out.end(), hdr, hdr + frame_header_size);
+   out.insert(out.end(), payload, payload + len);
+}
+
+void Frame::append(std::vector<uint8_t> &out, uint8_t type, const std::vector<uint8_t> &payload,
+                                                                           uint16_t flags) {
+   append(out, type, payload.data(), payload.size(), flags);
+}
+
+/*****************************************************************************************
+ * parse - reads the frame header at the front of data. The header fields are valid after
+ *         any return other than -1 once frame_header_size bytes are available.
+ *
+ *    Params:  data - start of the receive buffer
+ *             len - number of bytes in the buffer
+ *
+ *    Returns: 1 if a complete frame is present, 0 if more data is needed, -1 if the header
+ *             is bad (version, size) or the payload checksum does not match
+ *****************************************************************************************/
+int Frame::parse(const uint8_t *data, size_t len) {
+   if (len < frame_header_size)
+      return 0;
+
+   uint16_t n_flags;
+   uint32_t n_length, n_checksum;
+
+   version = data[0];
+   type = data[1];
+   memcpy(&n_flags, &data[2], sizeof(n_flags));
+   memcpy(&n_length, &data[4], sizeof(n_length));
+   memcpy(&n_checksum, &data[8], sizeof(n_checksum));
+   flags = ntohs(n_flags);
+   length = ntohl(n_length);
+   checksum = ntohl(n_checksum);
+
+   // Catch garbage before waiting on a payload that will never come
+   if ((version != frame_version) || (length > max_frame_payload))
+      return -1;
+
+   if (len < getSize())
+      return 0;
+
+   if (!(flags & frame_flag_nocrc) && (crc32(data + frame_header_size, length) != checksum))
+      return -1;
+
+   return 1;
+}
+
+/*****************************************************************************************
+ * buildCRCTable - lookup table for crc32, built once on first use
+ *****************************************************************************************/
+static std::vector<uint32_t> buildCRCTable() {
+   std::vector<uint32_t> table(256);
+
+   for (uint32_t i=0; i<256; i++) {
+      uint32_t c = i;
+      for (int k=0; k<8; k++)
+         c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      table[i] = c;
+   }
+   return table;
+}
+
+/*****************************************************************************************
+ * crc32 - standard (IEEE 802.3, reflected) CRC32 of the data, table driven
+ *****************************************************************************************/
+uint32_t Frame::crc32(const uint8_t *data, size_t len) {
+   static const std::vector<uint32_t> table = buildCRCTable();
+
+   uint32_t crc = 0xFFFFFFFF;
+   for (size_t i=0; i<len; i++)
+      crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+   return crc ^ 0xFFFFFFFF;
+}
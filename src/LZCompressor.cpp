@@ -0,0 +1,160 @@
+#include <cstring>
+#include "LZCompressor.h"
+
+// Matches shorter than this aren't worth the offset, further back than this can't be encoded
+const size_t lz_min_match = 4;
+const size_t lz_max_offset = 65535;
+
+// 4096-entry hash table of recent positions
+const unsigned int lz_hash_bits = 12;
+
+LZCompressor::LZCompressor() {
+
+}
+
+LZCompressor::~LZCompressor() {
+}
+
+/*****************************************************************************************
+ * compress - greedy LZ77: hashes each 4-byte sequence, and if the last position with the
+ *            same hash holds the same bytes (and is within reach) emits a match, extended
+ *            as far as it goes. Otherwise the byte becomes a literal.
+ *
+ *    Params:  data, len - the data to compress
+ *             out - the sequences are appended here
+ *****************************************************************************************/
+void LZCompressor::compress(const uint8_t *data, size_t len, std::vector<uint8_t> &out) {
+   // Table holds position + 1 so 0 is empty
+   _table.assign(1 << lz_hash_bits, 0);
+
+   out.reserve(out.size() + len / 2 + 16);
+
+   size_t anchor = 0;
+   size_t pos = 0;
+   while (pos + lz_min_match <= len) {
+      uint32_t seq;
+      memcpy(&seq, data + pos, sizeof(seq));
+      uint32_t hash = (seq * 2654435761u) >> (32 - lz_hash_bits);
+
+      size_t cand = _table[hash];
+      _table[hash] = pos + 1;
+
+      if ((cand == 0) || (pos - (cand - 1) > lz_max_offset) ||
+                                       (memcmp(data + cand - 1, data + pos, lz_min_match) != 0)) {
+         pos++;
+         continue;
+      }
+
+      size_t ref = cand - 1;
+      size_t mlen = lz_min_match;
+      while ((pos + mlen < len) && (data[ref + mlen] == data[pos + mlen]))
+         mlen++;
+
+      // Literals since the last match, then the match
+      size_t lit = pos - anchor;
+      size_t mcode = mlen - lz_min_match;
+      out.push_back(((lit < 15 ? lit : 15) << 4) | (mcode < 15 ? mcode : 15));
+      if (lit >= 15)
+         putLength(out, lit - 15);
+      out.insert(out.end(), data + anchor, data + pos);
+
+      size_t offset = pos - ref;
+      out.push_back(offset & 0xFF);
+      out.push_back(offset >> 8);
+      if (mcode >= 15)
+         putLength(out, mcode - 15);
+
+      pos += mlen;
+      anchor = pos;
+   }
+
+   // Whatever is left goes out as literals
+   size_t lit = len - anchor;
+   out.push_back((lit < 15 ? lit : 15) << 4);
+   if (lit >= 15)
+      putLength(out, lit - 15);
+   out.insert(out.end(), data + anchor, data + len);
+}
+
+/*****************************************************************************************
+ * decompress - replays the sequences into out. Every length and offset is checked against
+ *              the input and output bounds, so corrupt data fails instead of overrunning
+ *
+ *    Params:  data, len - the compressed sequences
+ *             out - sized to the original length
+ *
+ *    Returns: true if the data decoded to exactly out.size() bytes
+ *****************************************************************************************/
+bool LZCompressor::decompress(const uint8_t *data, size_t len, std::vector<uint8_t> &out) {
+   const uint8_t *ptr = data;
+   const uint8_t *end = data + len;
+   uint8_t *op = out.data();
+   uint8_t *oend = out.data() + out.size();
+
+   while (ptr < end) {
+      uint8_t token = *ptr++;
+
+      size_t lit = token >> 4;
+      if ((lit == 15) && !getLength(ptr, end, lit))
+         return false;
+      if ((lit > (size_t) (end - ptr)) || (lit > (size_t) (oend - op)))
+         return false;
+      memcpy(op, ptr, lit);
+      op += lit;
+      ptr += lit;
+
+      // The last sequence has no match
+      if (ptr == end)
+         break;
+
+      if (end - ptr < 2)
+         return false;
+      size_t offset = ptr[0] | (ptr[1] << 8);
+      ptr += 2;
+      if ((offset == 0) || (offset > (size_t) (op - out.data())))
+         return false;
+
+      size_t mlen = token & 0x0F;
+      if ((mlen == 15) && !getLength(ptr, end, mlen))
+         return false;
+      mlen += lz_min_match;
+      if (mlen > (size_t) (oend - op))
+         return false;
+
+      // A match can overlap what it is producing (runs), copy those a byte at a time
+      const uint8_t *src = op - offset;
+      if (offset >= mlen) {
+         memcpy(op, src, mlen);
+         op += mlen;
+      } else {
+         for (size_t i = 0; i < mlen; i++)
+            *op++ = *src++;
+      }
+   }
+
+   return op == oend;
+}
+
+/*****************************************************************************************
+ * putLength / getLength - the extra length bytes after a nibble of 15: 255s, then the rest
+ *
+ *    Returns: (getLength) false if the data runs out
+ *****************************************************************************************/
+void LZCompressor::putLength(std::vector<uint8_t> &out, size_t len) {
+   while (len >= 255) {
+      out.push_back(255);
+      len -= 255;
+   }
+   out.push_back(len);
+}
+
+bool LZCompressor::getLength(const uint8_t *&ptr, const uint8_t *end, size_t &len) {
+   uint8_t byte;
+   do {
+      if (ptr == end)
+         return false;
+      byte = *ptr++;
+      len += byte;
+   } while (byte == 255);
+   return true;
+}
@@ -0,0 +1,174 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "PlotCodec.h"
+
+/*****************************************************************************************
+ * encode - sorts the plots and writes them as an encoded batch
+ *
+ *    Params:  plots - the plots to encode, left sorted by (drone_id, timestamp)
+ *             out - the encoded batch is appended here
+ *****************************************************************************************/
+void PlotCodec::encode(std::vector<DronePlot> &plots, std::vector<uint8_t> &out) {
+   std::stable_sort(plots.begin(), plots.end(), [](const DronePlot &a, const DronePlot &b) {
+                        if (a.drone_id != b.drone_id)
+                           return a.drone_id < b.drone_id;
+                        return a.timestamp < b.timestamp; });
+
+   // Fixed-point coordinates only if every one of them converts back exactly
+   std::vector<int64_t> lat(plots.size()), lon(plots.size());
+   bool fixed = true;
+   for (size_t i = 0; fixed && (i < plots.size()); i++)
+      fixed = toFixed(plots[i].latitude, lat[i]) && toFixed(plots[i].longitude, lon[i]);
+
+   out.reserve(out.size() + 16 + plots.size() * 8);
+   out.insert(out.end(), plot_codec_magic, plot_codec_magic + sizeof(plot_codec_magic));
+   out.push_back(plot_codec_version);
+   out.push_back(fixed ? codec_fixed_coords : 0);
+   putVarint(out, plots.size());
+
+   int64_t prev = 0;
+   for (size_t i = 0; i < plots.size(); i++) {
+      putVarint(out, zigzag((int64_t) plots[i].drone_id - prev));
+      prev = plots[i].drone_id;
+   }
+
+   prev = 0;
+   for (size_t i = 0; i < plots.size(); i++) {
+      putVarint(out, zigzag((int64_t) plots[i].node_id - prev));
+      prev = plots[i].node_id;
+   }
+
+   prev = 0;
+   for (size_t i = 0; i < plots.size(); i++) {
+      putVarint(out, zigzag((int64_t) plots[i].timestamp - prev));
+      prev = plots[i].timestamp;
+   }
+
+   if (fixed) {
+      prev = 0;
+      for (size_t i = 0; i < lat.size(); i++) {
+         putVarint(out, zigzag(lat[i] - prev));
+         prev = lat[i];
+      }
+      prev = 0;
+      for (size_t i = 0; i < lon.size(); i++) {
+         putVarint(out, zigzag(lon[i] - prev));
+         prev = lon[i];
+      }
+   } else {
+      for (size_t i = 0; i < plots.size(); i++) {
+         uint8_t *ptr = (uint8_t *) &plots[i].latitude;
+         out.insert(out.end(), ptr, ptr + sizeof(float));
+      }
+      for (size_t i = 0; i < plots.size(); i++) {
+         uint8_t *ptr = (uint8_t *) &plots[i].longitude;
+         out.insert(out.end(), ptr, ptr + sizeof(float));
+      }
+   }
+}
+
+/*****************************************************************************************
+ * decode - reads an encoded batch back into plots
+ *
+ *    Params:  data, len - the encoded batch
+ *             plots - the decoded plots are appended here
+ *
+ *    Throws: runtime_error if the data is not an encoded batch or runs out early
+ *****************************************************************************************/
+void PlotCodec::decode(const uint8_t *data, size_t len, std::vector<DronePlot> &plots) {
+   if (!isEncoded(data, len) || (len < sizeof(plot_codec_magic) + 2))
+      throw std::runtime_error("PlotCodec decode called on data that is not an encoded batch.");
+
+   const uint8_t *ptr = data + sizeof(plot_codec_magic) + 1;
+   const uint8_t *end = data + len;
+   bool fixed = (*ptr++ & codec_fixed_coords);
+
+   // Every plot takes at least a byte per column, so a count past that is corrupt
+   uint64_t count = getVarint(ptr, end);
+   if (count > (uint64_t) (end - ptr) / 5)
+      throw std::runtime_error("PlotCodec batch count is larger than the data.");
+
+   size_t first = plots.size();
+   plots.resize(first + count);
+   DronePlot *rows = plots.data() + first;
+
+   int64_t prev = 0;
+   for (size_t i = 0; i < count; i++)
+      rows[i].drone_id = prev += unzigzag(getVarint(ptr, end));
+
+   prev = 0;
+   for (size_t i = 0; i < count; i++)
+      rows[i].node_id = prev += unzigzag(getVarint(ptr, end));
+
+   prev = 0;
+   for (size_t i = 0; i < count; i++)
+      rows[i].timestamp = prev += unzigzag(getVarint(ptr, end));
+
+   if (fixed) {
+      prev = 0;
+      for (size_t i = 0; i < count; i++)
+         rows[i].latitude = fromFixed(prev += unzigzag(getVarint(ptr, end)));
+      prev = 0;
+      for (size_t i = 0; i < count; i++)
+         rows[i].longitude = fromFixed(prev += unzigzag(getVarint(ptr, end)));
+   } else {
+      if ((size_t) (end - ptr) < count * 2 * sizeof(float))
+         throw std::runtime_error("PlotCodec batch ran out of data in the coordinates.");
+      for (size_t i = 0; i < count; i++, ptr += sizeof(float))
+         memcpy(&rows[i].latitude, ptr, sizeof(float));
+      for (size_t i = 0; i < count; i++, ptr += sizeof(float))
+         memcpy(&rows[i].longitude, ptr, sizeof(float));
+   }
+}
+
+/*****************************************************************************************
+ * isEncoded - checks for the magic bytes and a version this code can read
+ *****************************************************************************************/
+bool PlotCodec::isEncoded(const uint8_t *data, size_t len) {
+   return (len > sizeof(plot_codec_magic)) &&
+          (memcmp(data, plot_codec_magic, sizeof(plot_codec_magic)) == 0) &&
+          (data[sizeof(plot_codec_magic)] == plot_codec_version);
+}
+
+/*****************************************************************************************
+ * putVarint / getVarint - unsigned LEB128, 7 bits a byte, high bit set on all but the last
+ *
+ *    Throws: runtime_error (getVarint) if the data ends mid-value or the value is too long
+ *****************************************************************************************/
+void PlotCodec::putVarint(std::vector<uint8_t> &out, uint64_t val) {
+   while (val >= 0x80) {
+      out.push_back((uint8_t) (val | 0x80));
+      val >>= 7;
+   }
+   out.push_back((uint8_t) val);
+}
+
+uint64_t PlotCodec::getVarint(const uint8_t *&ptr, const uint8_t *end) {
+   uint64_t val = 0;
+   for (unsigned int shift = 0; shift < 64; shift += 7) {
+      if (ptr == end)
+         throw std::runtime_error("PlotCodec batch ran out of data mid-value.");
+
+      uint8_t byte = *ptr++;
+      val |= (uint64_t) (byte & 0x7F) << shift;
+      if (!(byte & 0x80))
+         return val;
+   }
+   throw std::runtime_error("PlotCodec varint too long.");
+}
+
+/*****************************************************************************************
+ * toFixed - scales a coordinate to an integer. Floats near zero have finer steps than
+ *           1/plot_codec_scale, so the conversion is checked by converting back.
+ *
+ *    Returns: true if fromFixed(fixed) gives back exactly coord
+ *****************************************************************************************/
+bool PlotCodec::toFixed(float coord, int64_t &fixed) {
+   if (!std::isfinite(coord) || (std::fabs(coord) > 1e9))
+      return false;
+
+   fixed = std::llround(coord * plot_codec_scale);
+   return fromFixed(fixed) == coord;
+}
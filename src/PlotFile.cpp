@@ -0,0 +1,692 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include "PlotFile.h"
+#include "DronePlotDB.h"
+#include "Frame.h"
+
+const uint8_t plot_file_magic[] = { 'D', 'P', 'L', 'T' };
+const uint8_t plot_file_end[] = { 'D', 'P', 'L', 'E' };
+const uint16_t plot_file_version = 1;
+
+const size_t plot_file_header = 16;
+const size_t plot_file_field = 8;
+const size_t plot_file_entry = 40;
+const size_t plot_file_footer = 20;
+
+// Schema field types
+const uint8_t ft_unsigned = 1;
+const uint8_t ft_signed = 2;
+const uint8_t ft_float = 3;
+
+// Queries are split across threads only when each gets at least this many plots to decode
+const size_t plot_file_parallel_plots = 262144;
+const unsigned int plot_file_max_threads = 16;
+
+// The fields this code writes, in column order
+struct schema_field
+{
+   const char *name;
+   uint8_t type;
+   uint8_t width;
+};
+
+const schema_field plot_file_schema[] = {
+   {"drone", ft_unsigned, 4},
+   {"node",  ft_unsigned, 4},
+   {"time",  ft_signed,   8},
+   {"lat",   ft_float,    4},
+   {"lon",   ft_float,    4}
+};
+const size_t plot_file_fields = sizeof(plot_file_schema) / sizeof(plot_file_schema[0]);
+
+/*****************************************************************************************
+ * putLE / getLE - little-endian integers of 1 to 8 bytes
+ *****************************************************************************************/
+static void putLE(uint8_t *dst, uint64_t val, size_t width) {
+   for (size_t i = 0; i < width; i++, val >>= 8)
+      dst[i] = (uint8_t) val;
+}
+
+static void putLE(std::vector<uint8_t> &out, uint64_t val, size_t width) {
+   size_t pos = out.size();
+   out.resize(pos + width);
+   putLE(out.data() + pos, val, width);
+}
+
+static uint64_t getLE(const uint8_t *src, size_t width) {
+   uint64_t val = 0;
+   for (size_t i = width; i > 0; i--)
+      val = (val << 8) | src[i - 1];
+   return val;
+}
+
+static uint32_t floatBits(float val) {
+   uint32_t bits;
+   memcpy(&bits, &val, sizeof(bits));
+   return bits;
+}
+
+/*****************************************************************************************
+ * getInt / getFloat - read one value of an integer or float schema field of any width the
+ *                    format allows
+ *****************************************************************************************/
+static int64_t getInt(const uint8_t *src, uint8_t type, uint8_t width) {
+   uint64_t val = getLE(src, width);
+
+   // Sign-extend narrower signed fields
+   if ((type == ft_signed) && (width < 8) && (val & ((uint64_t) 1 << (width * 8 - 1))))
+      val |= ~(uint64_t) 0 << (width * 8);
+   return (int64_t) val;
+}
+
+static float getFloat(const uint8_t *src, uint8_t width) {
+   if (width == sizeof(double)) {
+      uint64_t bits = getLE(src, width);
+      double val;
+      memcpy(&val, &bits, sizeof(val));
+      return (float) val;
+   }
+
+   uint32_t bits = getLE(src, width);
+   float val;
+   memcpy(&val, &bits, sizeof(val));
+   return val;
+}
+
+PlotFile::PlotFile(const char *filename):
+                                 _filename(filename),
+                                 _file(filename),
+                                 _writing(false),
+                                 _block_plots(plot_file_block),
+                                 _write_pos(0),
+                                 _data(NULL),
+                                 _len(0),
+                                 _row_width(0),
+                                 _drone_col(-1),
+                                 _node_col(-1),
+                                 _time_col(-1),
+                                 _lat_col(-1),
+                                 _lon_col(-1),
+                                 _num_plots(0)
+{
+
+}
+
+PlotFile::~PlotFile() {
+   if (_writing)
+      _file.closeFD();
+   close();
+}
+
+/*****************************************************************************************
+ * create - opens (and empties) the file for writing and writes the header and schema
+ *
+ *    Params:  block_plots - how many plots go in each block
+ *
+ *    Returns: false if the file couldn't be opened
+ *****************************************************************************************/
+bool PlotFile::create(size_t block_plots) {
+   if (!_file.openFile(FileFD::writefd, true))
+      return false;
+
+   if (ftruncate(_file.getFD(), 0) == -1) {
+      _file.closeFD();
+      return false;
+   }
+
+   _writing = true;
+   _block_plots = std::max((size_t) 1, block_plots);
+   _block.clear();
+   _block.reserve(_block_plots);
+   _index.clear();
+
+   std::vector<uint8_t> hdr(plot_file_magic, plot_file_magic + sizeof(plot_file_magic));
+   putLE(hdr, plot_file_version, 2);
+   putLE(hdr, plot_file_fields, 2);
+   putLE(hdr, _block_plots, 4);
+   putLE(hdr, 0, 4);
+
+   for (size_t i = 0; i < plot_file_fields; i++) {
+      uint8_t field[plot_file_field] = {0};
+      strncpy((char *) field, plot_file_schema[i].name, plot_file_field - 2);
+      field[6] = plot_file_schema[i].type;
+      field[7] = plot_file_schema[i].width;
+      hdr.insert(hdr.end(), field, field + plot_file_field);
+   }
+
+   if (_file.writeBytes<uint8_t>(hdr) < 0)
+      throw std::runtime_error("Unable to write plot file header to " + _filename);
+   _write_pos = hdr.size();
+   return true;
+}
+
+/*****************************************************************************************
+ * addPlot - adds a plot to the block being built, writing the block out once it is full
+ *****************************************************************************************/
+void PlotFile::addPlot(DronePlot &plot) {
+   _block.push_back(plot);
+   if (_block.size() >= _block_plots)
+      flushBlock();
+}
+
+/*****************************************************************************************
+ * finish - writes the last (partial) block, the index and the footer, and closes the file
+ *
+ *    Throws: runtime_error if a write fails
+ *****************************************************************************************/
+void PlotFile::finish() {
+   if (!_writing)
+      return;
+
+   flushBlock();
+
+   uint32_t num_blocks = _index.size() / plot_file_entry;
+   uint32_t index_crc = Frame::crc32(_index.data(), _index.size());
+
+   putLE(_index, _write_pos, 8);
+   putLE(_index, num_blocks, 4);
+   putLE(_index, index_crc, 4);
+   _index.insert(_index.end(), plot_file_end, plot_file_end + sizeof(plot_file_end));
+
+   if (_file.writeBytes<uint8_t>(_index) < 0)
+      throw std::runtime_error("Unable to write plot file index to " + _filename);
+
+   _file.closeFD();
+   _writing = false;
+   _index.clear();
+}
+
+/*****************************************************************************************
+ * flushBlock - writes the waiting plots as one block, column by column, and adds its entry
+ *              to the index
+ *****************************************************************************************/
+void PlotFile::flushBlock() {
+   if (_block.empty())
+      return;
+
+   size_t row_width = 0;
+   for (size_t i = 0; i < plot_file_fields; i++)
+      row_width += plot_file_schema[i].width;
+
+   size_t count = _block.size();
+   std::vector<uint8_t> buf;
+   buf.reserve(count * row_width);
+
+   time_t min_time = _block[0].timestamp, max_time = _block[0].timestamp;
+   unsigned int min_drone = _block[0].drone_id, max_drone = _block[0].drone_id;
+   for (size_t i = 0; i < count; i++) {
+      min_time = std::min(min_time, _block[i].timestamp);
+      max_time = std::max(max_time, _block[i].timestamp);
+      min_drone = std::min(min_drone, _block[i].drone_id);
+      max_drone = std::max(max_drone, _block[i].drone_id);
+      putLE(buf, _block[i].drone_id, 4);
+   }
+   for (size_t i = 0; i < count; i++)
+      putLE(buf, _block[i].node_id, 4);
+   for (size_t i = 0; i < count; i++)
+      putLE(buf, (uint64_t) _block[i].timestamp, 8);
+   for (size_t i = 0; i < count; i++)
+      putLE(buf, floatBits(_block[i].latitude), 4);
+   for (size_t i = 0; i < count; i++)
+      putLE(buf, floatBits(_block[i].longitude), 4);
+
+   putLE(_index, _write_pos, 8);
+   putLE(_index, count, 4);
+   putLE(_index, Frame::crc32(buf.data(), buf.size()), 4);
+   putLE(_index, (uint64_t) min_time, 8);
+   putLE(_index, (uint64_t) max_time, 8);
+   putLE(_index, min_drone, 4);
+   putLE(_index, max_drone, 4);
+
+   if (_file.writeBytes<uint8_t>(buf) < 0)
+      throw std::runtime_error("Unable to write plot file block to " + _filename);
+   _write_pos += buf.size();
+   _block.clear();
+}
+
+/*****************************************************************************************
+ * open - maps the file and reads the header, schema, footer and index. The blocks aren't
+ *        touched until they are read
+ *
+ *    Params:  sequential - the whole file will be read front to back (madvise)
+ *
+ *    Returns: false if the file can't be opened or doesn't start with the magic bytes
+ *
+ *    Throws: runtime_error if the file has the magic bytes but the rest doesn't check out
+ *****************************************************************************************/
+bool PlotFile::open(bool sequential) {
+   close();
+
+   if (!_file.openFile(FileFD::readfd))
+      return false;
+   _data = _file.mapFile(_len, sequential);
+   _file.closeFD();
+
+   if (!isPlotFile(_data, _len)) {
+      close();
+      return false;
+   }
+
+   auto fail = [this](const char *why) {
+      close();
+      throw std::runtime_error("Plot file " + _filename + " " + why);
+   };
+
+   if (_len < plot_file_header + plot_file_footer)
+      fail("is too short.");
+   if (getLE(_data + 4, 2) != plot_file_version)
+      fail("is a version this code can't read.");
+
+   size_t num_fields = getLE(_data + 6, 2);
+   size_t schema_end = plot_file_header + num_fields * plot_file_field;
+   if (schema_end + plot_file_footer > _len)
+      fail("schema runs past the end of the file.");
+
+   // Lay out the columns, and find the ones we know. A column's offset within a block is
+   // its position in a row times the block's plot count
+   _fields.clear();
+   _row_width = 0;
+   for (size_t i = 0; i < num_fields; i++) {
+      const uint8_t *field = _data + plot_file_header + i * plot_file_field;
+      field_info info;
+      info.name.assign((const char *) field, strnlen((const char *) field, 6));
+      info.type = field[6];
+      info.width = field[7];
+      info.column = _row_width;
+
+      // Fields we don't know are only skipped over, but have to take up space
+      if (info.width == 0)
+         fail("has an empty field in its schema.");
+      bool int_ok = ((info.type == ft_unsigned) || (info.type == ft_signed)) && (info.width <= 8);
+      bool float_ok = (info.type == ft_float) && ((info.width == 4) || (info.width == 8));
+
+      int *col = NULL;
+      if (info.name == "drone")
+         col = &_drone_col;
+      else if (info.name == "node")
+         col = &_node_col;
+      else if (info.name == "time")
+         col = &_time_col;
+      else if (info.name == "lat")
+         col = &_lat_col;
+      else if (info.name == "lon")
+         col = &_lon_col;
+
+      if (col != NULL) {
+         bool want_float = (col == &_lat_col) || (col == &_lon_col);
+         if (want_float ? !float_ok : !int_ok)
+            fail("has a field of a type this code can't read.");
+         *col = _fields.size();
+      }
+
+      _fields.push_back(info);
+      _row_width += info.width;
+   }
+   if ((_drone_col < 0) || (_node_col < 0) || (_time_col < 0) || (_lat_col < 0) || (_lon_col < 0))
+      fail("is missing a plot field.");
+
+   // Footer, then the index it points to
+   const uint8_t *footer = _data + _len - plot_file_footer;
+   if (memcmp(footer + 16, plot_file_end, sizeof(plot_file_end)) != 0)
+      fail("has no footer (was it finished?).");
+
+   uint64_t index_offset = getLE(footer, 8);
+   uint64_t num_blocks = getLE(footer + 8, 4);
+   if ((index_offset < schema_end) || (index_offset > _len - plot_file_footer) ||
+       (num_blocks != (_len - plot_file_footer - index_offset) / plot_file_entry) ||
+       ((_len - plot_file_footer - index_offset) % plot_file_entry != 0))
+      fail("index is the wrong size.");
+
+   const uint8_t *index = _data + index_offset;
+   if (Frame::crc32(index, num_blocks * plot_file_entry) != getLE(footer + 12, 4))
+      fail("index is corrupt.");
+
+   _blocks.resize(num_blocks);
+   _num_plots = 0;
+   for (size_t i = 0; i < num_blocks; i++) {
+      const uint8_t *entry = index + i * plot_file_entry;
+      block_info &block = _blocks[i];
+      block.offset = getLE(entry, 8);
+      block.count = getLE(entry + 8, 4);
+      block.crc = getLE(entry + 12, 4);
+      block.min_time = (time_t) getLE(entry + 16, 8);
+      block.max_time = (time_t) getLE(entry + 24, 8);
+      block.min_drone = getLE(entry + 32, 4);
+      block.max_drone = getLE(entry + 36, 4);
+
+      if ((block.offset < schema_end) || (block.offset > index_offset) ||
+          ((uint64_t) block.count * _row_width > index_offset - block.offset))
+         fail("has a block outside the data.");
+      _num_plots += block.count;
+   }
+   return true;
+}
+
+void PlotFile::close() {
+   FileFD::unmapFile(_data, _len);
+   _data = NULL;
+   _len = 0;
+   _blocks.clear();
+   _fields.clear();
+   _num_plots = 0;
+}
+
+bool PlotFile::isPlotFile(const uint8_t *data, size_t len) {
+   return (data != NULL) && (len >= sizeof(plot_file_magic)) &&
+          (memcmp(data, plot_file_magic, sizeof(plot_file_magic)) == 0);
+}
+
+void PlotFile::readBlock(size_t i, std::vector<DronePlot> &plots) {
+   decodeBlock(i, plots, std::numeric_limits<time_t>::min(), std::numeric_limits<time_t>::max(),
+                                                                                 all_drones);
+}
+
+/*****************************************************************************************
+ * readInts / readFloats - read a run of count values from one column into native values.
+ *                         A column already stored the way this host keeps the values is
+ *                         copied in one go
+ *****************************************************************************************/
+template <typename T>
+static void readInts(const uint8_t *src, uint8_t type, uint8_t width, size_t count, T *dst) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   if (width == sizeof(T)) {
+      memcpy(dst, src, count * sizeof(T));
+      return;
+   }
+#endif
+   for (size_t j = 0; j < count; j++)
+      dst[j] = (T) getInt(src + j * width, type, width);
+}
+
+static void readFloats(const uint8_t *src, uint8_t width, size_t count, float *dst) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   if (width == sizeof(float)) {
+      memcpy(dst, src, count * sizeof(float));
+      return;
+   }
+#endif
+   for (size_t j = 0; j < count; j++)
+      dst[j] = getFloat(src + j * width, width);
+}
+
+/*****************************************************************************************
+ * checkBlock - checks a block's CRC
+ *
+ *    Returns: the start of the block's data
+ *
+ *    Throws: runtime_error if the CRC doesn't match
+ *****************************************************************************************/
+const uint8_t *PlotFile::checkBlock(size_t i) {
+   const block_info &block = _blocks[i];
+   const uint8_t *base = _data + block.offset;
+
+   if (Frame::crc32(base, block.count * _row_width) != block.crc)
+      throw std::runtime_error("Plot file " + _filename + " has a corrupt block.");
+   return base;
+}
+
+/*****************************************************************************************
+ * decodeBlock - checks a block's CRC and appends the plots in it that match. The timestamp
+ *               and drone_id columns are read first so the filter runs down them
+ *
+ *    Throws: runtime_error if the CRC doesn't match
+ *****************************************************************************************/
+void PlotFile::decodeBlock(size_t i, std::vector<DronePlot> &plots, time_t t_begin,
+                                                        time_t t_end, unsigned int drone_id) {
+   const block_info &block = _blocks[i];
+   const uint8_t *base = checkBlock(i);
+
+   const field_info &drone = _fields[_drone_col];
+   const field_info &node = _fields[_node_col];
+   const field_info &tstamp = _fields[_time_col];
+   const field_info &lat = _fields[_lat_col];
+   const field_info &lon = _fields[_lon_col];
+
+   std::vector<time_t> times(block.count);
+   std::vector<unsigned int> drones(block.count);
+   readInts(base + tstamp.column * block.count, tstamp.type, tstamp.width, block.count,
+                                                                               times.data());
+   readInts(base + drone.column * block.count, drone.type, drone.width, block.count,
+                                                                              drones.data());
+
+   const uint8_t *node_ptr = base + node.column * block.count;
+   const uint8_t *lat_ptr = base + lat.column * block.count;
+   const uint8_t *lon_ptr = base + lon.column * block.count;
+
+   DronePlot plot;
+   for (size_t j = 0; j < block.count; j++) {
+      if ((times[j] < t_begin) || (times[j] > t_end) ||
+                                      ((drone_id != all_drones) && (drones[j] != drone_id)))
+         continue;
+
+      plot.timestamp = times[j];
+      plot.drone_id = drones[j];
+      plot.node_id = getInt(node_ptr + j * node.width, node.type, node.width);
+      plot.latitude = getFloat(lat_ptr + j * lat.width, lat.width);
+      plot.longitude = getFloat(lon_ptr + j * lon.width, lon.width);
+      plots.push_back(plot);
+   }
+}
+
+/*****************************************************************************************
+ * fillBlock - checks a block's CRC and copies it column by column into store rows set
+ *             aside by PlotStore::extend, a chunk's worth at a time
+ *
+ *    Params:  first_slot, first_lsn - the slot and LSN the block's first plot gets
+ *
+ *    Throws: runtime_error if the CRC doesn't match
+ *****************************************************************************************/
+void PlotFile::fillBlock(size_t i, PlotStore &store, size_t first_slot, uint64_t first_lsn) {
+   const block_info &block = _blocks[i];
+   const uint8_t *base = checkBlock(i);
+
+   const field_info &drone = _fields[_drone_col];
+   const field_info &node = _fields[_node_col];
+   const field_info &tstamp = _fields[_time_col];
+   const field_info &lat = _fields[_lat_col];
+   const field_info &lon = _fields[_lon_col];
+
+   size_t j = 0;
+   while (j < block.count) {
+      size_t slot = first_slot + j;
+      PlotChunk &chunk = store.chunkFor(slot);
+      size_t off = slot % plot_chunk_size;
+      size_t run = std::min((size_t) block.count - j, plot_chunk_size - off);
+
+      readInts(base + drone.column * block.count + j * drone.width, drone.type, drone.width,
+                                                                   run, &chunk.drone_id[off]);
+      readInts(base + node.column * block.count + j * node.width, node.type, node.width,
+                                                                    run, &chunk.node_id[off]);
+      readInts(base + tstamp.column * block.count + j * tstamp.width, tstamp.type,
+                                                     tstamp.width, run, &chunk.timestamp[off]);
+      readFloats(base + lat.column * block.count + j * lat.width, lat.width, run,
+                                                                       &chunk.latitude[off]);
+      readFloats(base + lon.column * block.count + j * lon.width, lon.width, run,
+                                                                      &chunk.longitude[off]);
+
+      std::fill(&chunk.flags[off], &chunk.flags[off] + run, 0);
+      for (size_t k = 0; k < run; k++)
+         chunk.lsn[off + k] = first_lsn + j + k;
+      j += run;
+   }
+}
+
+// One decode thread's share of the blocks
+struct PlotFile::decode_job
+{
+   PlotFile *file;
+   const std::vector<size_t> *blocks;
+   size_t begin, end;
+
+   // query: the filter, and the matches found
+   time_t t_begin, t_end;
+   unsigned int drone_id;
+   std::vector<DronePlot> plots;
+
+   // loadInto: the store, and the offset of each block's first plot from first_slot
+   PlotStore *store;
+   const std::vector<size_t> *starts;
+   size_t first_slot;
+   uint64_t first_lsn;
+
+   std::string error;
+};
+
+void *PlotFile::t_decode(void *data) {
+   decode_job &job = *static_cast<decode_job *>(data);
+
+   try {
+      for (size_t i = job.begin; i < job.end; i++) {
+         size_t block = (*job.blocks)[i];
+         if (job.store != NULL)
+            job.file->fillBlock(block, *job.store, job.first_slot + (*job.starts)[i],
+                                                         job.first_lsn + (*job.starts)[i]);
+         else
+            job.file->decodeBlock(block, job.plots, job.t_begin, job.t_end, job.drone_id);
+      }
+   } catch (std::runtime_error &e) {
+      job.error = e.what();
+   }
+   return NULL;
+}
+
+/*****************************************************************************************
+ * runJobs - splits the blocks into even runs, one per job, and decodes them in parallel.
+ *           The first run, and any a thread couldn't be started for, are decoded here
+ *
+ *    Params:  jobs - one per thread, with everything but the run filled in
+ *             blocks - the blocks to decode, in file order
+ *
+ *    Throws: runtime_error if any of the blocks is corrupt
+ *****************************************************************************************/
+void PlotFile::runJobs(std::vector<decode_job> &jobs, const std::vector<size_t> &blocks) {
+   size_t threads = jobs.size();
+   std::vector<pthread_t> tids(threads);
+   std::vector<bool> started(threads, false);
+
+   for (size_t i = 0; i < threads; i++) {
+      jobs[i].file = this;
+      jobs[i].blocks = &blocks;
+      jobs[i].begin = blocks.size() * i / threads;
+      jobs[i].end = blocks.size() * (i + 1) / threads;
+
+      if ((i > 0) && (pthread_create(&tids[i], NULL, t_decode, (void *) &jobs[i]) == 0))
+         started[i] = true;
+   }
+   for (size_t i = 0; i < threads; i++) {
+      if (!started[i])
+         t_decode((void *) &jobs[i]);
+   }
+
+   for (size_t i = 0; i < threads; i++) {
+      if (started[i])
+         pthread_join(tids[i], NULL);
+   }
+
+   for (size_t i = 0; i < threads; i++) {
+      if (!jobs[i].error.empty())
+         throw std::runtime_error(jobs[i].error);
+   }
+}
+
+/*****************************************************************************************
+ * decodeThreads - how many threads to decode with: max_threads (0 = one per core), but
+ *                 none with less than plot_file_parallel_plots to do
+ *****************************************************************************************/
+static unsigned int decodeThreads(size_t scan, size_t blocks, unsigned int max_threads) {
+   unsigned int threads = (max_threads > 0) ? max_threads : sysconf(_SC_NPROCESSORS_ONLN);
+   return std::max(1u, std::min({threads, plot_file_max_threads,
+                                 (unsigned int) (scan / plot_file_parallel_plots),
+                                 (unsigned int) blocks}));
+}
+
+/*****************************************************************************************
+ * findBlocks - picks out from the index the blocks whose timestamp (and drone_id) ranges
+ *              overlap the query, without touching the blocks themselves
+ *
+ *    Params:  blocks - the matching block numbers are appended here, in file order
+ *
+ *    Returns: the number of plots in those blocks
+ *****************************************************************************************/
+size_t PlotFile::findBlocks(time_t t_begin, time_t t_end, std::vector<size_t> &blocks,
+                                                                   unsigned int drone_id) {
+   size_t scan = 0;
+   for (size_t i = 0; i < _blocks.size(); i++) {
+      const block_info &block = _blocks[i];
+      if ((block.max_time < t_begin) || (block.min_time > t_end))
+         continue;
+      if ((drone_id != all_drones) && ((drone_id < block.min_drone) || (drone_id > block.max_drone)))
+         continue;
+      blocks.push_back(i);
+      scan += block.count;
+   }
+   return scan;
+}
+
+/*****************************************************************************************
+ * query - uses the index to pick out the blocks that could hold matching plots and decodes
+ *         only those. Large queries are split into runs of blocks decoded in parallel and
+ *         put back together in file order
+ *
+ *    Params:  t_begin, t_end - inclusive timestamp range
+ *             plots - matching plots are appended here
+ *             drone_id - the one drone wanted, or all_drones
+ *             max_threads - most decode threads to use (0 = one per core)
+ *
+ *    Returns: the number of plots appended
+ *
+ *    Throws: runtime_error if one of the blocks read is corrupt
+ *****************************************************************************************/
+size_t PlotFile::query(time_t t_begin, time_t t_end, std::vector<DronePlot> &plots,
+                                         unsigned int drone_id, unsigned int max_threads) {
+   std::vector<size_t> matches;
+   size_t scan = findBlocks(t_begin, t_end, matches, drone_id);
+
+   std::vector<decode_job> jobs(decodeThreads(scan, matches.size(), max_threads));
+   for (auto &job : jobs) {
+      job.t_begin = t_begin;
+      job.t_end = t_end;
+      job.drone_id = drone_id;
+      job.store = NULL;
+   }
+   runJobs(jobs, matches);
+
+   size_t before = plots.size();
+   for (auto &job : jobs)
+      plots.insert(plots.end(), job.plots.begin(), job.plots.end());
+   return plots.size() - before;
+}
+
+/*****************************************************************************************
+ * loadInto - decodes every plot in the file straight into the columns of a store, in
+ *            parallel for large files
+ *
+ *    Params:  store - holds numPlots() rows from first_slot on, set aside by
+ *                     PlotStore::extend
+ *             first_lsn - LSN of the first plot, the rest numbered on from it
+ *             max_threads - most decode threads to use (0 = one per core)
+ *
+ *    Throws: runtime_error if one of the blocks is corrupt. The rows are left part-filled
+ *****************************************************************************************/
+void PlotFile::loadInto(PlotStore &store, size_t first_slot, uint64_t first_lsn,
+                                                                 unsigned int max_threads) {
+   std::vector<size_t> blocks(_blocks.size());
+   std::vector<size_t> starts(_blocks.size());
+   size_t start = 0;
+   for (size_t i = 0; i < _blocks.size(); i++) {
+      blocks[i] = i;
+      starts[i] = start;
+      start += _blocks[i].count;
+   }
+
+   std::vector<decode_job> jobs(decodeThreads(start, blocks.size(), max_threads));
+   for (auto &job : jobs) {
+      job.store = &store;
+      job.starts = &starts;
+      job.first_slot = first_slot;
+      job.first_lsn = first_lsn;
+   }
+   runJobs(jobs, blocks);
+}
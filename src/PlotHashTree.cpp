@@ -0,0 +1,124 @@
+#include <cstring>
+#include "PlotHashTree.h"
+
+PlotHashTree::PlotHashTree():_root_hash(0),
+                             _root_count(0)
+{
+
+}
+
+PlotHashTree::~PlotHashTree() {
+}
+
+// splitmix64 finalizer
+static uint64_t mix64(uint64_t val) {
+   val += 0x9E3779B97F4A7C15ull;
+   val = (val ^ (val >> 30)) * 0xBF58476D1CE4E5B9ull;
+   val = (val ^ (val >> 27)) * 0x94D049BB133111EBull;
+   return val ^ (val >> 31);
+}
+
+/*****************************************************************************************
+ * plotHash - mixes the plot's fields into a 64-bit hash. Every field goes through the
+ *            mixer, so plots that differ in one bit of one field don't produce sums that
+ *            cancel out
+ *****************************************************************************************/
+uint64_t PlotHashTree::plotHash(unsigned int drone_id, unsigned int node_id, time_t timestamp,
+                                                            float latitude, float longitude) {
+   uint32_t lat_bits, lon_bits;
+   memcpy(&lat_bits, &latitude, sizeof(lat_bits));
+   memcpy(&lon_bits, &longitude, sizeof(lon_bits));
+
+   uint64_t hash = mix64(((uint64_t) drone_id << 32) | node_id);
+   hash = mix64(hash ^ (uint64_t) timestamp);
+   return mix64(hash ^ (((uint64_t) lat_bits << 32) | lon_bits));
+}
+
+/*****************************************************************************************
+ * getBucket - rounds the timestamp down to the start of its bucket (toward negative
+ *             infinity, so negative timestamps bucket consistently too)
+ *****************************************************************************************/
+time_t PlotHashTree::getBucket(time_t timestamp) {
+   time_t rem = timestamp % sync_bucket_secs;
+   if (rem < 0)
+      rem += sync_bucket_secs;
+   return timestamp - rem;
+}
+
+/*****************************************************************************************
+ * add / remove - updates the bucket, drone and root sums for one plot. Empty buckets and
+ *                drones are dropped so that they compare equal to ones that never existed
+ *****************************************************************************************/
+void PlotHashTree::add(unsigned int drone_id, time_t timestamp, uint64_t hash) {
+   drone_sum &drone = _drones[drone_id];
+   bucket_sum &bucket = drone.buckets[getBucket(timestamp)];
+
+   bucket.hash += hash;
+   bucket.count++;
+   drone.hash += hash;
+   drone.count++;
+   _root_hash += hash;
+   _root_count++;
+}
+
+void PlotHashTree::remove(unsigned int drone_id, time_t timestamp, uint64_t hash) {
+   auto drone_it = _drones.find(drone_id);
+   if (drone_it == _drones.end())
+      return;
+
+   auto bucket_it = drone_it->second.buckets.find(getBucket(timestamp));
+   if (bucket_it == drone_it->second.buckets.end())
+      return;
+
+   bucket_it->second.hash -= hash;
+   drone_it->second.hash -= hash;
+   _root_hash -= hash;
+   _root_count--;
+
+   if (--bucket_it->second.count == 0)
+      drone_it->second.buckets.erase(bucket_it);
+   if (--drone_it->second.count == 0)
+      _drones.erase(drone_it);
+}
+
+/*****************************************************************************************
+ * getDroneSums - appends a sync_entry for each drone in the tree. Buckets from before on
+ *                are taken back out of the drone's sum, which only walks the newest few
+ *****************************************************************************************/
+void PlotHashTree::getDroneSums(std::vector<sync_entry> &entries, time_t before) {
+   for (auto drone_it = _drones.begin(); drone_it != _drones.end(); drone_it++) {
+      sync_entry entry = {drone_it->first, 0, drone_it->second.hash, drone_it->second.count};
+
+      auto &buckets = drone_it->second.buckets;
+      for (auto bucket_it = buckets.lower_bound(before); bucket_it != buckets.end(); bucket_it++) {
+         entry.hash -= bucket_it->second.hash;
+         entry.count -= bucket_it->second.count;
+      }
+
+      if (entry.count > 0)
+         entries.push_back(entry);
+   }
+}
+
+/*****************************************************************************************
+ * getBucketSums - appends a sync_entry for each of the drone's buckets (none if the drone
+ *                 isn't in the tree)
+ *****************************************************************************************/
+void PlotHashTree::getBucketSums(unsigned int drone_id, std::vector<sync_entry> &entries,
+                                                                              time_t before) {
+   auto drone_it = _drones.find(drone_id);
+   if (drone_it == _drones.end())
+      return;
+
+   auto &buckets = drone_it->second.buckets;
+   auto bucket_end = buckets.lower_bound(before);
+   for (auto bucket_it = buckets.begin(); bucket_it != bucket_end; bucket_it++)
+      entries.push_back({drone_id, bucket_it->first, bucket_it->second.hash,
+                                                     bucket_it->second.count});
+}
+
+void PlotHashTree::clear() {
+   _drones.clear();
+   _root_hash = 0;
+   _root_count = 0;
+}
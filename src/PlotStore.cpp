@@ -0,0 +1,250 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+#include "PlotStore.h"
+#include "DronePlotDB.h"
+
+/*****************************************************************************************
+ * PlotRef - Constructor, binds the attribute references to row offset of the chunk
+ *****************************************************************************************/
+PlotRef::PlotRef(PlotChunk &chunk, size_t offset):
+               drone_id(chunk.drone_id[offset]),
+               node_id(chunk.node_id[offset]),
+               timestamp(chunk.timestamp[offset]),
+               latitude(chunk.latitude[offset]),
+               longitude(chunk.longitude[offset]),
+               _flags(chunk.flags[offset]),
+               _lsn(chunk.lsn[offset])
+{
+
+}
+
+/*****************************************************************************************
+ * getPlot - copies this row's attributes (including flags) into a DronePlot object
+ * assign - overwrites this row with the attributes (including flags) of a DronePlot
+ *****************************************************************************************/
+void PlotRef::getPlot(DronePlot &plot) {
+   plot.drone_id = drone_id;
+   plot.node_id = node_id;
+   plot.timestamp = timestamp;
+   plot.latitude = latitude;
+   plot.longitude = longitude;
+   plot.clrFlags(0xFFFF);
+   plot.setFlags(_flags);
+}
+
+void PlotRef::assign(DronePlot &plot) {
+   drone_id = plot.drone_id;
+   node_id = plot.node_id;
+   timestamp = plot.timestamp;
+   latitude = plot.latitude;
+   longitude = plot.longitude;
+   _flags = plot.getFlags();
+}
+
+/*****************************************************************************************
+ * serialize / writeCSV - same output as the DronePlot functions of the same name
+ *****************************************************************************************/
+void PlotRef::serialize(std::vector<uint8_t> &buf) {
+   DronePlot plot;
+   getPlot(plot);
+   plot.serialize(buf);
+}
+
+void PlotRef::writeCSV(std::string &buf) {
+   DronePlot plot;
+   getPlot(plot);
+   plot.writeCSV(buf);
+}
+
+/*****************************************************************************************
+ * PlotStore - Constructor, starts empty with no chunks allocated
+ *****************************************************************************************/
+PlotStore::PlotStore():
+               _base(0),
+               _head(0),
+               _tail(0)
+{
+
+}
+
+PlotStore::~PlotStore() {
+
+}
+
+/*****************************************************************************************
+ * append - adds a plot to the end of the store, allocating a new chunk if the last one
+ *          is full
+ *
+ *    Returns: the absolute slot the plot was stored in
+ *****************************************************************************************/
+size_t PlotStore::append(unsigned int drone_id, unsigned int node_id, time_t timestamp,
+                         float latitude, float longitude, unsigned short flags, uint64_t lsn) {
+
+   if (_tail == _base + _chunks.size() * plot_chunk_size)
+      _chunks.emplace_back(new PlotChunk);
+
+   size_t slot = _tail;
+   PlotChunk &chunk = chunkFor(slot);
+   size_t off = slot % plot_chunk_size;
+
+   chunk.drone_id[off] = drone_id;
+   chunk.node_id[off] = node_id;
+   chunk.timestamp[off] = timestamp;
+   chunk.latitude[off] = latitude;
+   chunk.longitude[off] = longitude;
+   chunk.flags[off] = flags;
+   chunk.lsn[off] = lsn;
+
+   _tail++;
+   return slot;
+}
+
+size_t PlotStore::append(DronePlot &plot, uint64_t lsn) {
+   return append(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude, plot.longitude,
+                                                                     plot.getFlags(), lsn);
+}
+
+/*****************************************************************************************
+ * extend - grows the store by count rows, allocating all the chunks they need up front. The
+ *          new rows hold whatever the chunk memory held until the caller writes them, which
+ *          can be done from several threads at once since no chunk is allocated after this
+ *
+ *    Returns: the absolute slot of the first new row
+ *****************************************************************************************/
+size_t PlotStore::extend(size_t count) {
+   size_t first = _tail;
+
+   while (_base + _chunks.size() * plot_chunk_size < _tail + count)
+      _chunks.emplace_back(new PlotChunk);
+
+   _tail += count;
+   return first;
+}
+
+/*****************************************************************************************
+ * at - returns a reference handle to the row at the absolute slot
+ *
+ *    Throws: runtime_error if the slot is not a live row
+ *****************************************************************************************/
+PlotRef PlotStore::at(size_t slot) {
+   if ((slot < _head) || (slot >= _tail))
+      throw std::runtime_error("PlotStore slot accessed out of range.");
+
+   return PlotRef(chunkFor(slot), slot % plot_chunk_size);
+}
+
+/*****************************************************************************************
+ * popFront - removes the oldest row. Slot numbers of the remaining rows do not change.
+ *****************************************************************************************/
+void PlotStore::popFront() {
+   if (_head == _tail)
+      return;
+
+   _head++;
+
+   // Release the first chunk once every row in it has been popped
+   if (_head - _base >= plot_chunk_size) {
+      _chunks.erase(_chunks.begin());
+      _base += plot_chunk_size;
+   }
+}
+
+/*****************************************************************************************
+ * erase - removes the row at the slot. All later rows move down one slot.
+ *
+ *    Throws: runtime_error if the slot is not a live row
+ *****************************************************************************************/
+void PlotStore::erase(size_t slot) {
+   if ((slot < _head) || (slot >= _tail))
+      throw std::runtime_error("PlotStore erase called with slot out of range.");
+
+   for (size_t i = slot + 1; i < _tail; i++)
+      copySlot(i, slot++);
+
+   truncate(_tail - 1);
+}
+
+/*****************************************************************************************
+ * sortByTime - stable sort of the rows by timestamp. Sorts a permutation of the slots
+ *              by the timestamp column, then gathers each column into new chunks.
+ *****************************************************************************************/
+void PlotStore::sortByTime() {
+   std::vector<size_t> order;
+   order.reserve(size());
+   for (size_t i = _head; i < _tail; i++)
+      order.push_back(i);
+
+   std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+                        return chunkFor(a).timestamp[a % plot_chunk_size] <
+                               chunkFor(b).timestamp[b % plot_chunk_size]; });
+
+   PlotStore sorted;
+   for (size_t i = 0; i < order.size(); i++) {
+      PlotChunk &src = chunkFor(order[i]);
+      size_t off = order[i] % plot_chunk_size;
+
+      sorted.append(src.drone_id[off], src.node_id[off], src.timestamp[off], src.latitude[off],
+                                 src.longitude[off], src.flags[off], src.lsn[off]);
+   }
+
+   _chunks.swap(sorted._chunks);
+   _base = sorted._base;
+   _head = sorted._head;
+   _tail = sorted._tail;
+}
+
+/*****************************************************************************************
+ * clear - removes all plots and frees the chunks
+ *****************************************************************************************/
+void PlotStore::clear() {
+   _chunks.clear();
+   _base = _head = _tail = 0;
+}
+
+/*****************************************************************************************
+ * getChunkRange - gets the offsets of the live rows inside chunk i
+ *
+ *    Params:  i - index of the chunk, 0 to numChunks()-1
+ *             begin_off - first live row offset in the chunk
+ *             end_off - one past the last live row offset in the chunk
+ *****************************************************************************************/
+void PlotStore::getChunkRange(size_t i, size_t &begin_off, size_t &end_off) {
+   size_t chunk_start = _base + i * plot_chunk_size;
+
+   begin_off = (_head > chunk_start) ? _head - chunk_start : 0;
+   end_off = std::min(plot_chunk_size, _tail - chunk_start);
+}
+
+/*****************************************************************************************
+ * copySlot - copies every column of row src over row dst
+ *****************************************************************************************/
+void PlotStore::copySlot(size_t src, size_t dst) {
+   PlotChunk &s = chunkFor(src);
+   PlotChunk &d = chunkFor(dst);
+   size_t so = src % plot_chunk_size;
+   size_t d_o = dst % plot_chunk_size;
+
+   d.drone_id[d_o] = s.drone_id[so];
+   d.node_id[d_o] = s.node_id[so];
+   d.timestamp[d_o] = s.timestamp[so];
+   d.latitude[d_o] = s.latitude[so];
+   d.longitude[d_o] = s.longitude[so];
+   d.flags[d_o] = s.flags[so];
+   d.lsn[d_o] = s.lsn[so];
+}
+
+/*****************************************************************************************
+ * truncate - drops all rows from new_tail onward and frees chunks left empty
+ *****************************************************************************************/
+void PlotStore::truncate(size_t new_tail) {
+   _tail = new_tail;
+   if (_head == _tail) {
+      clear();
+      return;
+   }
+
+   size_t needed = (_tail - _base + plot_chunk_size - 1) / plot_chunk_size;
+   _chunks.resize(needed);
+}
@@ -0,0 +1,630 @@
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "PlotWAL.h"
+#include "DronePlotDB.h"
+#include "Frame.h"
+#include "FileDesc.h"
+
+const char wal_magic[] = { 'P', 'W', 'A', 'L' };
+const char checkpoint_magic[] = { 'P', 'C', 'K', 'P' };
+const uint8_t wal_version = 1;
+
+// Magic and version, padded to 8 bytes
+const size_t wal_file_header = 8;
+const size_t wal_block_header = 8;
+
+// One plot in DronePlot::serialize order, and with its flags after it as logged
+const size_t wal_binary_size = sizeof(unsigned int) * 2 + sizeof(time_t) + sizeof(float) * 2;
+const size_t wal_plot_size = wal_binary_size + sizeof(unsigned short);
+
+/*****************************************************************************************
+ * putBinary / getBinary - a plot's fields in the order DronePlot::serialize writes them
+ *****************************************************************************************/
+static uint8_t *putBinary(uint8_t *ptr, DronePlot &plot) {
+   memcpy(ptr, &plot.drone_id, sizeof(plot.drone_id));
+   ptr += sizeof(plot.drone_id);
+   memcpy(ptr, &plot.node_id, sizeof(plot.node_id));
+   ptr += sizeof(plot.node_id);
+   memcpy(ptr, &plot.timestamp, sizeof(plot.timestamp));
+   ptr += sizeof(plot.timestamp);
+   memcpy(ptr, &plot.latitude, sizeof(plot.latitude));
+   ptr += sizeof(plot.latitude);
+   memcpy(ptr, &plot.longitude, sizeof(plot.longitude));
+   return ptr + sizeof(plot.longitude);
+}
+
+static const uint8_t *getBinary(const uint8_t *ptr, DronePlot &plot) {
+   memcpy(&plot.drone_id, ptr, sizeof(plot.drone_id));
+   ptr += sizeof(plot.drone_id);
+   memcpy(&plot.node_id, ptr, sizeof(plot.node_id));
+   ptr += sizeof(plot.node_id);
+   memcpy(&plot.timestamp, ptr, sizeof(plot.timestamp));
+   ptr += sizeof(plot.timestamp);
+   memcpy(&plot.latitude, ptr, sizeof(plot.latitude));
+   ptr += sizeof(plot.latitude);
+   memcpy(&plot.longitude, ptr, sizeof(plot.longitude));
+   return ptr + sizeof(plot.longitude);
+}
+
+/*****************************************************************************************
+ * writeAll - writes the whole buffer, retrying short writes
+ *
+ *    Returns: false on an I/O error (errno is left set)
+ *****************************************************************************************/
+static bool writeAll(int fd, const uint8_t *data, size_t len) {
+   while (len > 0) {
+      ssize_t results = write(fd, data, len);
+      if (results < 0) {
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+      data += results;
+      len -= results;
+   }
+   return true;
+}
+
+PlotWAL::PlotWAL(const char *dir, unsigned int verbosity):
+                                 _dir(dir),
+                                 _verbosity(verbosity),
+                                 _db(NULL),
+                                 _fd(-1),
+                                 _segment(0),
+                                 _appended(0),
+                                 _carry_through(0),
+                                 _durable(0),
+                                 _write_failed(false),
+                                 _since_checkpoint(0),
+                                 _last_checkpoint(0),
+                                 _checkpoint_wanted(false),
+                                 _stop(false),
+                                 _running(false)
+{
+   pthread_mutex_init(&_mutex, NULL);
+   pthread_cond_init(&_wake, NULL);
+}
+
+PlotWAL::~PlotWAL() {
+   stop();
+
+   pthread_cond_destroy(&_wake);
+   pthread_mutex_destroy(&_mutex);
+}
+
+/*****************************************************************************************
+ * recover - rebuilds the database from disk: the newest checkpoint that loads cleanly, then
+ *           every log segment numbered from that checkpoint on, in order
+ *
+ *    Params:  db - the (empty) database to load into
+ *
+ *    Returns: number of plots recovered
+ *
+ *    Throws: runtime_error if the WAL directory can't be created or listed
+ *****************************************************************************************/
+size_t PlotWAL::recover(DronePlotDB &db) {
+   auto started = std::chrono::steady_clock::now();
+
+   if ((mkdir(_dir.c_str(), S_IRWXU) == -1) && (errno != EEXIST))
+      throw std::runtime_error(std::string("Unable to create WAL directory ") + _dir + ": " +
+                                                                             strerror(errno));
+
+   std::vector<uint64_t> segments, checkpoints;
+   listFiles(segments, checkpoints);
+
+   // A checkpoint that doesn't check out is skipped for the one before it
+   uint64_t base = 0;
+   size_t from_checkpoint = 0;
+   for (auto it = checkpoints.rbegin(); it != checkpoints.rend(); it++) {
+      if (loadCheckpoint(*it, db, from_checkpoint)) {
+         base = *it;
+         break;
+      }
+      std::cerr << "Checkpoint " << getPath("checkpoint", *it) << " is corrupt, skipping it.\n";
+   }
+
+   size_t from_log = 0;
+   for (unsigned int i = 0; i < segments.size(); i++) {
+      if (segments[i] >= base)
+         from_log += replaySegment(segments[i], db);
+   }
+
+   // Never reuse a segment number, the one after a checkpoint may already have data
+   _segment = base;
+   if (!segments.empty() && (segments.back() >= _segment))
+      _segment = segments.back() + 1;
+
+   if (_verbosity >= 1) {
+      auto msecs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                             std::chrono::steady_clock::now() - started).count();
+      std::cout << "Recovered " << from_checkpoint << " plots from the checkpoint and " <<
+                   from_log << " from the log in " << msecs << " ms.\n";
+   }
+   return from_checkpoint + from_log;
+}
+
+/*****************************************************************************************
+ * start - begins logging: opens the next segment, hooks into the db and starts the commit
+ *         thread
+ *
+ *    Throws: runtime_error if the segment can't be created or the thread can't be started
+ *****************************************************************************************/
+void PlotWAL::start(DronePlotDB &db) {
+   if (!openSegment(_segment))
+      throw std::runtime_error(std::string("Unable to create WAL segment ") +
+                               getPath("wal", _segment) + ": " + strerror(errno));
+
+   _db = &db;
+   _last_checkpoint = time(NULL);
+   _stop = false;
+   db.attachWAL(this);
+
+   if (pthread_create(&_thread, NULL, t_commit, (void *) this) != 0) {
+      db.attachWAL(NULL);
+      throw std::runtime_error("Unable to create WAL commit thread");
+   }
+   _running = true;
+}
+
+/*****************************************************************************************
+ * stop - has the commit thread write what is left and take a final checkpoint (so a clean
+ *        restart has no log to replay), then detaches from the db. Reports any plots that
+ *        never made it to disk
+ *****************************************************************************************/
+void PlotWAL::stop() {
+   if (!_running)
+      return;
+
+   pthread_mutex_lock(&_mutex);
+   _stop = true;
+   pthread_cond_signal(&_wake);
+   pthread_mutex_unlock(&_mutex);
+
+   pthread_join(_thread, NULL);
+   _running = false;
+
+   if (_durable < _appended)
+      std::cerr << "WAL: " << (_appended - _durable) << " plots could not be written to " <<
+                                                                               _dir << ".\n";
+
+   _db->attachWAL(NULL);
+   close(_fd);
+   _fd = -1;
+}
+
+/*****************************************************************************************
+ * append - adds a plot to the next commit. Wakes the commit thread early once a full block
+ *          is waiting
+ *****************************************************************************************/
+void PlotWAL::append(DronePlot &plot) {
+   uint8_t rec[wal_plot_size];
+   uint8_t *ptr = putBinary(rec, plot);
+   unsigned short flags = plot.getFlags();
+   memcpy(ptr, &flags, sizeof(flags));
+
+   pthread_mutex_lock(&_mutex);
+   _pending.insert(_pending.end(), rec, rec + wal_plot_size);
+   _appended++;
+   if (_pending.size() >= wal_commit_bytes)
+      pthread_cond_signal(&_wake);
+   pthread_mutex_unlock(&_mutex);
+}
+
+void PlotWAL::requestCheckpoint() {
+   pthread_mutex_lock(&_mutex);
+   _checkpoint_wanted = true;
+   pthread_cond_signal(&_wake);
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * rotate - sets aside what is waiting to be committed, which belongs to the segment that is
+ *          ending, and moves on to the next segment number
+ *
+ *    Returns: the new segment's number
+ *****************************************************************************************/
+uint64_t PlotWAL::rotate() {
+   pthread_mutex_lock(&_mutex);
+   _carry.insert(_carry.end(), _pending.begin(), _pending.end());
+   _pending.clear();
+   _carry_through = _appended;
+   uint64_t next = ++_segment;
+   pthread_mutex_unlock(&_mutex);
+
+   return next;
+}
+
+void *PlotWAL::t_commit(void *data) {
+   static_cast<PlotWAL *>(data)->commitLoop();
+   return NULL;
+}
+
+/*****************************************************************************************
+ * commitLoop - the commit thread. Every wal_commit_ms (sooner if a block fills up) writes
+ *              whatever has been appended as one block with one fsync, then takes a
+ *              checkpoint if one is due. A failed write is reported and a checkpoint is
+ *              tried in its place, since it writes out everything, every wal_retry_secs
+ *              until one succeeds. Blocks written in the meantime don't count as on disk,
+ *              since the log has a hole before them
+ *****************************************************************************************/
+void PlotWAL::commitLoop() {
+   pthread_mutex_lock(&_mutex);
+   while (true) {
+      if (!_stop && !_checkpoint_wanted && (_pending.size() < wal_commit_bytes)) {
+         struct timespec wake;
+         clock_gettime(CLOCK_REALTIME, &wake);
+         wake.tv_nsec += wal_commit_ms * 1000000L;
+         if (wake.tv_nsec >= 1000000000L) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
+         }
+         pthread_cond_timedwait(&_wake, &_mutex, &wake);
+      }
+
+      bool stopping = _stop;
+      std::vector<uint8_t> block;
+      block.swap(_pending);
+      uint64_t through = _appended;
+      pthread_mutex_unlock(&_mutex);
+
+      bool failed = false;
+      if (!block.empty()) {
+         try {
+            writeBlock(block);
+         } catch (std::runtime_error &e) {
+            std::cerr << e.what() << "\n";
+            failed = true;
+         }
+      }
+
+      pthread_mutex_lock(&_mutex);
+      if (failed) {
+         _write_failed = true;
+      } else if (!_write_failed) {
+         _since_checkpoint += through - _durable;
+         _durable = through;
+      }
+
+      bool due = _checkpoint_wanted || (_since_checkpoint >= wal_checkpoint_plots) ||
+                 (_write_failed && (stopping ||
+                                    (time(NULL) - _last_checkpoint >= wal_retry_secs))) ||
+                 ((_since_checkpoint > 0) && (stopping ||
+                                    (time(NULL) - _last_checkpoint >= wal_checkpoint_secs)));
+      if (due) {
+         _checkpoint_wanted = false;
+         pthread_mutex_unlock(&_mutex);
+         try {
+            checkpoint();
+         } catch (std::runtime_error &e) {
+            std::cerr << e.what() << "\n";
+         }
+         pthread_mutex_lock(&_mutex);
+      }
+
+      if (_write_failed && (failed || due))
+         std::cerr << "WAL: " << (_appended - _durable) << " plots are not on disk yet.\n";
+
+      if (stopping)
+         break;
+   }
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * checkpoint - copies the database out (which also rotates the log), finishes the old
+ *              segment, starts the new one and writes the copy. Once the checkpoint is on
+ *              disk, the segments and checkpoints it replaces are deleted
+ *
+ *    Throws: runtime_error if a file can't be written
+ *****************************************************************************************/
+void PlotWAL::checkpoint() {
+   auto started = std::chrono::steady_clock::now();
+
+   std::vector<DronePlot> plots;
+   uint64_t segment = _db->checkpointPlots(plots);
+
+   pthread_mutex_lock(&_mutex);
+   std::vector<uint8_t> block;
+   block.swap(_carry);
+   uint64_t through = _carry_through;
+   _since_checkpoint = 0;
+   _last_checkpoint = time(NULL);
+   pthread_mutex_unlock(&_mutex);
+
+   // The checkpoint has these plots too, so it can still go ahead if they can't be written
+   bool written = true;
+   if (!block.empty()) {
+      try {
+         writeBlock(block);
+      } catch (std::runtime_error &e) {
+         std::cerr << e.what() << "\n";
+         written = false;
+      }
+   }
+
+   pthread_mutex_lock(&_mutex);
+   if (!written)
+      _write_failed = true;
+   else if (!_write_failed && (through > _durable))
+      _durable = through;
+   pthread_mutex_unlock(&_mutex);
+
+   close(_fd);
+   if (!openSegment(segment))
+      throw std::runtime_error(std::string("Unable to create WAL segment ") +
+                               getPath("wal", segment) + ": " + strerror(errno));
+
+   writeCheckpoint(segment, plots);
+
+   // Everything appended before the rotate is on disk now, whatever failed before it
+   pthread_mutex_lock(&_mutex);
+   _write_failed = false;
+   if (through > _durable)
+      _durable = through;
+   pthread_mutex_unlock(&_mutex);
+
+   removeBefore(segment);
+
+   if (_verbosity >= 2) {
+      auto msecs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                             std::chrono::steady_clock::now() - started).count();
+      std::cout << "Checkpointed " << plots.size() << " plots in " << msecs << " ms.\n";
+   }
+}
+
+/*****************************************************************************************
+ * openSegment - creates a segment file, writes its header and makes the name durable
+ *
+ *    Returns: false if the file couldn't be created (errno is left set)
+ *****************************************************************************************/
+bool PlotWAL::openSegment(uint64_t segment) {
+   _fd = open(getPath("wal", segment).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                                                                           S_IRUSR | S_IWUSR);
+   if (_fd == -1)
+      return false;
+
+   uint8_t hdr[wal_file_header] = {0};
+   memcpy(hdr, wal_magic, sizeof(wal_magic));
+   hdr[sizeof(wal_magic)] = wal_version;
+   if (!writeAll(_fd, hdr, sizeof(hdr)) || (fdatasync(_fd) == -1))
+      return false;
+
+   syncDir();
+   return true;
+}
+
+/*****************************************************************************************
+ * writeBlock - appends a block of plots to the current segment and fsyncs it
+ *
+ *    Throws: runtime_error if the write or sync fails
+ *****************************************************************************************/
+void PlotWAL::writeBlock(std::vector<uint8_t> &plots) {
+   uint32_t hdr[2] = { (uint32_t) plots.size(), Frame::crc32(plots.data(), plots.size()) };
+
+   if (!writeAll(_fd, (const uint8_t *) hdr, sizeof(hdr)) ||
+       !writeAll(_fd, plots.data(), plots.size()) || (fdatasync(_fd) == -1))
+      throw std::runtime_error(std::string("WAL write failed: ") + strerror(errno));
+}
+
+/*****************************************************************************************
+ * writeCheckpoint - writes the plots to a temporary file, syncs it and renames it into
+ *                   place, so a crash part way through leaves the previous checkpoint
+ *
+ *    Throws: runtime_error if the file can't be written
+ *****************************************************************************************/
+void PlotWAL::writeCheckpoint(uint64_t segment, std::vector<DronePlot> &plots) {
+   uint64_t count = plots.size();
+
+   std::vector<uint8_t> buf(wal_file_header + 16 + count * wal_plot_size + sizeof(uint32_t));
+   uint8_t *ptr = buf.data();
+   memcpy(ptr, checkpoint_magic, sizeof(checkpoint_magic));
+   ptr[sizeof(checkpoint_magic)] = wal_version;
+   ptr += wal_file_header;
+   memcpy(ptr, &segment, sizeof(segment));
+   ptr += sizeof(segment);
+   memcpy(ptr, &count, sizeof(count));
+   ptr += sizeof(count);
+
+   // The plots, then the flags column
+   for (size_t i = 0; i < count; i++)
+      ptr = putBinary(ptr, plots[i]);
+   for (size_t i = 0; i < count; i++) {
+      unsigned short flags = plots[i].getFlags();
+      memcpy(ptr, &flags, sizeof(flags));
+      ptr += sizeof(flags);
+   }
+
+   uint32_t crc = Frame::crc32(buf.data(), ptr - buf.data());
+   memcpy(ptr, &crc, sizeof(crc));
+
+   std::string path = getPath("checkpoint", segment);
+   std::string tmp_path = path + ".tmp";
+   int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+   if ((fd == -1) || !writeAll(fd, buf.data(), buf.size()) || (fsync(fd) == -1) ||
+                                                (rename(tmp_path.c_str(), path.c_str()) == -1)) {
+      std::string err = strerror(errno);
+      if (fd != -1)
+         close(fd);
+      unlink(tmp_path.c_str());
+      throw std::runtime_error("Checkpoint write failed: " + err);
+   }
+   close(fd);
+   syncDir();
+}
+
+/*****************************************************************************************
+ * loadCheckpoint - maps a checkpoint file and checks it over completely, then bulk-loads its
+ *                  plots and flags into the db straight from the mapping
+ *
+ *    Params:  count - set to the number of plots loaded
+ *
+ *    Returns: false (and leaves the db alone) if the file is missing, truncated or corrupt
+ *****************************************************************************************/
+bool PlotWAL::loadCheckpoint(uint64_t segment, DronePlotDB &db, size_t &count) {
+   FileFD infile(getPath("checkpoint", segment).c_str());
+   if (!infile.openFile(FileFD::readfd))
+      return false;
+
+   size_t len;
+   const uint8_t *data = infile.mapFile(len);
+   infile.closeFD();
+   if (data == NULL)
+      return false;
+
+   bool valid = false;
+   const size_t fixed = wal_file_header + 16 + sizeof(uint32_t);
+   uint64_t in_segment, in_count;
+   if ((len >= fixed) && (memcmp(data, checkpoint_magic, sizeof(checkpoint_magic)) == 0) &&
+                         (data[sizeof(checkpoint_magic)] == wal_version)) {
+      memcpy(&in_segment, data + wal_file_header, sizeof(in_segment));
+      memcpy(&in_count, data + wal_file_header + sizeof(in_segment), sizeof(in_count));
+
+      uint32_t crc;
+      memcpy(&crc, data + len - sizeof(crc), sizeof(crc));
+      valid = (in_segment == segment) && (in_count <= (len - fixed) / wal_plot_size) &&
+              (len == fixed + in_count * wal_plot_size) &&
+              (crc == Frame::crc32(data, len - sizeof(crc)));
+   }
+
+   if (valid) {
+      const uint8_t *plots = data + wal_file_header + 16;
+      count = db.loadBinaryData(plots, in_count, plots + in_count * wal_binary_size);
+   }
+
+   FileFD::unmapFile(data, len);
+   return valid;
+}
+
+/*****************************************************************************************
+ * replaySegment - adds the plots of every intact block in a segment to the db as one batch.
+ *                 Stops at the first block that is cut short or fails its CRC (the tail of
+ *                 a crash)
+ *
+ *    Returns: number of plots replayed
+ *****************************************************************************************/
+size_t PlotWAL::replaySegment(uint64_t segment, DronePlotDB &db) {
+   FileFD infile(getPath("wal", segment).c_str());
+   if (!infile.openFile(FileFD::readfd))
+      return 0;
+
+   size_t len;
+   const uint8_t *data = infile.mapFile(len);
+   infile.closeFD();
+   if ((data == NULL) || (len < wal_file_header) ||
+                         (memcmp(data, wal_magic, sizeof(wal_magic)) != 0) ||
+                         (data[sizeof(wal_magic)] != wal_version)) {
+      FileFD::unmapFile(data, len);
+      return 0;
+   }
+
+   std::vector<DronePlot> plots;
+   const uint8_t *ptr = data + wal_file_header;
+   const uint8_t *end = data + len;
+   DronePlot plot;
+   while ((size_t) (end - ptr) >= wal_block_header) {
+      uint32_t hdr[2];
+      memcpy(hdr, ptr, sizeof(hdr));
+
+      const uint8_t *block = ptr + wal_block_header;
+      if ((hdr[0] > (size_t) (end - block)) || (hdr[0] % wal_plot_size != 0) ||
+                                                   (Frame::crc32(block, hdr[0]) != hdr[1])) {
+         if (_verbosity >= 1)
+            std::cout << "Dropping an incomplete block at the end of " <<
+                                                          getPath("wal", segment) << "\n";
+         break;
+      }
+
+      for (const uint8_t *rec = block; rec < block + hdr[0]; rec += wal_plot_size) {
+         unsigned short flags;
+         memcpy(&flags, getBinary(rec, plot), sizeof(flags));
+         plot.clrFlags(plot.getFlags());
+         plot.setFlags(flags);
+         plots.push_back(plot);
+      }
+      ptr = block + hdr[0];
+   }
+
+   FileFD::unmapFile(data, len);
+
+   // The whole segment goes in under one lock
+   db.addPlots(plots);
+   return plots.size();
+}
+
+/*****************************************************************************************
+ * listFiles - finds the segment and checkpoint numbers in the WAL directory, sorted
+ *****************************************************************************************/
+void PlotWAL::listFiles(std::vector<uint64_t> &segments, std::vector<uint64_t> &checkpoints) {
+   DIR *dir = opendir(_dir.c_str());
+   if (dir == NULL)
+      throw std::runtime_error(std::string("Unable to read WAL directory ") + _dir + ": " +
+                                                                             strerror(errno));
+
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL) {
+      const char *dot = strchr(entry->d_name, '.');
+      if ((dot == NULL) || !isdigit(dot[1]))
+         continue;
+
+      // Leaves out anything with more after the number, like an unfinished .tmp
+      char *num_end;
+      uint64_t num = strtoull(dot + 1, &num_end, 10);
+      if (*num_end != '\0')
+         continue;
+
+      std::string prefix(entry->d_name, dot - entry->d_name);
+      if (prefix == "wal")
+         segments.push_back(num);
+      else if (prefix == "checkpoint")
+         checkpoints.push_back(num);
+   }
+   closedir(dir);
+
+   std::sort(segments.begin(), segments.end());
+   std::sort(checkpoints.begin(), checkpoints.end());
+}
+
+/*****************************************************************************************
+ * removeBefore - deletes the segments and checkpoints a checkpoint at this segment replaces
+ *****************************************************************************************/
+void PlotWAL::removeBefore(uint64_t segment) {
+   std::vector<uint64_t> segments, checkpoints;
+   listFiles(segments, checkpoints);
+
+   for (unsigned int i = 0; i < segments.size(); i++) {
+      if (segments[i] < segment)
+         unlink(getPath("wal", segments[i]).c_str());
+   }
+   for (unsigned int i = 0; i < checkpoints.size(); i++) {
+      if (checkpoints[i] < segment)
+         unlink(getPath("checkpoint", checkpoints[i]).c_str());
+   }
+}
+
+std::string PlotWAL::getPath(const char *prefix, uint64_t segment) {
+   char name[48];
+   snprintf(name, sizeof(name), "/%s.%010llu", prefix, (unsigned long long) segment);
+   return _dir + name;
+}
+
+/*****************************************************************************************
+ * syncDir - fsyncs the directory so files just created or renamed survive a crash
+ *****************************************************************************************/
+void PlotWAL::syncDir() {
+   int fd = open(_dir.c_str(), O_RDONLY | O_DIRECTORY);
+   if (fd == -1)
+      return;
+   fsync(fd);
+   close(fd);
+}
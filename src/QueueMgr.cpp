@@ -2,12 +2,15 @@
 #include <arpa/inet.h>
 #include <tuple>
 #include <sstream>
+#include <cstring>
 #include <crypto++/osrng.h>
 #include <crypto++/filters.h>
 #include <crypto++/files.h>
+#include <crypto++/cpu.h>
 #include "strfuncts.h"
 #include "ReplServer.h"
 #include "TCPConn.h"
+#include "LZCompressor.h"
 
 /********************************************************************************************
  * QueueMgr (constructor) - loads a hard-coded server.txt that contains a comma-separated list
@@ -15,8 +18,8 @@
  *
  ********************************************************************************************/
 
-QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity)
-               
+QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity),
+                                           _compressor(new LZCompressor)
 {
    if (loadServerList("servers.txt") <= 0)
       throw std::runtime_error("Could not open server.txt file, or file was empty/corrupt.");
@@ -145,6 +148,8 @@ void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
    logname += "server.log";
    changeLogfile(logname.c_str()); 
    _server_log.writeLog("Server started.");
+   _server_log.writeLog(CryptoPP::HasAESNI() ? "Replication data encrypted with AES-GCM using AES-NI." :
+                              "Replication data encrypted with AES-GCM (no AES-NI, software AES).");
 }
 
 
@@ -157,8 +162,12 @@ void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
  *********************************************************************************************/
 void QueueMgr::handleQueue() {
 
-   // Accept new connections, if any
-   handleSocket();
+   // Accept new connections, if any. They answer the client's SID with ours
+   TCPConn *new_conn = handleSocket();
+   if (new_conn != NULL) {
+      new_conn->setSvrID(getServerID());
+      new_conn->setPersistent(_persistent);
+   }
 
    // Handle any open connections, reading from and writing to the socket
    handleConnections();
@@ -172,7 +181,8 @@ void QueueMgr::handleQueue() {
  * populateQueue - Gets the information from the connections and populates them into the queue
  *                 for handling later
  *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types. A
+ *            compressed batch that can't be unpacked is logged and dropped
  **********************************************************************************************/
 void QueueMgr::populateQueue() {
 
@@ -181,8 +191,8 @@ void QueueMgr::populateQueue() {
    for ( ; conn_it != _connlist.end(); conn_it++) {
       
       // If the connection has data marked ready, get it and handle it based on the
-      // command at the beginning
-      if (((*conn_it)->getStatus() == TCPConn::s_hasdata) && (*conn_it)->isInputDataReady()) {
+      // command at the beginning. Persistent connections have data ready while still open
+      if ((*conn_it)->isInputDataReady()) {
          std::vector<uint8_t> buf;
 
          (*conn_it)->getInputData(buf);
@@ -191,12 +201,30 @@ void QueueMgr::populateQueue() {
             throw std::runtime_error("TCPConn claimed replication data but none existed.");
          }
         
+         // Undo the compression stage before it goes in the queue. A batch that won't
+         // unpack is dropped, the rest of the connections' data still gets handled
+         if (Compressor::isPacked(buf.data(), buf.size())) {
+            std::vector<uint8_t> unpacked;
+            try {
+               Compressor::unpack(buf.data(), buf.size(), unpacked);
+            } catch (std::runtime_error &e) {
+               std::stringstream msg;
+               msg << "Dropping a compressed batch from SID " << (*conn_it)->getNodeID() <<
+                                                                     ". Msg: " << e.what();
+               if (_verbosity >= 1)
+                  std::cout << msg.str() << "\n";
+               _server_log.writeLog(msg.str().c_str());
+               continue;
+            }
+            buf.swap(unpacked);
+         }
+
          // Add this data to the queue
-         _queue.emplace(recv, (*conn_it)->getNodeID(), buf);
          if (_verbosity >= 3) {
-            std::cout << "Replication info pulled off connection and placed into queue w/ " <<
-                              (buf.size()-4) / DronePlot::getDataSize() << " potential plots.\n";
-         }   
+            std::cout << "Replication info pulled off connection and placed into queue (" <<
+                              buf.size() << " bytes).\n";
+         }
+         _queue.emplace(recv, (*conn_it)->getNodeID(), std::move(buf));   
       }      
    }
 }
@@ -205,31 +233,235 @@ void QueueMgr::populateQueue() {
  * replToAll - places data into the queue for each server (calls replToServer). Replication 
                will happen on its own
  *
- *    Params:  data - the data in binary form to send to the server
+ *    Params:  data - the data in binary form to send to the server, moved into the batch
+ *                    the peers share
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
-void QueueMgr::sendToAll(std::vector<uint8_t> &data) {
+void QueueMgr::sendToAll(std::vector<uint8_t> &&data) {
+   std::vector<uint8_t> packed_data;
+   bool compressed = packBatch(data, packed_data);
+
+   // One copy of each form, shared by every peer it goes to
+   shared_batch raw = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+   shared_batch packed;
+   if (compressed)
+      packed = std::make_shared<const std::vector<uint8_t>>(std::move(packed_data));
+
    for (unsigned int i=0; i<_server_list.size(); i++) {
-      sendToServer(std::get<0>(_server_list[i]).c_str(), data);
+      const char *sid = std::get<0>(_server_list[i]).c_str();
+      if (compressed && (getPeerCaps(sid) & cap_compress))
+         sendToServer(sid, packed);
+      else
+         sendToServer(sid, raw);
    }
 
 }
 
+/*********************************************************************************************
+ * packBatch - runs the compression stage on an outgoing batch. Small batches are left alone,
+ *             and so are ones the compressor can't shrink by enough to matter. If that keeps
+ *             happening (already-dense data) it stops trying for a while.
+ *
+ *    Params:  data - the batch, replaced by the packed (header + compressed) batch if used
+ *
+ *    Returns: true if data was compressed
+ *********************************************************************************************/
+bool QueueMgr::packBatch(std::vector<uint8_t> &data) {
+   std::vector<uint8_t> packed;
+   if (!packBatch(data, packed))
+      return false;
+
+   data.swap(packed);
+   return true;
+}
+
+/*********************************************************************************************
+ * packBatch - as above, but leaves data alone and puts the packed batch in packed
+ *
+ *    Returns: true if data was compressed into packed (otherwise packed is left empty)
+ *********************************************************************************************/
+bool QueueMgr::packBatch(const std::vector<uint8_t> &data, std::vector<uint8_t> &packed) {
+   if (!_compressor || (data.size() < compress_min_bytes))
+      return false;
+
+   if (_compress_skip > 0) {
+      _compress_skip--;
+      _compress_skipped++;
+      return false;
+   }
+
+   _compressor->pack(data.data(), data.size(), packed);
+
+   if (packed.size() > data.size() * compress_max_ratio) {
+      packed.clear();
+      _compress_skipped++;
+      if (++_compress_poor >= compress_poor_limit) {
+         _compress_poor = 0;
+         _compress_skip = compress_backoff;
+      }
+      return false;
+   }
+
+   if (_verbosity >= 3)
+      std::cout << "Compressed batch from " << data.size() << " to " << packed.size() <<
+                                             " bytes with " << _compressor->getName() << ".\n";
+
+   _compress_poor = 0;
+   _compress_in += data.size();
+   _compress_out += packed.size();
+   return true;
+}
+
+/*********************************************************************************************
+ * logCompressionStats - writes how much the compression stage saved to the log
+ *********************************************************************************************/
+void QueueMgr::logCompressionStats() {
+   std::stringstream msg;
+   msg << "Compression: " << _compress_in << " bytes sent as " << _compress_out;
+   if (_compress_in > 0)
+      msg << " (" << (100 * _compress_out / _compress_in) << "%)";
+   msg << ", " << _compress_skipped << " batches sent uncompressed for a poor ratio.";
+
+   _server_log.writeLog(msg.str().c_str());
+   if (_verbosity >= 2)
+      std::cout << msg.str() << "\n";
+}
+
 /*********************************************************************************************
  * sendToServer - places data into the queue to be sent to the server indicated by
  *                server_id. Transmission will happen on its own
  *
  *    Params:  server_id - string of the server's name (will be mapped automatically to IP)
- *             data - the data in binary form to send to the server
+ *             data - the data in binary form to send to the server (the vector form moves
+ *                    it into the queued batch)
+ *             batch_lsn - highest LSN in the data. If non-zero, the peer's cursor advances to
+ *                         it when the ACK comes back, or the batch is re-sent if it doesn't
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
-void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data) {
-   _queue.emplace(send, server_id, data);
+void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &&data, uint64_t batch_lsn) {
+   sendToServer(server_id, std::make_shared<const std::vector<uint8_t>>(std::move(data)),
+                                                                                 batch_lsn);
+}
+
+void QueueMgr::sendToServer(const char *server_id, shared_batch data, uint64_t batch_lsn) {
+   if (batch_lsn > 0) {
+      peer_cursor &cursor = _cursors[server_id];
+      cursor.sent_lsn = batch_lsn;
+      cursor.in_flight = true;
+   }
+
+   _queue.emplace(send, server_id, std::move(data), batch_lsn);
 
 }
 
+/*********************************************************************************************
+ * getPeerCursor - gets the LSN the peer has acknowledged everything up to
+ *
+ *    Params:  server_id - the peer's server ID
+ *             lsn - loaded with the acknowledged LSN
+ *
+ *    Returns: true if the peer is ready for a new batch, false if one is still in flight
+ *********************************************************************************************/
+bool QueueMgr::getPeerCursor(const char *server_id, uint64_t &lsn) {
+   peer_cursor &cursor = _cursors[server_id];
+
+   lsn = cursor.acked_lsn;
+   return !cursor.in_flight;
+}
+
+/*********************************************************************************************
+ * skipToLSN - advances the peer's cursor without sending anything, for when every plot up to
+ *             the LSN was filtered out (e.g. all of them replicated in from elsewhere)
+ *********************************************************************************************/
+void QueueMgr::skipToLSN(const char *server_id, uint64_t lsn) {
+   peer_cursor &cursor = _cursors[server_id];
+
+   if (!cursor.in_flight && (lsn > cursor.acked_lsn))
+      cursor.acked_lsn = lsn;
+}
+
+/*********************************************************************************************
+ * rewindCursor - moves the peer's cursor back so everything after the LSN is sent again, for
+ *                a peer that has lost what it acknowledged (a restart)
+ *
+ *    Returns: true if the cursor was moved, false if a batch is in flight (its ACK would
+ *             move the cursor forward again, try after it lands)
+ *********************************************************************************************/
+bool QueueMgr::rewindCursor(const char *server_id, uint64_t lsn) {
+   peer_cursor &cursor = _cursors[server_id];
+
+   if (cursor.in_flight)
+      return false;
+
+   if (lsn < cursor.acked_lsn)
+      cursor.acked_lsn = lsn;
+   return true;
+}
+
+/*********************************************************************************************
+ * isBackpressured - checks whether the peer's connections are sending slower than we queue
+ *
+ *    Params:  server_id - the peer's server ID
+ *
+ *    Returns: true if a connection to the peer has max_pending_output or more bytes waiting
+ *             on the socket
+ *********************************************************************************************/
+bool QueueMgr::isBackpressured(const char *server_id) {
+   for (auto conn_it = _connlist.begin(); conn_it != _connlist.end(); conn_it++) {
+      if (!strcmp((*conn_it)->getNodeID(), server_id) &&
+                                    ((*conn_it)->getPendingOutput() >= max_pending_output))
+         return true;
+   }
+   return false;
+}
+
+/*********************************************************************************************
+ * handleConnections - before the connections are handled (and closed ones dropped), checks
+ *                     outgoing batches. An ACK'd batch moves the peer's cursor forward. A
+ *                     connection that closed without the ACK frees the peer so the next
+ *                     replication pass re-sends from the cursor. Also records the
+ *                     capabilities each peer sent in its handshake.
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ *********************************************************************************************/
+void QueueMgr::handleConnections() {
+
+   for (auto conn_it = _connlist.begin(); conn_it != _connlist.end(); conn_it++) {
+      TCPConn &conn = **conn_it;
+
+      if (conn.hasPeerCaps())
+         _cursors[conn.getNodeID()].caps = conn.getPeerCaps();
+
+      if (!conn.hasBatch())
+         continue;
+
+      peer_cursor &cursor = _cursors[conn.getNodeID()];
+      if (conn.isBatchAcked()) {
+         if (conn.getBatchLSN() > cursor.acked_lsn)
+            cursor.acked_lsn = conn.getBatchLSN();
+         cursor.in_flight = false;
+         conn.clearBatch();
+
+         if (_verbosity >= 3)
+            std::cout << "Peer " << conn.getNodeID() << " acknowledged through LSN " <<
+                                                               cursor.acked_lsn << "\n";
+      }
+      else if (!conn.isConnected() && (conn.getStatus() != TCPConn::s_connecting)) {
+         cursor.in_flight = false;
+         conn.clearBatch();
+
+         std::stringstream msg;
+         msg << "Batch to SID " << conn.getNodeID() << " through LSN " << cursor.sent_lsn <<
+                     " was not acknowledged. Will resend from LSN " << cursor.acked_lsn << ".";
+         _server_log.writeLog(msg.str().c_str());
+      }
+   }
+
+   TCPServer::handleConnections();
+}
+
 /*********************************************************************************************
  * pop - removes the next received data element sitting in the queue and returns the data 
  *       loaded into the parameters. Also assigns outgoing queue elements to a connection
@@ -245,13 +477,13 @@ void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data) {
  *********************************************************************************************/
 bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
    while (_queue.size() > 0) {
-      auto next_qe = _queue.front();
+      queue_element &next_qe = _queue.front();
 
       // If this a send item, create a connection and start sending
       if (next_qe.type == send) {
 
          // Set up the connection and attempt to establish link (will retry if failure)
-         launchDataConn(next_qe.server_id.c_str(), next_qe.data);
+         launchDataConn(next_qe.server_id.c_str(), next_qe.batch, next_qe.batch_lsn);
 
          _queue.pop();
          continue;  
@@ -271,9 +503,10 @@ bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
  *
  *    Params:  sid - pop action places the first recv'd pop server id into this attribute
  *             data - data received gets loaded into this vector
+ *             batch_lsn - LSN to report back to the cursor when the peer ACKs the data
  *
  *********************************************************************************************/
-void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
+void QueueMgr::launchDataConn(const char *sid, shared_batch data, uint64_t batch_lsn) {
 
    unsigned long ip_addr;
    unsigned short port;
@@ -292,10 +525,21 @@ void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
       throw std::runtime_error("Attempt to send data to server ID not in the server list.");
    }
 
+   // Already have an authenticated connection sitting idle to this server, use it
+   if (_persistent) {
+      for (auto conn_it = _connlist.begin(); conn_it != _connlist.end(); conn_it++) {
+         if ((*conn_it)->isIdle() && !strcmp((*conn_it)->getNodeID(), sid)) {
+            (*conn_it)->assignOutgoingData(data, batch_lsn);
+            return;
+         }
+      }
+   }
+
    // Try to connect to the server and if there's an issue, delete and re-throw socket_error
-   TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
+   TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _cipher_stats, _verbosity);
    new_conn->setNodeID(sid);
    new_conn->setSvrID(getServerID());
+   new_conn->setPersistent(_persistent);
 
    try {
       new_conn->connect(ip_addr, port);
@@ -309,7 +553,7 @@ void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
    }
 
 
-   new_conn->assignOutgoingData(data);
+   new_conn->assignOutgoingData(data, batch_lsn);
    _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
 }
 
@@ -0,0 +1,99 @@
+#include <limits>
+#include <algorithm>
+#include "ReorderBuffer.h"
+
+ReorderBuffer::ReorderBuffer(time_t lateness, time_t idle_secs):
+                                 _lateness(lateness),
+                                 _idle_secs(idle_secs),
+                                 _started(false),
+                                 _start(0),
+                                 _size(0),
+                                 _late(0)
+{
+
+}
+
+/*****************************************************************************************
+ * add - puts a plot in its drone's buffer and moves its node's progress up
+ *
+ *    Params:  now - when it arrived, on the same clock release is given
+ *
+ *    Returns: false if the plot is older than one already released for the drone, in which
+ *             case it is only counted
+ *****************************************************************************************/
+bool ReorderBuffer::add(const DronePlot &plot, time_t now) {
+   if (!_started) {
+      _started = true;
+      _start = now;
+   }
+
+   auto node_it = _nodes.find(plot.node_id);
+   if (node_it == _nodes.end())
+      node_it = _nodes.insert({plot.node_id, {plot.timestamp, now}}).first;
+
+   node_progress &node = node_it->second;
+   node.last_arrival = now;
+   if (plot.timestamp > node.newest)
+      node.newest = plot.timestamp;
+
+   auto drone_it = _drones.find(plot.drone_id);
+   if (drone_it == _drones.end()) {
+      drone_it = _drones.insert({plot.drone_id, drone_buf()}).first;
+      drone_it->second.released = std::numeric_limits<time_t>::min();
+   }
+
+   drone_buf &buf = drone_it->second;
+   if (plot.timestamp < buf.released) {
+      _late++;
+      return false;
+   }
+
+   buf.plots.emplace(plot.timestamp, plot);
+   _size++;
+   return true;
+}
+
+/*****************************************************************************************
+ * releaseThrough - moves every drone's plots with timestamps up to through into plots
+ *****************************************************************************************/
+size_t ReorderBuffer::releaseThrough(time_t through, std::vector<DronePlot> &plots) {
+   size_t count = 0;
+   for (auto &drone : _drones) {
+      drone_buf &buf = drone.second;
+
+      auto plot_it = buf.plots.begin();
+      while ((plot_it != buf.plots.end()) && (plot_it->first <= through)) {
+         plots.push_back(plot_it->second);
+         buf.released = plot_it->first;
+         plot_it = buf.plots.erase(plot_it);
+         count++;
+      }
+   }
+   _size -= count;
+   return count;
+}
+
+/*****************************************************************************************
+ * release - hands out the plots at or below the watermark. If every node has gone idle,
+ *           that is all of them. Until idle_secs after the first plot, it is none of them
+ *
+ *    Params:  now - the current time, on the clock add was given
+ *             plots - the released plots are appended here, each drone's in time order
+ *
+ *    Returns: the number of plots released
+ *****************************************************************************************/
+size_t ReorderBuffer::release(time_t now, std::vector<DronePlot> &plots) {
+   if (!_started || (now - _start <= _idle_secs))
+      return 0;
+
+   time_t watermark = std::numeric_limits<time_t>::max();
+   for (auto &node : _nodes) {
+      if (now - node.second.last_arrival <= _idle_secs)
+         watermark = std::min(watermark, node.second.newest - _lateness);
+   }
+   return releaseThrough(watermark, plots);
+}
+
+size_t ReorderBuffer::flush(std::vector<DronePlot> &plots) {
+   return releaseThrough(std::numeric_limits<time_t>::max(), plots);
+}
@@ -1,10 +1,47 @@
 #include <iostream>
 #include <exception>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <unordered_set>
 #include "ReplServer.h"
+#include "PlotCodec.h"
 
 const time_t secs_between_repl = 20;
+
+// Most servers in the replication group
 const unsigned int max_servers = 10;
 
+// Most plots sent to a peer in one replication batch. A peer that is further behind catches
+// up over several batches
+const size_t max_batch_plots = 10000;
+
+// Anti-entropy sync: how often (sim seconds), and the most buckets exchanged in one round.
+// Anything past that is picked up by the next round
+const time_t secs_between_sync = 60;
+const size_t max_sync_buckets = 256;
+
+// Buckets newer than this (sim seconds) are still arriving through normal replication and
+// are left out of the sync
+const time_t sync_settle_secs = 3 * secs_between_repl;
+
+// Plots per snapshot chunk, and how long (sim seconds) a snapshot source can go quiet before
+// the next peer is asked
+const size_t snapshot_chunk_plots = 65536;
+const time_t snapshot_retry_secs = 5 * secs_between_repl;
+
+// Clock skew: a peer's plot is matched with one of ours up to this many seconds apart (more
+// than clocks can be off by), and we correct our clock to the reference node once its skew
+// is this many seconds (the correction is whole seconds) after this many matches
+const time_t skew_match_secs = 10;
+const double skew_adjust_secs = 0.75;
+const uint64_t skew_min_matches = 5;
+
+// Track stream: a node's plots can come in out of order by as much as its clock gets
+// corrected (at least deconflict_secs is allowed, more if a skew estimate is bigger), and a
+// peer that hasn't sent anything in several replication intervals is taken to be idle
+const time_t track_idle_secs = 5 * secs_between_repl;
+
 /*********************************************************************************************
  * ReplServer (constructor) - creates our ReplServer. Initializes:
  *
@@ -19,6 +56,9 @@ ReplServer::ReplServer(DronePlotDB &plotdb, float time_mult)
                                _plotdb(plotdb),
                                _shutdown(false), 
                                _time_mult(time_mult),
+                               _skew_index(deconflict_tolerance, skew_match_secs,
+                                                               deconflict_retain_secs),
+                               _tracks(deconflict_secs, track_idle_secs),
                                _verbosity(1),
                                _ip_addr("127.0.0.1"),
                                _port(9999)
@@ -32,6 +72,9 @@ ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short
                                   _plotdb(plotdb),
                                   _shutdown(false), 
                                   _time_mult(time_mult), 
+                                  _skew_index(deconflict_tolerance, skew_match_secs,
+                                                                  deconflict_retain_secs),
+                                  _tracks(deconflict_secs, track_idle_secs),
                                   _verbosity(verbosity),
                                   _ip_addr(ip_addr),
                                   _port(port)
@@ -75,6 +118,8 @@ void ReplServer::replicate() {
 
    // Track when we started the server
    _last_repl = 0;
+   _last_sync = 0;
+   _snap_start = time(NULL);
 
    // Set up our queue's listening socket
    _queue.bindSvr(_ip_addr.c_str(), _port);
@@ -95,8 +140,20 @@ void ReplServer::replicate() {
       if (getAdjustedTime() - _last_repl > secs_between_repl) {
 
          queueNewPlots();
+         streamTracks();
          _last_repl = getAdjustedTime();
       }
+
+      // Less often, check with the peers that nothing was missed
+      if (getAdjustedTime() - _last_sync > secs_between_sync) {
+         startSync();
+         _last_sync = getAdjustedTime();
+      }
+
+      // Snapshots aren't tied to the replication timer, the next chunk goes as soon as the
+      // last one is ACK'd
+      requestSnapshot();
+      pumpSnapshots();
       
       // Check the queue for updates and pop them until the queue is empty. The pop command only returns
       // incoming replication information--outgoing replication in the queue gets turned into a TCPConn
@@ -105,124 +162,745 @@ void ReplServer::replicate() {
       std::vector<uint8_t> data;
       while (_queue.pop(sid, data)) {
 
-         // Incoming replication--add it to this server's local database
-         addReplDronePlots(data);         
+         // Anything from our snapshot source shows it is still working on it
+         if (!_bootstrapped && (sid == _snap_source))
+            _snap_requested = getAdjustedTime();
+
+         // Incoming replication--add it to this server's local database. Our own plots
+         // that came in since the last message are indexed first so peers' can be matched
+         // A message that doesn't decode is dropped (sync repairs anything it carried)
+         // rather than taking the server down
+         indexLocalPlots();
+         try {
+            if (SyncMsg::isSync(data.data(), data.size()))
+               handleSync(sid, data);
+            else
+               addReplDronePlots(data);
+         } catch (std::runtime_error &e) {
+            if (_verbosity >= 1)
+               std::cout << "Dropping a bad message from " << sid << ": " << e.what() << "\n";
+         }
       }       
+      adjustClock();
 
-      usleep(1000);
+      // Sleep until a socket is ready or the next timer (replication, reconnect) is due
+      _queue.waitForEvents(getWaitTimeout());
    }   
+
+   streamTracks(true);
+
+   _queue.logCompressionStats();
+   _queue.logCipherStats();
+
+   if (_verbosity >= 2)
+      std::cout << "Anti-entropy sync: " << _sync_rounds << " rounds, " << _sync_plots_in <<
+               " plots recovered from peers, " << _sync_plots_out << " plots sent to peers.\n";
+
+   if (_verbosity >= 2) {
+      uint64_t dropped, flagged;
+      _plotdb.getDeconflictStats(dropped, flagged);
+      std::cout << "Deconfliction: " << dropped << " duplicate plots dropped, " << flagged <<
+                                                                        " flagged.\n";
+   }
+
+   if (_verbosity >= 2) {
+      std::cout << "Clock skew: our timestamps corrected by " << _clock_adjust << " secs.\n";
+      for (auto &node : _skew.getEstimates())
+         std::cout << "   node " << node.first << ": " << node.second.skew << " secs ahead (+/- " <<
+                     node.second.scale << ", " << node.second.matches << " matches)\n";
+   }
+   saveSkew();
+
+   if ((_verbosity >= 2) && _track_file.is_open())
+      std::cout << "Track stream: " << _track_plots << " plots written in time order, " <<
+                                    _tracks.getLate() << " arrived too late and were left out.\n";
 }
 
 /**********************************************************************************************
- * queueNewPlots - looks at the database and grabs the new plots, marshalling them and
- *                 sending them to the queue manager
+ * getWaitTimeout - how long the replication loop can sleep: until the next replication pass
+ *                  or sync is due or a connection needs attention, whichever comes first
  *
- *    Returns: number of new plots sent to the QueueMgr
+ *    Returns: the timeout in milliseconds
+ **********************************************************************************************/
+
+int ReplServer::getWaitTimeout() {
+   // First system time at which getAdjustedTime() - _last_repl > secs_between_repl (and the
+   // same for the sync)
+   time_t next_repl = _start_time + static_cast<time_t>(
+                        ceil((_last_repl + secs_between_repl + 1) / _time_mult));
+   time_t next_sync = _start_time + static_cast<time_t>(
+                        ceil((_last_sync + secs_between_sync + 1) / _time_mult));
+   next_repl = std::min(next_repl, next_sync);
+
+   time_t now = time(NULL);
+   if (next_repl <= now)
+      return 0;
+
+   int timeout = max_wait_ms;
+   if ((next_repl - now) * 1000 < timeout)
+      timeout = (next_repl - now) * 1000;
+
+   return _queue.getWaitTimeout(timeout);
+}
+
+/**********************************************************************************************
+ * queueNewPlots - for each peer that is not waiting on an ACK, gets the locally-received plots
+ *                 past that peer's replication cursor, marshalls them and sends them to the
+ *                 queue manager. Peers sitting at the same cursor that take the same batch
+ *                 encoding share one marshalled batch. Plots that came in through
+ *                 replication are flagged DBFLAG_SYNCD and skipped.
+ *
+ *    Returns: number of new plots sent to the QueueMgr (counted once per batch)
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
 unsigned int ReplServer::queueNewPlots() {
-   std::vector<uint8_t> marshall_data;
-   unsigned int count = 0;
+   unsigned int total = 0;
 
    if (_verbosity >= 3)
       std::cout << "Replicating plots.\n";
 
-   // Loop through the drone plots, looking for new ones
-   std::list<DronePlot>::iterator dpit = _plotdb.begin();
-   for ( ; dpit != _plotdb.end(); dpit++) {
+   // Group the idle peers by where their cursor sits and how their batches are encoded
+   // (PlotCodec, compression). Peers we can't write to fast enough wait for their socket
+   // to drain
+   std::map<std::pair<uint64_t, uint16_t>, std::vector<std::string>> groups;
+   for (unsigned int i=0; i<_queue.getNumServers(); i++) {
+      uint64_t cursor;
+      if (_queue.isBackpressured(_queue.getPeerID(i)))
+         continue;
+
+      // Peers being sent a snapshot get these plots in it
+      if (_snap_out.count(_queue.getPeerID(i)) > 0)
+         continue;
+      if (_queue.getPeerCursor(_queue.getPeerID(i), cursor)) {
+         uint16_t caps = _queue.getPeerCaps(_queue.getPeerID(i)) & (cap_plot_codec | cap_compress);
+         groups[std::make_pair(cursor, caps)].push_back(_queue.getPeerID(i));
+      }
+   }
 
-      // If this is a new one, marshall it and clear the flag
-      if (dpit->isFlagSet(DBFLAG_NEW)) {
-         
-         dpit->serialize(marshall_data);
-         dpit->clrFlags(DBFLAG_NEW);
+   for (auto git = groups.begin(); git != groups.end(); git++) {
+      std::vector<uint8_t> marshall_data;
+      std::vector<DronePlot> new_plots;
+      unsigned int count = 0;
 
-         count++;
+      uint64_t batch_lsn = _plotdb.getPlotsSince(git->first.first, new_plots, DBFLAG_SYNCD,
+                                                                           max_batch_plots);
+      count = new_plots.size();
+
+      // Nothing to send, but the plots we looked at don't need to be looked at again
+      if (count == 0) {
+         for (unsigned int i=0; i<git->second.size(); i++)
+            _queue.skipToLSN(git->second[i].c_str(), batch_lsn);
+         continue;
+      }
+
+      if (git->first.second & cap_plot_codec) {
+         PlotCodec::encode(new_plots, marshall_data);
+      } else {
+         // Raw batch: the count, then the serialized plots
+         if (_verbosity >= 3)
+            std::cout << "Adding in count: " << count << "\n";
+
+         marshall_data.reserve(count * DronePlot::getDataSize() + sizeof(unsigned int));
+         uint8_t *ctptr_begin = (uint8_t *) &count;
+         marshall_data.insert(marshall_data.end(), ctptr_begin, ctptr_begin+sizeof(unsigned int));
+         for (unsigned int i=0; i<new_plots.size(); i++)
+            new_plots[i].serialize(marshall_data);
       }
-      if (marshall_data.size() % DronePlot::getDataSize() != 0)
-         throw std::runtime_error("Issue with marshalling!");
 
-   }
-  
-   if (count == 0) {
       if (_verbosity >= 3)
-         std::cout << "No new plots found to replicate.\n";
+         std::cout << "Batch of " << count << " plots is " << marshall_data.size() << " bytes (" <<
+                  count * DronePlot::getDataSize() + sizeof(unsigned int) << " unencoded).\n";
+
+      // Compressed once here, before the per-peer queueing (and encryption at send)
+      if (git->first.second & cap_compress)
+         _queue.packBatch(marshall_data);
+
+      // Send to the queue manager, the peers' cursors move up when they ACK. Every peer in the
+      // group shares the one copy of the batch
+      shared_batch batch = std::make_shared<const std::vector<uint8_t>>(std::move(marshall_data));
+      for (unsigned int i=0; i<git->second.size(); i++)
+         _queue.sendToServer(git->second[i].c_str(), batch, batch_lsn);
+
+      if (_verbosity >= 2)
+         std::cout << "Queued up " << count << " plots to be replicated to " <<
+                                          git->second.size() << " server(s).\n";
+      total += count;
+   }
 
-      return 0;
+   if ((total == 0) && (_verbosity >= 3))
+      std::cout << "No new plots found to replicate.\n";
+
+   return total;
+}
+
+/**********************************************************************************************
+ * addReplDronePlots - Adds drone plots to the database from data that was replicated in. 
+ *                     Deconflicts issues between plot points (DronePlotDB checks each one
+ *                     against its DeconflictIndex as it is added).
+ * 
+ * Params:  data - a PlotCodec batch, or the number of data points in a 32 bit unsigned
+ *                 integer followed by a series of serialized drone plot points
+ *
+ **********************************************************************************************/
+
+void ReplServer::addReplDronePlots(std::vector<uint8_t> &data) {
+   std::vector<DronePlot> plots;
+
+   if (PlotCodec::isEncoded(data.data(), data.size())) {
+      PlotCodec::decode(data.data(), data.size(), plots);
+   } else {
+      if (data.size() < 4) {
+         throw std::runtime_error("Not enough data passed into addReplDronePlots");
+      }
+
+      if ((data.size() - 4) % DronePlot::getDataSize() != 0) {
+         throw std::runtime_error("Data passed into addReplDronePlots was not the right multiple of DronePlot size");
+      }
+
+      // Get the number of plot points
+      unsigned int *numptr = (unsigned int *) data.data();
+      unsigned int count = *numptr;
+
+      if (count > (data.size() - 4) / DronePlot::getDataSize())
+         throw std::runtime_error("Plot count passed into addReplDronePlots is larger than the data");
+
+      plots.resize(count);
+      for (unsigned int i=0; i<count; i++)
+         plots[i].deserialize(data, sizeof(unsigned int) + i * DronePlot::getDataSize());
    }
- 
-   // Add the count onto the front
-   if (_verbosity >= 3)
-      std::cout << "Adding in count: " << count << "\n";
 
-   uint8_t *ctptr_begin = (uint8_t *) &count;
-   marshall_data.insert(marshall_data.begin(), ctptr_begin, ctptr_begin+sizeof(unsigned int));
+   addReplPlots(plots);
+
+   if (_verbosity >= 2)
+      std::cout << "Replicated in " << plots.size() << " plots\n";
+}
+
+/**********************************************************************************************
+ * addReplPlots - adds plots that came from a peer, flagged DBFLAG_SYNCD so we don't replicate
+ *                them back out, in one DronePlotDB::mergePlots call. Plots we already hold
+ *                are skipped: a sync can deliver a plot ahead of the batch that carries it,
+ *                and a batch whose ACK was lost is re-sent. The new ones are checked against
+ *                our own plots for the skew estimates
+ *
+ *    Returns: the number of plots that were new
+ **********************************************************************************************/
+
+unsigned int ReplServer::addReplPlots(std::vector<DronePlot> &plots) {
+   std::vector<bool> is_new;
+   _plotdb.mergePlots(plots, DBFLAG_SYNCD, is_new);
+
+   unsigned int added = 0;
+   for (unsigned int i=0; i<plots.size(); i++) {
+      if (is_new[i]) {
+         observeSkew(plots[i]);
+         added++;
+      }
+   }
+   return added;
+}
+
+/**********************************************************************************************
+ * findSyncDiffs - compares two sets of hash tree sums
+ *
+ *    Params:  theirs, mine - the sums, at the same tree level
+ *             diffs - gets the key of every node whose sums differ or that only one side has,
+ *                     with our sums (0 if we don't have it)
+ **********************************************************************************************/
 
-   // Send to the queue manager
-   if (marshall_data.size() > 0) {
-      _queue.sendToAll(marshall_data);
+static void findSyncDiffs(std::vector<sync_entry> &theirs, std::vector<sync_entry> &mine,
+                                                         std::vector<sync_entry> &diffs) {
+   std::map<std::pair<unsigned int, time_t>, sync_entry *> their_map;
+   for (unsigned int i=0; i<theirs.size(); i++)
+      their_map[std::make_pair(theirs[i].drone_id, theirs[i].bucket)] = &theirs[i];
+
+   for (unsigned int i=0; i<mine.size(); i++) {
+      auto it = their_map.find(std::make_pair(mine[i].drone_id, mine[i].bucket));
+      if (it == their_map.end()) {
+         diffs.push_back(mine[i]);
+         continue;
+      }
+
+      if ((it->second->hash != mine[i].hash) || (it->second->count != mine[i].count))
+         diffs.push_back(mine[i]);
+      their_map.erase(it);
    }
 
-   if (_verbosity >= 2) 
-      std::cout << "Queued up " << count << " plots to be replicated.\n";
+   for (auto it = their_map.begin(); it != their_map.end(); it++)
+      diffs.push_back({it->first.first, it->first.second, 0, 0});
+}
 
-   return count;
+/**********************************************************************************************
+ * sumSyncEntries - adds up hash tree sums into the level above (drones into the root)
+ **********************************************************************************************/
+
+static void sumSyncEntries(std::vector<sync_entry> &entries, uint64_t &hash, uint32_t &count) {
+   hash = 0;
+   count = 0;
+   for (unsigned int i=0; i<entries.size(); i++) {
+      hash += entries[i].hash;
+      count += entries[i].count;
+   }
 }
 
 /**********************************************************************************************
- * addReplDronePlots - Adds drone plots to the database from data that was replicated in. 
- *                     Deconflicts issues between plot points.
- * 
- * Params:  data - should start with the number of data points in a 32 bit unsigned integer, 
- *                 then a series of drone plot points
+ * startSync - starts an anti-entropy round by sending our hash tree's root and per-drone sums
+ *             to every peer that supports the exchange and isn't backed up. Only buckets
+ *             that have had time to settle are included
+ **********************************************************************************************/
+
+void ReplServer::startSync() {
+   SyncMsg digest(SyncMsg::sm_digest);
+   digest.horizon = PlotHashTree::getBucket(getAdjustedTime() - sync_settle_secs);
+   _plotdb.getSyncDrones(digest.entries, digest.horizon);
+   sumSyncEntries(digest.entries, digest.root_hash, digest.root_count);
+
+   for (unsigned int i=0; i<_queue.getNumServers(); i++) {
+      const char *sid = _queue.getPeerID(i);
+      if (!(_queue.getPeerCaps(sid) & cap_sync) || _queue.isBackpressured(sid) ||
+                                                            (_snap_out.count(sid) > 0))
+         continue;
+
+      sendSync(sid, digest);
+      _sync_rounds++;
+   }
+}
+
+/**********************************************************************************************
+ * handleSync - answers one step of a peer's anti-entropy exchange (see SyncMsg for the steps)
  *
+ *    Params:  sid - the peer it came from
+ *             data - the sync message
+ *
+ *    Throws: runtime_error if the message is corrupt
  **********************************************************************************************/
 
-void ReplServer::addReplDronePlots(std::vector<uint8_t> &data) {
-   if (data.size() < 4) {
-      throw std::runtime_error("Not enough data passed into addReplDronePlots");
+void ReplServer::handleSync(const std::string &sid, std::vector<uint8_t> &data) {
+   SyncMsg msg;
+   msg.decode(data.data(), data.size());
+
+   // Everything is compared as of the horizon of the side that started the exchange
+   if (msg.type == SyncMsg::sm_digest) {
+      std::vector<sync_entry> mine, diffs;
+      uint64_t hash;
+      uint32_t count;
+      _plotdb.getSyncDrones(mine, msg.horizon);
+      sumSyncEntries(mine, hash, count);
+      if ((hash == msg.root_hash) && (count == msg.root_count)) {
+         if (_verbosity >= 3)
+            std::cout << "Sync with " << sid << ": databases match (" << count << " plots).\n";
+         return;
+      }
+
+      // Send our buckets for every drone that doesn't match
+      findSyncDiffs(msg.entries, mine, diffs);
+
+      SyncMsg reply(SyncMsg::sm_buckets);
+      reply.horizon = msg.horizon;
+      for (unsigned int i=0; i<diffs.size(); i++) {
+         reply.drones.push_back(diffs[i].drone_id);
+         _plotdb.getSyncBuckets(diffs[i].drone_id, reply.entries, msg.horizon);
+      }
+      sendSync(sid.c_str(), reply);
+
+   } else if (msg.type == SyncMsg::sm_buckets) {
+      std::vector<sync_entry> mine, diffs;
+      for (unsigned int i=0; i<msg.drones.size(); i++)
+         _plotdb.getSyncBuckets(msg.drones[i], mine, msg.horizon);
+      findSyncDiffs(msg.entries, mine, diffs);
+
+      if (diffs.size() > max_sync_buckets)
+         diffs.resize(max_sync_buckets);
+
+      // Our plots in every bucket that doesn't match, and ask for theirs
+      SyncMsg reply(SyncMsg::sm_plots);
+      for (unsigned int i=0; i<diffs.size(); i++) {
+         reply.entries.push_back({diffs[i].drone_id, diffs[i].bucket, 0, 0});
+         _plotdb.queryDrone(diffs[i].drone_id, diffs[i].bucket,
+                                       diffs[i].bucket + sync_bucket_secs - 1, reply.plots);
+      }
+
+      if (_verbosity >= 2)
+         std::cout << "Sync with " << sid << ": " << diffs.size() << " bucket(s) differ.\n";
+
+      if (diffs.size() > 0) {
+         _sync_plots_out += reply.plots.size();
+         sendSync(sid.c_str(), reply);
+      }
+
+   } else if (msg.type == SyncMsg::sm_snap_request) {
+      snapshot_send &snap = _snap_out[sid];
+      snap.end_lsn = _plotdb.getLastLSN();
+      snap.started = false;
+      snap.plots = 0;
+
+      if (_verbosity >= 2)
+         std::cout << "Sending a snapshot through LSN " << snap.end_lsn << " to " << sid << ".\n";
+
+   } else if (msg.type == SyncMsg::sm_snap_done) {
+      if (_bootstrapped || (sid != _snap_source))
+         return;
+
+      _bootstrapped = true;
+      if (_verbosity >= 1)
+         std::cout << "Bootstrapped from " << sid << "'s snapshot (" << msg.root_count <<
+                        " plots), ready " << (time(NULL) - _snap_start) << " secs after start.\n";
+
+   } else {
+      unsigned int added = addReplPlots(msg.plots);
+      _sync_plots_in += added;
+
+      if ((added > 0) && (_verbosity >= 2))
+         std::cout << "Sync with " << sid << ": recovered " << added << " plots.\n";
+
+      if (msg.entries.size() == 0)
+         return;
+
+      // Send back whatever we have in the wanted buckets that they didn't send us
+      std::unordered_set<uint64_t> theirs;
+      for (unsigned int i=0; i<msg.plots.size(); i++)
+         theirs.insert(PlotHashTree::plotHash(msg.plots[i].drone_id, msg.plots[i].node_id,
+                     msg.plots[i].timestamp, msg.plots[i].latitude, msg.plots[i].longitude));
+
+      SyncMsg reply(SyncMsg::sm_plots);
+      std::vector<DronePlot> bucket;
+      for (unsigned int i=0; i<msg.entries.size() && (i < max_sync_buckets); i++) {
+         bucket.clear();
+         _plotdb.queryDrone(msg.entries[i].drone_id, msg.entries[i].bucket,
+                              msg.entries[i].bucket + sync_bucket_secs - 1, bucket);
+
+         for (unsigned int j=0; j<bucket.size(); j++) {
+            if (theirs.count(PlotHashTree::plotHash(bucket[j].drone_id, bucket[j].node_id,
+                        bucket[j].timestamp, bucket[j].latitude, bucket[j].longitude)) == 0)
+               reply.plots.push_back(bucket[j]);
+         }
+      }
+
+      if (reply.plots.size() > 0) {
+         _sync_plots_out += reply.plots.size();
+         sendSync(sid.c_str(), reply);
+      }
    }
+}
+
+/**********************************************************************************************
+ * requestSnapshot - until we have bootstrapped, asks a peer for a snapshot of its database.
+ *                   A peer is only asked once we know it supports snapshots (we have talked
+ *                   to it). If the peer goes quiet for snapshot_retry_secs, the next one in the
+ *                   server list is asked
+ **********************************************************************************************/
 
-   if ((data.size() - 4) % DronePlot::getDataSize() != 0) {
-      throw std::runtime_error("Data passed into addReplDronePlots was not the right multiple of DronePlot size");
+void ReplServer::requestSnapshot() {
+   if (_bootstrapped)
+      return;
+   if (!_snap_source.empty() && (getAdjustedTime() - _snap_requested <= snapshot_retry_secs))
+      return;
+
+   // Start with the peer after the one we last asked
+   unsigned int num = _queue.getNumServers();
+   unsigned int first = 0;
+   for (unsigned int i=0; i<num; i++) {
+      if (_snap_source == _queue.getPeerID(i))
+         first = i + 1;
    }
 
-   // Get the number of plot points
-   unsigned int *numptr = (unsigned int *) data.data();
-   unsigned int count = *numptr;
+   for (unsigned int i=0; i<num; i++) {
+      const char *sid = _queue.getPeerID((first + i) % num);
+      if (!(_queue.getPeerCaps(sid) & cap_snapshot))
+         continue;
 
-   // Store sub-vectors for efficiency
-   std::vector<uint8_t> plot;
-   auto dptr = data.begin() + sizeof(unsigned int);
+      SyncMsg request(SyncMsg::sm_snap_request);
+      sendSync(sid, request);
 
-   for (unsigned int i=0; i<count; i++) {
-      plot.clear();
-      plot.assign(dptr, dptr + DronePlot::getDataSize());
-      addSingleDronePlot(plot);
-      dptr += DronePlot::getDataSize();      
+      _snap_source = sid;
+      _snap_requested = getAdjustedTime();
+      if (_verbosity >= 2)
+         std::cout << "Requested a snapshot from " << sid << ".\n";
+      return;
    }
-   if (_verbosity >= 2)
-      std::cout << "Replicated in " << count << " plots\n";   
 }
 
+/**********************************************************************************************
+ * pumpSnapshots - sends the next chunk of every snapshot being served, for each peer that has
+ *                 ACK'd the last one. The snapshot covers every plot (including ones
+ *                 replicated in) up to the LSN at the time of the request. The chunks go out
+ *                 as ordinary batches with their last LSN, so each ACK moves the peer's cursor
+ *                 and a lost chunk is re-sent from there. Once the cursor reaches the end the
+ *                 peer is told it is done, and normal replication picks up from that LSN
+ **********************************************************************************************/
+
+void ReplServer::pumpSnapshots() {
+   auto snap_it = _snap_out.begin();
+   while (snap_it != _snap_out.end()) {
+      const char *sid = snap_it->first.c_str();
+      snapshot_send &snap = snap_it->second;
+
+      uint64_t cursor;
+      if (!_queue.getPeerCursor(sid, cursor) || _queue.isBackpressured(sid)) {
+         snap_it++;
+         continue;
+      }
+
+      // The peer may have lost what it ACK'd before, start from the beginning
+      if (!snap.started) {
+         _queue.rewindCursor(sid, 0);
+         cursor = 0;
+         snap.started = true;
+      }
+
+      if (cursor >= snap.end_lsn) {
+         SyncMsg done(SyncMsg::sm_snap_done);
+         done.root_count = snap.plots;
+         sendSync(sid, done);
+
+         if (_verbosity >= 2)
+            std::cout << "Snapshot of " << snap.plots << " plots sent to " << sid << ".\n";
+         snap_it = _snap_out.erase(snap_it);
+         continue;
+      }
+
+      std::vector<DronePlot> plots;
+      uint64_t chunk_lsn = _plotdb.getPlotsSince(cursor, plots, 0, snapshot_chunk_plots,
+                                                                           snap.end_lsn);
+      if (plots.size() == 0) {
+         _queue.skipToLSN(sid, chunk_lsn);
+         snap_it++;
+         continue;
+      }
+
+      std::vector<uint8_t> data;
+      PlotCodec::encode(plots, data);
+      if (_queue.getPeerCaps(sid) & cap_compress)
+         _queue.packBatch(data);
+      _queue.sendToServer(sid, std::move(data), chunk_lsn);
+
+      snap.plots += plots.size();
+      snap_it++;
+   }
+}
 
 /**********************************************************************************************
- * addSingleDronePlot - Takes in binary serialized drone data and adds it to the database. 
+ * sendSync - encodes a sync message and queues it to the peer like a batch. It isn't tied to
+ *            the peer's replication cursor, so it doesn't hold up or wait on plot batches
+ **********************************************************************************************/
+
+void ReplServer::sendSync(const char *sid, SyncMsg &msg) {
+   std::vector<uint8_t> data;
+   msg.encode(data);
+
+   if (_queue.getPeerCaps(sid) & cap_compress)
+      _queue.packBatch(data);
+
+   _queue.sendToServer(sid, std::move(data));
+}
+
+/**********************************************************************************************
+ * setSkewFile - sets where the skew estimates and our clock correction are saved, and loads
+ *               them if the file is there, so a restarted server goes on stamping plots the
+ *               way it did before
+ **********************************************************************************************/
+
+void ReplServer::setSkewFile(const char *filename) {
+   _skew_file = filename;
+
+   time_t correction;
+   if (!_skew.load(filename, correction))
+      return;
+
+   _clock_adjust = correction;
+   _skew_lsn = _plotdb.setClockAdjust(_clock_adjust);
+
+   if (_verbosity >= 1)
+      std::cout << "Loaded clock skew estimates from " << filename << ", correcting our clock by " <<
+                                                                  _clock_adjust << " secs.\n";
+}
+
+/**********************************************************************************************
+ * setRecovered - a server whose database came back from the WAL doesn't ask a peer for a
+ *                snapshot. It is only missing what came in while it was down, and that the
+ *                next anti-entropy sync repairs. The replayed plots were given new LSNs, so
+ *                the peers' cursors (kept only in memory) start after them rather than at 0,
+ *                which would send the peers every plot we ever originated. Any the peers
+ *                hadn't ACK'd before we went down are left to sync as well
  *
+ *    Params:  last_lsn - the LSN of the last plot recovered
+ **********************************************************************************************/
+
+void ReplServer::setRecovered(uint64_t last_lsn) {
+   _bootstrapped = true;
+
+   for (unsigned int i=0; i<_queue.getNumServers(); i++)
+      _queue.skipToLSN(_queue.getPeerID(i), last_lsn);
+}
+
+void ReplServer::saveSkew() {
+   if (_skew_file.empty())
+      return;
+
+   if (!_skew.save(_skew_file.c_str(), _clock_adjust))
+      std::cerr << "Unable to save clock skew estimates to " << _skew_file << ".\n";
+}
+
+/**********************************************************************************************
+ * indexLocalPlots - matches the plots we originated since the last call against the peers'
+ *                   plots in _skew_index, then adds them so peers' plots that come in later
+ *                   can be matched against them. Learns our node ID from them
+ **********************************************************************************************/
+
+void ReplServer::indexLocalPlots() {
+   std::vector<DronePlot> plots;
+   _skew_lsn = _plotdb.getPlotsSince(_skew_lsn, plots, DBFLAG_SYNCD);
+
+   if ((_node_id == 0) && (plots.size() > 0))
+      _node_id = plots[0].node_id;
+
+   std::vector<DeconflictIndex::entry> matches;
+   for (unsigned int i=0; i<plots.size(); i++) {
+      DronePlot &plot = plots[i];
+
+      matches.clear();
+      _skew_index.find(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude,
+                                                         plot.longitude, matches);
+
+      // The closest in time from each peer
+      std::map<unsigned int, time_t> closest;
+      for (unsigned int j=0; j<matches.size(); j++) {
+         time_t diff = matches[j].timestamp - plot.timestamp;
+         auto c_it = closest.find(matches[j].node_id);
+         if ((c_it == closest.end()) || (std::abs(diff) < std::abs(c_it->second)))
+            closest[matches[j].node_id] = diff;
+      }
+      for (auto &c : closest)
+         _skew.update(c.first, (double) c.second);
+
+      // The index only needs a unique ID for each plot, we never take one out
+      _skew_index.add(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude,
+                                                   plot.longitude, ++_skew_entries);
+   }
+}
+
+/**********************************************************************************************
+ * observeSkew - if a peer's plot is a sighting we have already reported, adds the difference
+ *               in their timestamps to the peer's skew estimate (of several candidates, the
+ *               closest in time). Then adds it to _skew_index, in case ours comes later
  **********************************************************************************************/
 
-void ReplServer::addSingleDronePlot(std::vector<uint8_t> &data) {
-   DronePlot tmp_plot;
+void ReplServer::observeSkew(DronePlot &plot) {
+   std::vector<DeconflictIndex::entry> matches;
+   _skew_index.find(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude,
+                                                      plot.longitude, matches);
+
+   bool found = false;
+   time_t diff = 0;
+   for (unsigned int i=0; i<matches.size(); i++) {
+      if (matches[i].node_id != _node_id)
+         continue;
+
+      time_t d = plot.timestamp - matches[i].timestamp;
+      if (!found || (std::abs(d) < std::abs(diff)))
+         diff = d;
+      found = true;
+   }
+   if (found)
+      _skew.update(plot.node_id, (double) diff);
+
+   _skew_index.add(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude,
+                                                plot.longitude, ++_skew_entries);
+}
+
+/**********************************************************************************************
+ * adjustClock - the lowest node ID we have matched enough plots with is the reference clock.
+ *               If that isn't us and its estimate rounds to a second or more, moves our
+ *               correction so the plots we originate from here on are stamped on its clock.
+ *               The estimates are all relative to our clock, so they move with it, and the
+ *               index starts over since our plots in it were stamped the old way
+ **********************************************************************************************/
+
+void ReplServer::adjustClock() {
+   if (_node_id == 0)
+      return;
+
+   for (auto &node : _skew.getEstimates()) {
+      if (node.second.matches < skew_min_matches)
+         continue;
+      if ((node.first > _node_id) || (fabs(node.second.skew) < skew_adjust_secs))
+         return;
+
+      time_t secs = (time_t) llround(node.second.skew);
+      _clock_adjust += secs;
+      _skew.shift((double) -secs);
+      _skew_index.clear();
+      _skew_lsn = _plotdb.setClockAdjust(_clock_adjust);
+
+      if (_verbosity >= 1)
+         std::cout << "Node " << node.first << "'s clock is " << secs << " secs ahead, correcting " <<
+                                       "our timestamps by " << _clock_adjust << " secs.\n";
+      saveSkew();
+      return;
+   }
+}
 
-   tmp_plot.deserialize(data);
+/**********************************************************************************************
+ * setTrackFile - opens the file the track stream is written to
+ *
+ *    Throws: runtime_error if it can't be opened
+ **********************************************************************************************/
 
-   _plotdb.addPlot(tmp_plot.drone_id, tmp_plot.node_id, tmp_plot.timestamp, tmp_plot.latitude,
-                                                         tmp_plot.longitude);
+void ReplServer::setTrackFile(const char *filename) {
+   _track_file.open(filename);
+   if (_track_file.fail())
+      throw std::runtime_error(std::string("Unable to open track file ") + filename);
 }
 
+/**********************************************************************************************
+ * streamTracks - feeds every plot added since the last call (ours and replicated, but not
+ *                duplicates already flagged) to the reorder buffer, and writes what it
+ *                releases to the track file, less any flagged as duplicates while they were
+ *                held. The lateness is the largest skew estimate, since a node's clock
+ *                correction can step its timestamps back that far
+ *
+ *    Params:  flush - write out everything still held (at shutdown)
+ **********************************************************************************************/
+
+void ReplServer::streamTracks(bool flush) {
+   if (!_track_file.is_open())
+      return;
+
+   std::vector<DronePlot> plots;
+   _track_lsn = _plotdb.getPlotsSince(_track_lsn, plots, DBFLAG_DUP);
+
+   time_t now = getAdjustedTime();
+   for (unsigned int i=0; i<plots.size(); i++)
+      _tracks.add(plots[i], now);
+
+   double max_skew = (double) deconflict_secs;
+   for (auto &node : _skew.getEstimates())
+      if (node.second.matches >= skew_min_matches)
+         max_skew = std::max(max_skew, fabs(node.second.skew));
+   _tracks.setLateness((time_t) ceil(max_skew));
+
+   plots.clear();
+   if (flush)
+      _tracks.flush(plots);
+   else
+      _tracks.release(now, plots);
+
+   std::string buf;
+   for (unsigned int i=0; i<plots.size(); i++) {
+      if (!_plotdb.hasPlot(plots[i], DBFLAG_DUP))
+         continue;
+
+      plots[i].writeCSV(buf);
+      _track_file << buf;
+      _track_plots++;
+   }
+   _track_file.flush();
+}
 
 void ReplServer::shutdown() {
    _shutdown = true;
+
+   // Don't wait out the event loop's timeout
+   _queue.wakeUp();
 }
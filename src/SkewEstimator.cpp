@@ -0,0 +1,95 @@
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <fstream>
+#include "SkewEstimator.h"
+
+/*****************************************************************************************
+ * update - folds one timestamp difference into the node's estimate. The first match sets
+ *          the estimate outright; after that the residual is Huber-clipped and added in
+ *          with a gain of 1/matches, floored at skew_min_gain
+ *****************************************************************************************/
+void SkewEstimator::update(unsigned int node_id, double diff) {
+   estimate &est = _nodes[node_id];
+
+   est.matches++;
+   if (est.matches == 1) {
+      est.skew = diff;
+      est.scale = 0.0;
+      return;
+   }
+
+   double gain = std::max(1.0 / est.matches, skew_min_gain);
+   double resid = diff - est.skew;
+   double limit = skew_huber_k * std::max(est.scale, skew_min_scale);
+
+   est.skew += gain * std::max(-limit, std::min(resid, limit));
+   est.scale += gain * (fabs(resid) - est.scale);
+}
+
+void SkewEstimator::shift(double secs) {
+   for (auto &node : _nodes)
+      node.second.skew += secs;
+}
+
+bool SkewEstimator::getEstimate(unsigned int node_id, estimate &est) {
+   auto node_it = _nodes.find(node_id);
+   if (node_it == _nodes.end())
+      return false;
+
+   est = node_it->second;
+   return true;
+}
+
+/*****************************************************************************************
+ * save - writes the correction, then one line per node: node_id skew scale matches. The
+ *        file is written to a temp name and renamed over the old one
+ *
+ *    Returns: false if the file couldn't be written
+ *****************************************************************************************/
+bool SkewEstimator::save(const char *filename, time_t correction) {
+   std::string tmpname = std::string(filename) + ".tmp";
+
+   std::ofstream sfile(tmpname.c_str());
+   if (sfile.fail())
+      return false;
+
+   sfile << "correction " << (long long) correction << "\n";
+   for (auto &node : _nodes)
+      sfile << node.first << " " << node.second.skew << " " << node.second.scale << " " <<
+                                                          node.second.matches << "\n";
+   sfile.close();
+   if (sfile.fail())
+      return false;
+
+   return rename(tmpname.c_str(), filename) == 0;
+}
+
+/*****************************************************************************************
+ * load - reads back what save wrote
+ *
+ *    Returns: false if the file can't be opened or isn't in the right format, in which case
+ *             nothing is changed
+ *****************************************************************************************/
+bool SkewEstimator::load(const char *filename, time_t &correction) {
+   std::ifstream sfile(filename);
+   if (sfile.fail())
+      return false;
+
+   std::string label;
+   long long corr;
+   if (!(sfile >> label >> corr) || (label != "correction"))
+      return false;
+
+   std::map<unsigned int, estimate> nodes;
+   unsigned int node_id;
+   estimate est;
+   while (sfile >> node_id >> est.skew >> est.scale >> est.matches)
+      nodes[node_id] = est;
+   if (!sfile.eof())
+      return false;
+
+   _nodes.swap(nodes);
+   correction = (time_t) corr;
+   return true;
+}
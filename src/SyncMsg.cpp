@@ -0,0 +1,119 @@
+#include <stdexcept>
+#include <cstring>
+#include "SyncMsg.h"
+#include "PlotCodec.h"
+
+// Size of one sync_entry on the wire
+const size_t sync_entry_size = 4 + 8 + 8 + 4;
+
+// Big-endian field writers and readers. The readers check the length first
+static void putU32(std::vector<uint8_t> &out, uint32_t val) {
+   for (int shift = 24; shift >= 0; shift -= 8)
+      out.push_back((uint8_t) (val >> shift));
+}
+
+static void putU64(std::vector<uint8_t> &out, uint64_t val) {
+   for (int shift = 56; shift >= 0; shift -= 8)
+      out.push_back((uint8_t) (val >> shift));
+}
+
+static uint64_t getBE(const uint8_t *&ptr, const uint8_t *end, size_t bytes) {
+   if ((size_t) (end - ptr) < bytes)
+      throw std::runtime_error("Sync message ran out of data.");
+
+   uint64_t val = 0;
+   for (size_t i = 0; i < bytes; i++)
+      val = (val << 8) | *ptr++;
+   return val;
+}
+
+SyncMsg::SyncMsg(msg_type in_type):type(in_type)
+{
+
+}
+
+/*****************************************************************************************
+ * encode - writes the message in the layout described in SyncMsg.h
+ *
+ *    Params:  out - the message is appended here
+ *****************************************************************************************/
+void SyncMsg::encode(std::vector<uint8_t> &out) {
+   out.reserve(out.size() + 32 + drones.size() * 4 + entries.size() * sync_entry_size);
+
+   out.insert(out.end(), sync_msg_magic, sync_msg_magic + sizeof(sync_msg_magic));
+   out.push_back(sync_msg_version);
+   out.push_back((uint8_t) type);
+   putU64(out, (uint64_t) horizon);
+   putU64(out, root_hash);
+   putU32(out, root_count);
+
+   putU32(out, drones.size());
+   for (unsigned int i = 0; i < drones.size(); i++)
+      putU32(out, drones[i]);
+
+   putU32(out, entries.size());
+   for (unsigned int i = 0; i < entries.size(); i++) {
+      putU32(out, entries[i].drone_id);
+      putU64(out, (uint64_t) entries[i].bucket);
+      putU64(out, entries[i].hash);
+      putU32(out, entries[i].count);
+   }
+
+   PlotCodec::encode(plots, out);
+}
+
+/*****************************************************************************************
+ * decode - reads a message written by encode into this object
+ *
+ *    Params:  data, len - the message
+ *
+ *    Throws: runtime_error if the data is not a sync message, is an unknown type or is
+ *            truncated
+ *****************************************************************************************/
+void SyncMsg::decode(const uint8_t *data, size_t len) {
+   if (!isSync(data, len) || (len < sizeof(sync_msg_magic) + 2))
+      throw std::runtime_error("SyncMsg decode called on data that is not a sync message.");
+
+   const uint8_t *ptr = data + sizeof(sync_msg_magic) + 1;
+   const uint8_t *end = data + len;
+
+   uint8_t in_type = *ptr++;
+   if ((in_type < sm_digest) || (in_type > sm_snap_done))
+      throw std::runtime_error("Sync message is of an unknown type.");
+   type = (msg_type) in_type;
+
+   horizon = (time_t) getBE(ptr, end, 8);
+   root_hash = getBE(ptr, end, 8);
+   root_count = getBE(ptr, end, 4);
+
+   // Counts are checked against what's left before anything is sized off them
+   uint32_t count = getBE(ptr, end, 4);
+   if (count > (size_t) (end - ptr) / 4)
+      throw std::runtime_error("Sync message drone count is larger than the data.");
+   drones.resize(count);
+   for (unsigned int i = 0; i < count; i++)
+      drones[i] = getBE(ptr, end, 4);
+
+   count = getBE(ptr, end, 4);
+   if (count > (size_t) (end - ptr) / sync_entry_size)
+      throw std::runtime_error("Sync message entry count is larger than the data.");
+   entries.resize(count);
+   for (unsigned int i = 0; i < count; i++) {
+      entries[i].drone_id = getBE(ptr, end, 4);
+      entries[i].bucket = (time_t) getBE(ptr, end, 8);
+      entries[i].hash = getBE(ptr, end, 8);
+      entries[i].count = getBE(ptr, end, 4);
+   }
+
+   plots.clear();
+   PlotCodec::decode(ptr, end - ptr, plots);
+}
+
+/*****************************************************************************************
+ * isSync - checks for the magic bytes and a version this code can read
+ *****************************************************************************************/
+bool SyncMsg::isSync(const uint8_t *data, size_t len) {
+   return (len > sizeof(sync_msg_magic)) &&
+          (memcmp(data, sync_msg_magic, sizeof(sync_msg_magic)) == 0) &&
+          (data[sizeof(sync_msg_magic)] == sync_msg_version);
+}
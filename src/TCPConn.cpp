@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <chrono>
 #include "TCPConn.h"
 #include "strfuncts.h"
 #include <crypto++/secblock.h>
@@ -13,6 +14,8 @@
 #include <crypto++/rijndael.h>
 #include <crypto++/gcm.h>
 #include <crypto++/aes.h>
+#include <crypto++/sha.h>
+#include <crypto++/hkdf.h>
 
 using namespace CryptoPP;
 
@@ -21,54 +24,35 @@ const unsigned int iv_size = AES::BLOCKSIZE;
 const unsigned int key_size = AES::DEFAULT_KEYLENGTH;
 const unsigned int auth_size = 16;
 
+// Flags on REP frames. The GCM tag covers the payload, so no CRC is needed, which lets the
+// header go out before the payload is encrypted
+static const uint16_t rep_flags = frame_flag_gcm | frame_flag_nocrc;
+
+// Authenticated along with every encrypted REP payload: the frame header fields it was sent
+// under, so a payload can't be replayed as some other frame type
+static const uint8_t rep_aad[] = { frame_version, Frame::f_rep, rep_flags >> 8, rep_flags & 0xFF };
+
+// HKDF info string for the session keys. Changing the derivation means changing this
+static const char session_info[] = "AFIT-REPL session v1";
+
 /**********************************************************************************************
- * TCPConn (constructor) - creates the connector and initializes - creates the command strings
- *                         to wrap around network commands
+ * TCPConn (constructor) - creates the connector and initializes
  *
  *    Params: key - reference to the pre-loaded AES key
+ *            stats - the server's encryption totals, updated as replication data goes by
  *            verbosity - stdout verbosity - 3 = max
  *
  **********************************************************************************************/
 
-TCPConn::TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int verbosity) : _data_ready(false),
-                                                                                            _aes_key(key),
-                                                                                            _verbosity(verbosity),
-                                                                                            _server_log(server_log)
+TCPConn::TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, cipher_stats &stats,
+                                                             unsigned int verbosity) : reconnect(0),
+                                                                                       _data_ready(false),
+                                                                                       _aes_key(key),
+                                                                                       _stats(stats),
+                                                                                       _verbosity(verbosity),
+                                                                                       _server_log(server_log)
 {
-   // prep some tools to search for command sequences in data
-   uint8_t slash = (uint8_t)'/';
-   c_rep.push_back((uint8_t)'<');
-   c_rep.push_back((uint8_t)'R');
-   c_rep.push_back((uint8_t)'E');
-   c_rep.push_back((uint8_t)'P');
-   c_rep.push_back((uint8_t)'>');
-
-   c_endrep = c_rep;
-   c_endrep.insert(c_endrep.begin() + 1, 1, slash);
-
-   c_ack.push_back((uint8_t)'<');
-   c_ack.push_back((uint8_t)'A');
-   c_ack.push_back((uint8_t)'C');
-   c_ack.push_back((uint8_t)'K');
-   c_ack.push_back((uint8_t)'>');
-
-   c_auth.push_back((uint8_t)'<');
-   c_auth.push_back((uint8_t)'A');
-   c_auth.push_back((uint8_t)'U');
-   c_auth.push_back((uint8_t)'T');
-   c_auth.push_back((uint8_t)'>');
 
-   c_endauth = c_auth;
-   c_endauth.insert(c_endauth.begin() + 1, 1, slash);
-
-   c_sid.push_back((uint8_t)'<');
-   c_sid.push_back((uint8_t)'S');
-   c_sid.push_back((uint8_t)'I');
-   c_sid.push_back((uint8_t)'D');
-   c_sid.push_back((uint8_t)'>');
-
-   c_endsid = c_sid;
-   c_endsid.insert(c_endsid.begin() + 1, 1, slash);
 }
 
 TCPConn::~TCPConn()
@@ -87,6 +71,9 @@ bool TCPConn::accept(SocketFD &server)
 {
    // Accept the connection
    bool results = _connfd.acceptFD(server);
+   _watched = false;
+   if (results)
+      _connfd.setNonBlocking();
 
    // Set the state as waiting for the authorization packet
    _status = s_connected;
@@ -95,22 +82,196 @@ bool TCPConn::accept(SocketFD &server)
 }
 
 /**********************************************************************************************
- * sendData - sends the data in the parameter to the socket
+ * sendData - sends the data in the parameter to the socket. Whatever the socket can't take
+ *            right now stays queued and goes out as it becomes writable
  *
- *    Params:  msg - the string to be sent
- *             size - if we know how much data we should expect to send, this should be populated
+ *    Params:  buf - the data to be sent (copied into the outbound queue)
  *
- *    Throws: runtime_error for unrecoverable errors
+ *    Throws: socket_error for network errors
  **********************************************************************************************/
 
 bool TCPConn::sendData(std::vector<uint8_t> &buf)
 {
+   queueOutput(std::vector<uint8_t>(buf));
+   return true;
+}
+
+/**********************************************************************************************
+ * queueOutput - moves a buffer onto the end of the outbound queue and sends what it can
+ *
+ *    Params:  data - the buffer, moved into the queue (no copy)
+ *
+ *    Throws: socket_error for network errors
+ **********************************************************************************************/
+
+void TCPConn::queueOutput(std::vector<uint8_t> &&data)
+{
+   if (data.size() == 0)
+      return;
 
-   _connfd.writeBytes<uint8_t>(buf);
+   // Would land in the middle of the REP payload
+   if (_streambatch)
+      throw std::runtime_error("Frame queued while a REP frame was still being sent.");
+
+   _tx_pending += data.size();
+   _txqueue.push_back(std::move(data));
+
+   // Nothing ahead of it, try to send right away
+   if (_txqueue.size() == 1)
+      flushOutput();
+}
+
+/**********************************************************************************************
+ * flushOutput - writes as much of the outbound queue as the socket will take, several
+ *               buffers per writev. Accounts for short writes by remembering how far into
+ *               the front buffer it got. When the queue runs dry while a REP frame is being
+ *               sent, the next chunk is encrypted onto it.
+ *
+ *    Returns: true if everything is sent, false if the socket filled up (EAGAIN)
+ *
+ *    Throws: socket_error if the write fails
+ **********************************************************************************************/
+
+bool TCPConn::flushOutput()
+{
+   const int max_iov = 16;
+
+   _writable = false;
+   while (true)
+   {
+      if (_txqueue.empty())
+      {
+         if (!_streambatch)
+            break;
+         nextChunk();
+      }
+
+      struct iovec iov[max_iov];
+      int iovcnt = 0;
+      size_t off = _txoff;
+      for (auto it = _txqueue.begin(); (it != _txqueue.end()) && (iovcnt < max_iov); it++)
+      {
+         iov[iovcnt].iov_base = it->data() + off;
+         iov[iovcnt].iov_len = it->size() - off;
+         iovcnt++;
+         off = 0;
+      }
+
+      ssize_t results = _connfd.sendvFD(iov, iovcnt);
+      if (results < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            return false;
+         throw socket_error("Write error on connection socket.");
+      }
 
+      // Drop the buffers that went out completely, remember where the partial one stopped
+      size_t sent = results;
+      _tx_pending -= sent;
+      while (sent > 0)
+      {
+         size_t left = _txqueue.front().size() - _txoff;
+         if (sent < left)
+         {
+            _txoff += sent;
+            break;
+         }
+         sent -= left;
+
+         // Keep a sent chunk buffer around for the next chunk
+         if (_streambatch && (_scratch.capacity() == 0) &&
+                                      (_txqueue.front().capacity() >= stream_chunk_size))
+            _scratch.swap(_txqueue.front());
+
+         _txqueue.pop_front();
+         _txoff = 0;
+      }
+   }
    return true;
 }
 
+/**********************************************************************************************
+ * closeWhenFlushed - disconnects now if nothing is waiting to go out, otherwise once the
+ *                    outbound queue empties (so a final ACK isn't cut off)
+ **********************************************************************************************/
+
+void TCPConn::closeWhenFlushed()
+{
+   if (!hasPendingOutput())
+      disconnect();
+   else
+      _close_pending = true;
+}
+
+/**********************************************************************************************
+ * sendOutput - queues the REP frame header and IV, then starts streaming the batch. The batch
+ *              itself is never copied: it is encrypted from the shared buffer a chunk at a
+ *              time into a recycled scratch buffer as the socket takes the data
+ *
+ *    Throws: runtime_error if called before the session keys are set up
+ **********************************************************************************************/
+
+void TCPConn::sendOutput()
+{
+   if (!_has_session)
+      throw std::runtime_error("Replication data send attempted before session keys were set up.");
+
+   size_t payload_len = gcm_iv_size + _outbatch->size() + gcm_tag_size;
+   std::vector<uint8_t> head(frame_header_size + gcm_iv_size);
+
+   Frame::encodeHeader(head.data(), Frame::f_rep, NULL, payload_len, rep_flags);
+   startSeal(head.data() + frame_header_size);
+   queueOutput(std::move(head));
+
+   _streambatch = std::move(_outbatch);
+   _stream_pos = 0;
+   flushOutput();
+}
+
+/**********************************************************************************************
+ * nextChunk - encrypts up to stream_chunk_size more of the batch being sent onto the outbound
+ *             queue. The last chunk gets the GCM tag and ends the stream
+ **********************************************************************************************/
+
+void TCPConn::nextChunk()
+{
+   size_t total = _streambatch->size();
+   size_t len = std::min(stream_chunk_size, total - _stream_pos);
+   bool last = (_stream_pos + len == total);
+
+   std::vector<uint8_t> chunk;
+   chunk.swap(_scratch);
+   chunk.resize(len + (last ? gcm_tag_size : 0));
+
+   sealChunk(_streambatch->data() + _stream_pos, len, chunk.data());
+   _stream_pos += len;
+
+   if (last)
+   {
+      finishSeal(chunk.data() + len);
+      _streambatch.reset();
+      _stream_pos = 0;
+   }
+
+   _tx_pending += chunk.size();
+   _txqueue.push_back(std::move(chunk));
+}
+
+/**********************************************************************************************
+ * getPendingOutput - bytes still to go out: what is queued plus the rest of a batch being
+ *                    streamed
+ **********************************************************************************************/
+
+size_t TCPConn::getPendingOutput()
+{
+   size_t pending = _tx_pending;
+   if (_streambatch)
+      pending += _streambatch->size() - _stream_pos + gcm_tag_size;
+   return pending;
+}
+
 /**********************************************************************************************
  * sendEncryptedData - sends the data in the parameter to the socket after block encrypting it
  *
@@ -123,11 +284,11 @@ bool TCPConn::sendData(std::vector<uint8_t> &buf)
 bool TCPConn::sendEncryptedData(std::vector<uint8_t> &buf)
 {
 
-   // Encrypt
+   // Encrypt, then tag it so the receiver can find the end of the ciphertext
    encryptData(buf);
 
    // And send!
-   return sendData(buf);
+   return sendFrame(Frame::f_auth, buf);
 }
 
 /**********************************************************************************************
@@ -142,23 +303,165 @@ void TCPConn::encryptData(std::vector<uint8_t> &buf)
 {
    // For the initialization vector
    SecByteBlock init_vector(iv_size);
-   AutoSeededRandomPool rnd;
 
    // Generate our random init vector
-   rnd.GenerateBlock(init_vector, init_vector.size());
+   _rng.GenerateBlock(init_vector, init_vector.size());
 
-   // Encrypt the data
+   // Encrypt the data straight into the output behind the IV
    CFB_Mode<AES>::Encryption encryptor;
    encryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
 
-   std::string cipher;
-   ArraySource as(buf.data(), buf.size(), true,
-                  new StreamTransformationFilter(encryptor, new StringSink(cipher)));
+   std::vector<uint8_t> enc_data(iv_size + buf.size());
+   memcpy(enc_data.data(), init_vector.data(), iv_size);
+   encryptor.ProcessData(enc_data.data() + iv_size, buf.data(), buf.size());
+   buf.swap(enc_data);
+}
 
-   // Now add the IV to the stream we will be sending out
-   std::vector<uint8_t> enc_data(init_vector.begin(), init_vector.end());
-   enc_data.insert(enc_data.end(), cipher.begin(), cipher.end());
-   buf = enc_data;
+/**********************************************************************************************
+ * genChallenge - fills buf with auth_size random bytes for the R_A/R_B challenge
+ **********************************************************************************************/
+
+void TCPConn::genChallenge(std::string &buf)
+{
+   buf.resize(auth_size);
+   _rng.GenerateBlock((uint8_t *) &buf[0], auth_size);
+}
+
+/**********************************************************************************************
+ * deriveSessionKeys - runs HKDF-SHA256 over the shared key, salted with R_A||R_B, for a key
+ *                     and nonce prefix in each direction. Both challenges are fresh per
+ *                     connection, so a session's keys are never reused by another session.
+ *                     The GCM objects are keyed here and kept for the life of the connection.
+ *
+ *    Params:  r_a, r_b - the client's and server's challenge strings
+ *             client - true on the connecting side (sends with the client-to-server keys)
+ **********************************************************************************************/
+
+void TCPConn::deriveSessionKeys(const std::string &r_a, const std::string &r_b, bool client)
+{
+   // <c2s key><s2c key><c2s nonce prefix><s2c nonce prefix>
+   SecByteBlock okm(2 * key_size + 2 * nonce_prefix_size);
+   std::string salt = r_a + r_b;
+
+   HKDF<SHA256> hkdf;
+   hkdf.DeriveKey(okm, okm.size(), _aes_key, _aes_key.size(), (const uint8_t *) salt.data(),
+                  salt.size(), (const uint8_t *) session_info, sizeof(session_info) - 1);
+
+   uint8_t *c2s_key = okm.data();
+   uint8_t *s2c_key = c2s_key + key_size;
+   uint8_t *c2s_prefix = s2c_key + key_size;
+   uint8_t *s2c_prefix = c2s_prefix + nonce_prefix_size;
+
+   _tx_gcm.SetKey(client ? c2s_key : s2c_key, key_size);
+   _rx_gcm.SetKey(client ? s2c_key : c2s_key, key_size);
+   memcpy(_tx_prefix, client ? c2s_prefix : s2c_prefix, nonce_prefix_size);
+   memcpy(_rx_prefix, client ? s2c_prefix : c2s_prefix, nonce_prefix_size);
+   _tx_seq = 0;
+   _rx_seq = 0;
+   _has_session = true;
+}
+
+/**********************************************************************************************
+ * startSeal - starts encrypting a replication payload with the session's AES-GCM key. The IV
+ *             is the nonce prefix and the next message counter, so no random numbers or key
+ *             setup are needed per message
+ *
+ *    Params:  iv - gcm_iv_size bytes, filled in with the IV to send ahead of the ciphertext
+ **********************************************************************************************/
+
+void TCPConn::startSeal(uint8_t *iv)
+{
+   // Counter goes in big endian after the prefix
+   uint64_t seq = ++_tx_seq;
+   memcpy(iv, _tx_prefix, nonce_prefix_size);
+   for (int i = gcm_iv_size - 1; i >= (int) nonce_prefix_size; i--, seq >>= 8)
+      iv[i] = seq & 0xFF;
+
+   _tx_gcm.Resynchronize(iv, gcm_iv_size);
+   _tx_gcm.Update(rep_aad, sizeof(rep_aad));
+}
+
+/**********************************************************************************************
+ * sealChunk - encrypts the next piece of the payload. The ciphertext is written directly
+ *             into out, so the data is passed over once
+ *
+ *    Params:  data, len - the plaintext
+ *             out - at least len bytes
+ **********************************************************************************************/
+
+void TCPConn::sealChunk(const uint8_t *data, size_t len, uint8_t *out)
+{
+   auto start = std::chrono::steady_clock::now();
+
+   _tx_gcm.ProcessData(out, data, len);
+
+   _stats.enc_bytes += len;
+   _stats.enc_secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**********************************************************************************************
+ * finishSeal - writes the gcm_tag_size authentication tag that ends the payload
+ **********************************************************************************************/
+
+void TCPConn::finishSeal(uint8_t *tag)
+{
+   _tx_gcm.TruncatedFinal(tag, gcm_tag_size);
+}
+
+/**********************************************************************************************
+ * openPayload - verifies and decrypts a sealed payload into out
+ *
+ *    Params:  data, len - <IV><ciphertext><tag> as received
+ *             out - resized to and loaded with the plaintext
+ *
+ *    Returns: true if the tag matched, false if the data was altered, truncated, sealed
+ *             under a different key, or replayed (out is cleared)
+ **********************************************************************************************/
+
+bool TCPConn::openPayload(const uint8_t *data, size_t len, std::vector<uint8_t> &out)
+{
+   if (!_has_session || (len < gcm_iv_size + gcm_tag_size))
+   {
+      _stats.auth_failures++;
+      return false;
+   }
+
+   // The IV has to carry this session's prefix and a counter past the last one accepted
+   uint64_t seq = 0;
+   for (unsigned int i = nonce_prefix_size; i < gcm_iv_size; i++)
+      seq = (seq << 8) | data[i];
+
+   if ((memcmp(data, _rx_prefix, nonce_prefix_size) != 0) || (seq <= _rx_seq))
+   {
+      std::stringstream msg;
+      msg << "Replayed or out of sequence replication message (counter " << seq << ") from " <<
+                                                                           getNodeID() << ".";
+      _server_log.writeLog(msg.str().c_str());
+      _stats.auth_failures++;
+      return false;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+
+   size_t plain_len = len - gcm_iv_size - gcm_tag_size;
+   const uint8_t *iv = data;
+   const uint8_t *cipher = iv + gcm_iv_size;
+   const uint8_t *tag = cipher + plain_len;
+
+   out.resize(plain_len);
+
+   if (!_rx_gcm.DecryptAndVerify(out.data(), tag, gcm_tag_size, iv, gcm_iv_size,
+                                 rep_aad, sizeof(rep_aad), cipher, plain_len))
+   {
+      out.clear();
+      _stats.auth_failures++;
+      return false;
+   }
+   _rx_seq = seq;
+
+   _stats.dec_bytes += plain_len;
+   _stats.dec_secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   return true;
 }
 
 /**********************************************************************************************
@@ -173,6 +476,17 @@ void TCPConn::handleConnection()
 
    try
    {
+      // Send whatever the socket couldn't take before
+      if (_writable && _connected)
+         flushOutput();
+
+      if (_close_pending)
+      {
+         if (!hasPendingOutput())
+            disconnect();
+         return;
+      }
+
       switch (_status)
       {
 
@@ -239,6 +553,11 @@ void TCPConn::handleConnection()
       case s_hasdata:
          break;
 
+      // Client: Persistent connection, batch ack'd, waiting for the next one
+      case s_idle:
+         waitForBatch();
+         break;
+
       default:
          throw std::runtime_error("Invalid connection status!");
          break;
@@ -260,34 +579,12 @@ void TCPConn::handleConnection()
  **********************************************************************************************/
 void TCPConn::sendRand_B()
 {
+   // Remember R_B so we can check the client's K(R_B) against it
+   genChallenge(_authstr);
+   std::vector<uint8_t> rbuf(_authstr.begin(), _authstr.end());
+   sendFrame(Frame::f_auth, rbuf);
 
-   // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData())
-   {
-      std::vector<uint8_t> buf;
-
-      if (!getData(buf))
-         return;
-
-      if (!getCmdData(buf, c_sid, c_endsid))
-      {
-         std::stringstream msg;
-         msg << "SID string from connecting client invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
-
-      std::string rand_B(_authstr);
-      genRandString(rand_B, auth_size);
-      std::vector<uint8_t> rbuf(rand_B.begin(), rand_B.end());
-      wrapCmd(rbuf, c_auth, c_endauth);
-      sendData(rbuf);
-
-      //_status = s_datarx;
-      _status = s_S_waitKR_B;
-   }
-
+   _status = s_S_waitKR_B;
 }
 
 /**********************************************************************************************
@@ -303,14 +600,15 @@ void TCPConn::sendEncrRand_B()
    //send K(R_B) to server
 
    // If data on the socket, should be random string (R_B) from our host server
-   if (_connfd.hasData())
+   if (hasInput())
    {
       std::vector<uint8_t> buf;
 
-      if (!getData(buf))
+      int results = getFrame(Frame::f_auth, buf);
+      if (results == 0)
          return;
 
-      if (!getCmdData(buf, c_auth, c_endauth))
+      if (results < 0)
       {
          std::stringstream msg;
          msg << "Random string from connecting client invalid format. Cannot authenticate.";
@@ -319,6 +617,9 @@ void TCPConn::sendEncrRand_B()
          return;
       }
 
+      // R_B goes into the session keys once the server is authenticated
+      _peerstr = toString(buf);
+
       //encrypt and send to server
       if (!sendEncryptedData(buf))
       {
@@ -342,11 +643,10 @@ void TCPConn::sendEncrRand_B()
 void TCPConn::sendRand_A()
 {
 
-   std::string rand_A = _authstr;
-   genRandString(rand_A, auth_size);
-   std::vector<uint8_t> buf(rand_A.begin(), rand_A.end());
-   wrapCmd(buf, c_auth, c_endauth);
-   sendData(buf);
+   // Remember R_A so we can check the server's K(R_A) against it
+   genChallenge(_authstr);
+   std::vector<uint8_t> buf(_authstr.begin(), _authstr.end());
+   sendFrame(Frame::f_auth, buf);
 
    _status = s_C_waitKR_A;
 }
@@ -358,15 +658,16 @@ void TCPConn::sendRand_A()
 void TCPConn::waitEncrRand_B()
 {
    // If data on the socket, should be encrypted random string from our client
-   if (_connfd.hasData())
+   if (hasInput())
    {
       std::vector<uint8_t> buf;
 
       //Get K(R_B) and decrypt
-      if (!getEncryptedData(buf))
+      int results = getFrame(Frame::f_auth, buf);
+      if (results == 0)
          return;
 
-      if (!getCmdData(buf, c_auth, c_endauth))
+      if (results < 0)
       {
          std::stringstream msg;
          msg << "Encrypted random string from connecting client invalid format. Cannot authenticate.";
@@ -374,6 +675,7 @@ void TCPConn::waitEncrRand_B()
          disconnect();
          return;
       }
+      decryptData(buf);
 
       //check if decrypted K(R_B) is equal to R_B
       if (_authstr.compare(toString(buf)) != 0)
@@ -398,15 +700,16 @@ void TCPConn::waitEncrRand_B()
 void TCPConn::waitRand_A()
 {
    // If data on the socket, should be random string (R_A) from our host server
-   if (_connfd.hasData())
+   if (hasInput())
    {
       std::vector<uint8_t> buf;
 
-      if (!getData(buf))
+      // Get R_A
+      int results = getFrame(Frame::f_auth, buf);
+      if (results == 0)
          return;
 
-      // Get R_A
-      if (!getCmdData(buf, c_auth, c_endauth))
+      if (results < 0)
       {
          std::stringstream msg;
          msg << "Random string from connecting client invalid format. Cannot authenticate.";
@@ -415,6 +718,8 @@ void TCPConn::waitRand_A()
          return;
       }
 
+      std::string r_a = toString(buf);
+
       //encrypt R_A and send K(R_A) to server
       if (!sendEncryptedData(buf))
       {
@@ -425,7 +730,11 @@ void TCPConn::waitRand_A()
          return;
       }
 
+      // Client proved it has the key, key the session with both challenges
+      deriveSessionKeys(r_a, _authstr, false);
+
       //set status to wait for some message from client confirming authentication
+      _authenticated = true;
       _status = s_connected;
    }
 }
@@ -443,16 +752,16 @@ void TCPConn::client_auth()
    //encrypt R_A and send K(R_A) to server
 
    // If data on the socket, should be encrypted random string from server
-   if (_connfd.hasData())
+   if (hasInput())
    {
       std::vector<uint8_t> buf;
-      std::vector<uint8_t> buf2;
 
-      //Get K(R_B) and decrypt
-      if (!getEncryptedData(buf))
+      //Get K(R_A) and decrypt
+      int results = getFrame(Frame::f_auth, buf);
+      if (results == 0)
          return;
 
-      if (!getCmdData(buf, c_auth, c_endauth))
+      if (results < 0)
       {
          std::stringstream msg;
          msg << "Encrypted random string from connecting server invalid format. Cannot authenticate.";
@@ -460,6 +769,8 @@ void TCPConn::client_auth()
          disconnect();
          return;
       }
+      decryptData(buf);
+
       //check if decrypted K(R_B) is equal to R_B
       if (_authstr.compare(toString(buf)) != 0)
       {
@@ -470,10 +781,12 @@ void TCPConn::client_auth()
          return;
       }
 
+      // Server proved it has the key, key the session with both challenges
+      deriveSessionKeys(_authstr, _peerstr, true);
+
       //Resend SID as confirmation of authentication
       std::vector<uint8_t> sbuf(_svr_id.begin(), _svr_id.end());
-      wrapCmd(sbuf, c_sid, c_endsid);
-      sendData(sbuf);
+      sendFrame(Frame::f_sid, sbuf, local_caps);
       
       _status = s_datatx;
    }
@@ -488,15 +801,15 @@ void TCPConn::client_auth()
 void TCPConn::sendSID()
 {
    std::vector<uint8_t> buf(_svr_id.begin(), _svr_id.end());
-   wrapCmd(buf, c_sid, c_endsid);
-   sendData(buf);
+   sendFrame(Frame::f_sid, buf, local_caps);
 
    //_status = s_datatx;
    _status = s_C_waitR_B;
 }
 
 /**********************************************************************************************
- * waitForSID()  - receives the SID and sends our SID
+ * waitForSID()  - receives the SID. The first time starts the challenge/response, the second
+ *                 (client confirming after authentication) gets our SID sent back
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
@@ -505,14 +818,16 @@ void TCPConn::waitForSID()
 {
 
    // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData())
+   if (hasInput())
    {
       std::vector<uint8_t> buf;
+      uint16_t caps = 0;
 
-      if (!getData(buf))
+      int results = getFrame(Frame::f_sid, buf, &caps);
+      if (results == 0)
          return;
 
-      if (!getCmdData(buf, c_sid, c_endsid))
+      if (results < 0)
       {
          std::stringstream msg;
          msg << "SID string from connecting client invalid format. Cannot authenticate.";
@@ -522,12 +837,29 @@ void TCPConn::waitForSID()
       }
 
       std::string node(buf.begin(), buf.end());
-      setNodeID(node.c_str());
+
+      // Not authenticated yet, send our challenge R_B
+      if (!_authenticated) {
+         setNodeID(node.c_str());
+         _status = s_S_sendR_B;
+         return;
+      }
+
+      if (node.compare(_node_id) != 0) {
+         std::stringstream msg;
+         msg << "SID confirmation from " << node << " does not match authenticated node " << _node_id;
+         _server_log.writeLog(msg.str().c_str());
+         disconnect();
+         return;
+      }
+
+      // The confirmed SID carries the capabilities we can use with this client
+      _peer_caps = caps & local_caps;
+      _peer_caps_known = true;
 
       // Send our Node ID
       buf.assign(_svr_id.begin(), _svr_id.end());
-      wrapCmd(buf, c_sid, c_endsid);
-      sendData(buf);
+      sendFrame(Frame::f_sid, buf, local_caps);
 
       _status = s_datarx;
    }
@@ -543,14 +875,16 @@ void TCPConn::transmitData()
 {
 
    // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData())
+   if (hasInput())
    {
       std::vector<uint8_t> buf;
+      uint16_t caps = 0;
 
-      if (!getData(buf))
+      int results = getFrame(Frame::f_sid, buf, &caps);
+      if (results == 0)
          return;
 
-      if (!getCmdData(buf, c_sid, c_endsid))
+      if (results < 0)
       {
          std::stringstream msg;
          msg << "SID string from connected server invalid format. Cannot authenticate.";
@@ -561,9 +895,11 @@ void TCPConn::transmitData()
 
       std::string node(buf.begin(), buf.end());
       setNodeID(node.c_str());
+      _peer_caps = caps & local_caps;
+      _peer_caps_known = true;
 
       // Send the replication data
-      sendData(_outputbuf);
+      sendOutput();
 
       if (_verbosity >= 3)
          std::cout << "Successfully authenticated connection with " << getNodeID() << " and sending replication data.\n";
@@ -583,36 +919,57 @@ void TCPConn::transmitData()
 void TCPConn::waitForData()
 {
 
+   // Persistent connection, the last batch hasn't been picked up by the QueueMgr yet
+   if (_data_ready)
+      return;
+
    // If data on the socket, should be replication data
-   if (_connfd.hasData())
+   if (hasInput())
    {
       std::vector<uint8_t> buf;
 
-      if (!getData(buf))
+      // Large batches can take several reads to arrive
+      uint16_t flags = 0;
+      int results = getFrame(Frame::f_rep, buf, &flags);
+      if (results == 0)
          return;
 
-      if (!getCmdData(buf, c_rep, c_endrep))
+      // Replication data must be encrypted, a tag mismatch means it was altered on the way
+      if ((results < 0) || !(flags & frame_flag_gcm))
       {
          std::stringstream msg;
-         msg << "Replication data possibly corrupted from" << getNodeID() << "\n";
+         msg << "Replication data possibly corrupted or not authenticated from " << getNodeID() << "\n";
          _server_log.writeLog(msg.str().c_str());
          disconnect();
          return;
       }
 
       // Got the data, save it
-      _inputbuf = buf;
+      _inputbuf.swap(buf);
       _data_ready = true;
 
       // Send the acknowledgement and disconnect
-      sendData(c_ack);
+      std::vector<uint8_t> ack;
+      sendFrame(Frame::f_ack, ack);
 
       if (_verbosity >= 2)
          std::cout << "Successfully received replication data from " << getNodeID() << "\n";
 
-      disconnect();
+      // Persistent, stay in s_datarx for the next batch
+      if (_persistent) {
+         _last_activity = time(NULL);
+         return;
+      }
+
+      closeWhenFlushed();
       _status = s_hasdata;
    }
+   else if (_persistent && (_last_activity > 0) && (time(NULL) > _last_activity + 2 * idle_timeout))
+   {
+      if (_verbosity >= 3)
+         std::cout << "Persistent connection from " << getNodeID() << " timed out.\n";
+      disconnect();
+   }
 }
 
 /**********************************************************************************************
@@ -625,19 +982,35 @@ void TCPConn::awaitAck()
 {
 
    // Should have the awk message
-   if (_connfd.hasData())
+   if (hasInput())
    {
       std::vector<uint8_t> buf;
 
-      if (!getData(buf))
+      int results = getFrame(Frame::f_ack, buf);
+      if (results == 0)
          return;
 
-      if (findCmd(buf, c_ack) == buf.end())
+      if (results < 0)
       {
          std::stringstream msg;
          msg << "Awk expected from data send, received something else. Node:" << getNodeID() << "\n";
          _server_log.writeLog(msg.str().c_str());
       }
+      else
+      {
+         // Only now has the peer got the batch--lets the QueueMgr advance its cursor
+         _batch_acked = true;
+      }
+
+      // Persistent, hold the connection for the next batch
+      if (_persistent && _batch_acked) {
+         if (_verbosity >= 3)
+            std::cout << "Data ack received from " << getNodeID() << ". Holding connection open.\n";
+
+         _last_activity = time(NULL);
+         _status = s_idle;
+         return;
+      }
 
       if (_verbosity >= 3)
          std::cout << "Data ack received from " << getNodeID() << ". Disconnecting.\n";
@@ -647,166 +1020,211 @@ void TCPConn::awaitAck()
 }
 
 /**********************************************************************************************
- * getData - Reads in data from the socket and checks to see if there's an end command to the
- *           message to confirm we got it all
- *
- *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
+ * waitForBatch - persistent client connection, already authenticated. Sends the next batch
+ *                as soon as one is assigned. Closes the connection if the other side closes
+ *                it or it sits idle past idle_timeout.
  *
- *    Returns: true if the data is ready to be read, false if they lost connection
- *
- *    Throws: runtime_error for unrecoverable issues
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-bool TCPConn::getData(std::vector<uint8_t> &buf)
+void TCPConn::waitForBatch()
 {
+   if (_outbatch)
+   {
+      sendOutput();
 
-   std::vector<uint8_t> readbuf;
-   size_t count = 0;
+      if (_verbosity >= 3)
+         std::cout << "Sending replication data to " << getNodeID() << " on open connection.\n";
 
-   buf.clear();
+      _status = s_waitack;
+      return;
+   }
 
-   while (_connfd.hasData())
+   // Nothing should come in while idle--getData notices the close
+   if (hasInput())
    {
-      // read the data on the socket up to 1024
-      count += _connfd.readBytes<uint8_t>(readbuf, 1024);
-
-      // check if we lost connection
-      if (readbuf.size() == 0)
+      if (getData(_rxbuf))
       {
          std::stringstream msg;
-         std::string ip_addr;
-         msg << "Connection from server " << _node_id << " lost (IP: " << getIPAddrStr(ip_addr) << ")";
+         msg << "Unexpected data on idle connection to " << getNodeID() << ". Disconnecting.";
          _server_log.writeLog(msg.str().c_str());
          disconnect();
-         return false;
       }
+      return;
+   }
 
-      buf.insert(buf.end(), readbuf.begin(), readbuf.end());
-
-      // concat the data onto anything we've read before
-      //      _inputbuf.insert(_inputbuf.end(), readbuf.begin(), readbuf.end());
+   if (time(NULL) > _last_activity + idle_timeout)
+   {
+      if (_verbosity >= 3)
+         std::cout << "Closing idle connection to " << getNodeID() << "\n";
+      disconnect();
    }
-   return true;
 }
 
 /**********************************************************************************************
- * decryptData - Takes in an encrypted buffer in the form IV/Data and decrypts it, replacing
- *               buf with the decrypted info (destroys IV string>
+ * getData - Reads everything waiting on the socket onto the end of buf without blocking. Reads
+ *           go straight into buf's free space, which is reused from call to call
  *
- *    Params: buf - the encrypted string and holds the decrypted data (minus IV)
+ *    Params: buf - the data read is appended here
+ *
+ *    Returns: true if the connection is still up, false if they lost connection
  *
+ *    Throws: socket_error for read errors
  **********************************************************************************************/
-void TCPConn::decryptData(std::vector<uint8_t> &buf)
+
+bool TCPConn::getData(ByteBuffer &buf)
 {
-   // For the initialization vector
-   SecByteBlock init_vector(iv_size);
 
-   // Copy the IV from the incoming stream of data
-   init_vector.Assign(buf.data(), iv_size);
-   buf.erase(buf.begin(), buf.begin() + iv_size);
+   ssize_t results;
+   size_t count = 0;
 
-   // Decrypt the data
-   CFB_Mode<AES>::Decryption decryptor;
-   decryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
+   _readable = false;
 
-   std::string recovered;
-   ArraySource as(buf.data(), buf.size(), true,
-                  new StreamTransformationFilter(decryptor, new StringSink(recovered)));
+   // Read until the socket has nothing more waiting
+   while ((results = _connfd.readInto(buf, 16384)) != 0)
+   {
+      if (results < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            break;
+         throw socket_error("Read error on connection socket.");
+      }
+      count += results;
+   }
 
-   buf.assign(recovered.begin(), recovered.end());
+   // check if we lost connection. If the peer sent something and then closed, hand back
+   // what was read--the close gets picked up on the next read
+   if ((results == 0) && (count > 0))
+      _readable = true;
+   else if (results == 0)
+   {
+      std::stringstream msg;
+      std::string ip_addr;
+      msg << "Connection from server " << _node_id << " lost (IP: " << getIPAddrStr(ip_addr) << ")";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return false;
+   }
+   return true;
 }
 
 /**********************************************************************************************
- * getEncryptedData - Reads in data from the socket and decrypts it, passing the decrypted
- *                    data back in buf
+ * getFrame - reads what is waiting on the socket into the receive buffer and takes the first
+ *            frame off the front of it. Whatever follows the frame stays buffered, and a
+ *            frame that has only partly arrived waits for the rest.
  *
- *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
+ *    Params: type - the Frame::frame_type expected
+ *            buf - loaded with the frame's payload
  *
- *    Returns: true if the data is ready to be read, false otherwise
+ *    Returns: 1 if a frame was taken, 0 if more data is needed (or the connection closed),
+ *             -1 if the data is not a valid frame of the expected type
  *
- *    Throws: runtime_error for unrecoverable issues
+ *    Throws: socket_error for read errors
  **********************************************************************************************/
 
-bool TCPConn::getEncryptedData(std::vector<uint8_t> &buf)
+int TCPConn::getFrame(uint8_t type, std::vector<uint8_t> &buf, uint16_t *flags)
 {
-   // Get the data from the socket
-   if (!getData(buf))
-      return false;
+   if (_readable && !getData(_rxbuf))
+      return 0;
 
-   decryptData(buf);
+   Frame frame;
+   int results = frame.parse(_rxbuf.data(), _rxbuf.size());
+   if (results <= 0)
+   {
+      _rx_pending = false;
+      return results;
+   }
 
-   return true;
+   if (frame.type != type)
+      return -1;
+
+   // Encrypted payloads are decrypted straight out of the receive buffer
+   results = 1;
+   if ((frame.type == Frame::f_rep) && (frame.flags & frame_flag_gcm))
+   {
+      if (!openPayload(_rxbuf.data() + frame_header_size, frame.length, buf))
+         results = -1;
+   }
+   else
+      buf.assign(_rxbuf.data() + frame_header_size, _rxbuf.data() + frame.getSize());
+
+   if (flags != NULL)
+      *flags = frame.flags;
+
+   _rxbuf.consume(frame.getSize());
+   _rx_pending = !_rxbuf.empty();
+   return results;
 }
 
 /**********************************************************************************************
- * findCmd - returns an iterator to the location of a string where a command starts
- * hasCmd - returns true if command was found, false otherwise
+ * sendFrame - puts the frame header on the payload and sends it
  *
- *    Params: buf = the data buffer to look for the command within
- *            cmd - the command string to search for in the data
- *
- *    Returns: iterator - points to cmd position if found, end() if not found
+ *    Params: type - the Frame::frame_type of the message
+ *            payload - the message data
+ *            flags - header flags for the frame type
  *
+ *    Throws: runtime_error for unrecoverable errors
  **********************************************************************************************/
 
-std::vector<uint8_t>::iterator TCPConn::findCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd)
-{
-   return std::search(buf.begin(), buf.end(), cmd.begin(), cmd.end());
-}
-
-bool TCPConn::hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd)
+bool TCPConn::sendFrame(uint8_t type, std::vector<uint8_t> &payload, uint16_t flags)
 {
-   return !(findCmd(buf, cmd) == buf.end());
+   std::vector<uint8_t> frame;
+   Frame::append(frame, type, payload, flags);
+   queueOutput(std::move(frame));
+   return true;
 }
 
 /**********************************************************************************************
- * getCmdData - looks for a startcmd and endcmd and returns the data between the two 
- *
- *    Params: buf = the string to search for the tags
- *            startcmd - the command at the beginning of the data sought
- *            endcmd - the command at the end of the data sought
+ * decryptData - Takes in an encrypted buffer in the form IV/Data and decrypts it, replacing
+ *               buf with the decrypted info (destroys IV string>
  *
- *    Returns: true if both start and end commands were found, false otherwisei
+ *    Params: buf - the encrypted string and holds the decrypted data (minus IV)
  *
  **********************************************************************************************/
-
-bool TCPConn::getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                         std::vector<uint8_t> &endcmd)
+void TCPConn::decryptData(std::vector<uint8_t> &buf)
 {
-   std::vector<uint8_t> temp = buf;
-   auto start = findCmd(temp, startcmd);
-   auto end = findCmd(temp, endcmd);
+   // For the initialization vector
+   SecByteBlock init_vector(iv_size);
 
-   if ((start == temp.end()) || (end == temp.end()) || (start == end))
-      return false;
+   // Copy the IV from the incoming stream of data
+   init_vector.Assign(buf.data(), iv_size);
+   buf.erase(buf.begin(), buf.begin() + iv_size);
 
-   buf.assign(start + startcmd.size(), end);
-   return true;
+   // Decrypt the data in place
+   CFB_Mode<AES>::Decryption decryptor;
+   decryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
+
+   decryptor.ProcessData(buf.data(), buf.data(), buf.size());
 }
 
 /**********************************************************************************************
- * wrapCmd - wraps the command brackets around the passed-in data
+ * getEncryptedData - Reads in data from the socket and decrypts it, passing the decrypted
+ *                    data back in buf
+ *
+ *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
  *
- *    Params: buf = the string to wrap around
- *            startcmd - the command at the beginning of the data
- *            endcmd - the command at the end of the data
+ *    Returns: true if the data is ready to be read, false otherwise
  *
+ *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                      std::vector<uint8_t> &endcmd)
+bool TCPConn::getEncryptedData(std::vector<uint8_t> &buf)
 {
-   std::vector<uint8_t> temp = startcmd;
-   temp.insert(temp.end(), buf.begin(), buf.end());
-   temp.insert(temp.end(), endcmd.begin(), endcmd.end());
+   // Get the auth frame off the socket
+   if (getFrame(Frame::f_auth, buf) <= 0)
+      return false;
 
-   buf = temp;
+   decryptData(buf);
+
+   return true;
 }
 
 /**********************************************************************************************
  * getReplData - Returns the data received on the socket and marks the socket as done
  *
- *    Params: buf = the data received
+ *    Params: buf = the data received (moved out of the connection, not copied)
  *
  *
  *    Throws: runtime_error for unrecoverable issues
@@ -815,11 +1233,17 @@ void TCPConn::wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
 void TCPConn::getInputData(std::vector<uint8_t> &buf)
 {
 
-   // Returns the replication data off this connection, then prepares it to be removed
-   buf = _inputbuf;
+   // Hands the replication data off this connection over without copying it, then prepares
+   // it to be removed
+   buf.swap(_inputbuf);
+   _inputbuf.clear();
 
    _data_ready = false;
-   _status = s_none;
+
+   // A persistent connection is still open and waiting for more. One still flushing its
+   // ACK is cleaned up after it closes
+   if ((_status == s_hasdata) && !_connected)
+      _status = s_none;
 }
 
 /**********************************************************************************************
@@ -842,6 +1266,8 @@ void TCPConn::connect(const char *ip_addr, unsigned short port)
       throw socket_error("TCP Connection failed!");
 
    _connected = true;
+   _watched = false;
+   _connfd.setNonBlocking();
 }
 
 // Same as above, but ip_addr and port are in network (big endian) format
@@ -854,6 +1280,8 @@ void TCPConn::connect(unsigned long ip_addr, unsigned short port)
       throw socket_error("TCP Connection failed!");
 
    _connected = true;
+   _watched = false;
+   _connfd.setNonBlocking();
 }
 
 /**********************************************************************************************
@@ -861,16 +1289,93 @@ void TCPConn::connect(unsigned long ip_addr, unsigned short port)
  *                      is sent to the target server
  *
  *    Params:  data - the data stream to send to the server
+ *             batch_lsn - highest database LSN contained in the data, reported back through
+ *                         getBatchLSN once the peer acknowledges it (0 = not tracked)
+ *
+ **********************************************************************************************/
+
+void TCPConn::assignOutgoingData(shared_batch data, uint64_t batch_lsn)
+{
+   _has_batch = (batch_lsn > 0);
+   _batch_lsn = batch_lsn;
+   _batch_acked = false;
+
+   _outbatch = data;
+}
+
+/**********************************************************************************************
+ * clearBatch - forgets the batch LSN once the QueueMgr has recorded the ack or the failure
+ **********************************************************************************************/
+
+void TCPConn::clearBatch()
+{
+   _has_batch = false;
+   _batch_acked = false;
+   _batch_lsn = 0;
+}
+
+/**********************************************************************************************
+ * hasInput - true if epoll flagged the socket or the last read left another command behind
+ **********************************************************************************************/
+
+bool TCPConn::hasInput()
+{
+   return _readable || _rx_pending;
+}
+
+/**********************************************************************************************
+ * needsService - true if the next handleConnection will do something even if nothing new
+ *                arrives on the socket, so the event loop should not sleep
+ **********************************************************************************************/
+
+bool TCPConn::needsService()
+{
+   // Closed connections need to be reconnected (on their timer) or cleaned up
+   if (!_connected)
+      return (_status != s_connecting);
+
+   if (_rx_pending || _data_ready)
+      return true;
+
+   // Socket took more room since the last flush, or a close is waiting on the flush
+   if ((_writable && hasPendingOutput()) || (_close_pending && !hasPendingOutput()))
+      return true;
+
+   switch (_status)
+   {
+   case s_connecting:
+   case s_S_sendR_B:
+   case s_C_sendR_A:
+   case s_none:
+      return true;
+
+   case s_idle:
+      return (bool) _outbatch;
+
+   default:
+      return false;
+   }
+}
+
+/**********************************************************************************************
+ * getDeadline - the time handleConnection next has timed work to do: a reconnect attempt or
+ *               closing an idle persistent connection
  *
+ *    Returns: the time, or 0 if no timer is running
  **********************************************************************************************/
 
-void TCPConn::assignOutgoingData(std::vector<uint8_t> &data)
+time_t TCPConn::getDeadline()
 {
+   if (!_connected)
+      return (_status == s_connecting) ? reconnect : 0;
+
+   if (_status == s_idle)
+      return _last_activity + idle_timeout;
+
+   if (_persistent && (_status == s_datarx) && (_last_activity > 0))
+      return _last_activity + 2 * idle_timeout + 1;
 
-   _outputbuf.clear();
-   _outputbuf = c_rep;
-   _outputbuf.insert(_outputbuf.end(), data.begin(), data.end());
-   _outputbuf.insert(_outputbuf.end(), c_endrep.begin(), c_endrep.end());
+   return 0;
 }
 
 /**********************************************************************************************
@@ -880,8 +1385,24 @@ void TCPConn::assignOutgoingData(std::vector<uint8_t> &data)
  **********************************************************************************************/
 void TCPConn::disconnect()
 {
+   // Closing the socket also takes it out of the epoll set
    _connfd.closeFD();
    _connected = false;
+   _watched = false;
+   _readable = false;
+
+   // Anything still queued can't be sent now
+   _txqueue.clear();
+   _txoff = 0;
+   _tx_pending = 0;
+   _writable = false;
+   _watching_out = false;
+   _close_pending = false;
+
+   // A reconnect runs a new handshake and gets new keys. A half-sent batch is not resumed
+   _has_session = false;
+   _streambatch.reset();
+   _stream_pos = 0;
 }
 
 /**********************************************************************************************
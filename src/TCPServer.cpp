@@ -4,6 +4,9 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <stdexcept>
 #include <strings.h>
 #include <vector>
@@ -13,19 +16,35 @@
 #include <crypto++/secblock.h>
 #include <crypto++/osrng.h>
 #include <crypto++/files.h>
+#include <crypto++/cpu.h>
 #include "TCPServer.h"
 #include "ALMgr.h"
 
 TCPServer::TCPServer(unsigned int verbosity)
                         :_aes_key(CryptoPP::AES::DEFAULT_KEYLENGTH), 
                          _server_log("server.log", 0),
-                         _verbosity(verbosity)
+                         _verbosity(verbosity),
+                         _listen_ready(false)
 {
+   _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (_epoll_fd < 0)
+      throw std::runtime_error("Unable to create epoll instance.");
+
+   _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (_wake_fd < 0)
+      throw std::runtime_error("Unable to create eventfd for the event loop.");
+
+   epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.ptr = &_wake_fd;
+   if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake_fd, &ev) < 0)
+      throw std::runtime_error("Unable to add eventfd to the epoll set.");
 }
 
 
 TCPServer::~TCPServer() {
-
+   close(_wake_fd);
+   close(_epoll_fd);
 }
 
 /**********************************************************************************************
@@ -57,6 +76,13 @@ void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
 void TCPServer::listenSvr() {
    _sockfd.listenFD(5);
 
+   // A NULL pointer in the event data marks the listening socket
+   epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
+   if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _sockfd.getFD(), &ev) < 0)
+      throw socket_error("Unable to add the listening socket to the epoll set.");
+
    std::string ipaddr_str;
    std::stringstream msg;
    _sockfd.getIPAddrStr(ipaddr_str);
@@ -74,9 +100,6 @@ void TCPServer::listenSvr() {
 
 void TCPServer::runServer() {
    bool online = true;
-   timespec sleeptime;
-   sleeptime.tv_sec = 0;
-   sleeptime.tv_nsec = 100000000;
 
    // Start the server socket listening
    listenSvr();
@@ -86,8 +109,8 @@ void TCPServer::runServer() {
 
       handleConnections();
 
-      // So we're not chewing up CPU cycles unnecessarily
-      nanosleep(&sleeptime, NULL);
+      // Sleep until there's something to do
+      waitForEvents(getWaitTimeout());
    } 
 
 
@@ -106,10 +129,11 @@ void TCPServer::runServer() {
 TCPConn *TCPServer::handleSocket() {
   
    // The socket has data, means a new connection 
-   if (_sockfd.hasData()) {
+   if (_listen_ready) {
+      _listen_ready = false;
 
       // Try to accept the connection
-      TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
+      TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _cipher_stats, _verbosity);
       if (!new_conn->accept(_sockfd)) {
          _server_log.strerrLog("Data received on socket but failed to accept.");
          return NULL;
@@ -203,7 +227,9 @@ void TCPServer::handleConnections() {
             msg += "' lost connection.";
             _server_log.writeLog(msg);
 
-            // Remove them from the connect list
+            // Remove them from the connect list (closing the socket if still open)
+            if ((*tptr)->isConnected())
+               (*tptr)->disconnect();
             tptr = _connlist.erase(tptr);
             std::cout << "Connection disconnected.\n";
             continue;
@@ -230,6 +256,118 @@ void TCPServer::loadAESKey(const char *filename) {
 }
 
 
+/**********************************************************************************************
+ * waitForEvents - registers any newly-connected sockets with epoll, then sleeps until a
+ *                 socket is ready, wakeUp is called, or the timeout passes. Ready connections
+ *                 are marked readable for their state handlers.
+ *
+ *    Params:  timeout_ms - longest to sleep in milliseconds (0 = just check, -1 = forever)
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPServer::waitForEvents(int timeout_ms) {
+   const int max_events = 64;
+   epoll_event events[max_events];
+
+   // Register new sockets, and watch for writability only while output is queued
+   for (auto tptr = _connlist.begin(); tptr != _connlist.end(); tptr++) {
+      if (!(*tptr)->isConnected())
+         continue;
+      if (!(*tptr)->isWatched() || ((*tptr)->hasPendingOutput() != (*tptr)->isWatchingOut()))
+         watchConn(**tptr);
+   }
+
+   int n = epoll_wait(_epoll_fd, events, max_events, timeout_ms);
+   if (n < 0) {
+      if (errno == EINTR)
+         return;
+      throw socket_error("epoll_wait failed in the event loop.");
+   }
+
+   for (int i=0; i<n; i++) {
+      if (events[i].data.ptr == NULL) {
+         _listen_ready = true;
+      } else if (events[i].data.ptr == &_wake_fd) {
+         uint64_t count;
+         if (read(_wake_fd, &count, sizeof(count)) < 0) {
+            // Already drained, nothing to do
+         }
+      } else {
+         TCPConn *conn = static_cast<TCPConn *>(events[i].data.ptr);
+         if (events[i].events & EPOLLOUT)
+            conn->setWritable();
+         if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+            conn->setReadable();
+      }
+   }
+}
+
+/**********************************************************************************************
+ * getWaitTimeout - finds how long the event loop can sleep: 0 if any connection has work
+ *                  waiting, otherwise until the earliest connection timer
+ *
+ *    Params:  max_ms - the longest it will return
+ *
+ *    Returns: the timeout in milliseconds
+ **********************************************************************************************/
+
+int TCPServer::getWaitTimeout(int max_ms) {
+   time_t now = time(NULL);
+   int timeout = max_ms;
+
+   for (auto tptr = _connlist.begin(); tptr != _connlist.end(); tptr++) {
+      if ((*tptr)->needsService())
+         return 0;
+
+      time_t deadline = (*tptr)->getDeadline();
+      if (deadline == 0)
+         continue;
+
+      if (deadline <= now)
+         return 0;
+
+      if ((deadline - now) * 1000 < timeout)
+         timeout = (deadline - now) * 1000;
+   }
+   return timeout;
+}
+
+/**********************************************************************************************
+ * wakeUp - pokes the eventfd so a thread sleeping in waitForEvents returns
+ **********************************************************************************************/
+
+void TCPServer::wakeUp() {
+   uint64_t one = 1;
+   if (write(_wake_fd, &one, sizeof(one)) < 0) {
+      // Counter is already non-zero, the loop will wake anyway
+   }
+}
+
+/**********************************************************************************************
+ * watchConn - adds a connection's socket to the epoll set, pointing the event back at it, or
+ *             updates it if already there. EPOLLOUT is included while the connection has
+ *             output queued so the loop wakes when the socket can take more
+ *
+ *    Throws: socket_error if epoll won't take the socket
+ **********************************************************************************************/
+
+void TCPServer::watchConn(TCPConn &conn) {
+   epoll_event ev;
+   bool want_out = conn.hasPendingOutput();
+
+   ev.events = EPOLLIN | EPOLLRDHUP;
+   if (want_out)
+      ev.events |= EPOLLOUT;
+   ev.data.ptr = &conn;
+
+   int op = conn.isWatched() ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+   if (epoll_ctl(_epoll_fd, op, conn.getFD(), &ev) < 0)
+      throw socket_error("Unable to add connection socket to the epoll set.");
+   conn.setWatched();
+   conn.setWatchingOut(want_out);
+}
+
 /**********************************************************************************************
  * shutdown - Cleanly closes the socket FD.
  *
@@ -245,3 +383,28 @@ void TCPServer::shutdown() {
 void TCPServer::changeLogfile(const char *filename) {
    _server_log.changeFilename(filename);
 }
+
+/**********************************************************************************************
+ * logCipherStats - writes the replication data encryption totals and throughput to the log
+ *                  (and stdout at verbosity 2+)
+ **********************************************************************************************/
+
+void TCPServer::logCipherStats() {
+   std::stringstream msg;
+   const double mb = 1024.0 * 1024.0;
+
+   msg.setf(std::ios::fixed);
+   msg.precision(2);
+   msg << "AES-GCM (AES-NI " << (CryptoPP::HasAESNI() ? "yes" : "no") << "): encrypted " <<
+          _cipher_stats.enc_bytes / mb << " MB";
+   if (_cipher_stats.enc_secs > 0.0)
+      msg << " at " << _cipher_stats.enc_bytes / mb / _cipher_stats.enc_secs << " MB/s";
+   msg << ", decrypted " << _cipher_stats.dec_bytes / mb << " MB";
+   if (_cipher_stats.dec_secs > 0.0)
+      msg << " at " << _cipher_stats.dec_bytes / mb / _cipher_stats.dec_secs << " MB/s";
+   msg << ", " << _cipher_stats.auth_failures << " authentication failures.";
+
+   _server_log.writeLog(msg.str().c_str());
+   if (_verbosity >= 2)
+      std::cout << msg.str() << "\n";
+}
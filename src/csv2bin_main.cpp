@@ -8,75 +8,128 @@
 
 #include <stdexcept>
 #include <iostream>
+#include <getopt.h>
 #include "FileDesc.h"
 #include "DronePlotDB.h"
+#include "CSVConverter.h"
+#include "PlotFile.h"
 #include "strfuncts.h"
 
 using namespace std; 
 
 void displayHelp(const char *execname) {
    std::cout << execname << " <input file> <output file> <NodeID>\n";
-//   std::cout << "   t: maximum number of threads to use\n";
-//   std::cout << "   n: calculate primes up to the given range\n";
-//   std::cout << "   s: only run in single process mode\n";
-//   std::cout << "   m: only run in multithreaded mode\n";
-//   std::cout << "   w: skip writing to disk\n";
+   std::cout << "   t: maximum number of parse threads to use (default: one per core)\n";
+   std::cout << "   c: read the output back in and write it to diditwork.csv to check it\n";
+   std::cout << "   r: <t_begin>,<t_end> - with c, only read back the plots with timestamps in\n";
+   std::cout << "      this range, decoding just the blocks the file's index says could match\n";
+   std::cout << "   v: verbosity - how much information to send to stdout (0-3, 3=max)\n";
 }
 
 
 int main(int argc, char *argv[]) {
+   std::vector<std::string> args;
+   unsigned int max_threads = 0;
+   unsigned int verbosity = 0;
+   bool check = false;
+   bool ranged = false;
+   time_t t_begin = 0, t_end = 0;
+   char *endptr;
+
+   // The - at the beginning of the optstring hands the file names and node ID to case 1
+   int c = 0;
+   while ((c = getopt(argc, argv, "-t:cv:r:")) != -1) {
+      switch (c) {
+      case 1:
+         args.push_back(optarg);
+         break;
+
+      case 't':
+         max_threads = (unsigned int) strtol(optarg, NULL, 10);
+         break;
+
+      case 'c':
+         check = true;
+         break;
+
+      case 'v':
+         verbosity = (unsigned int) strtol(optarg, NULL, 10);
+         break;
+
+      case 'r':
+         t_begin = (time_t) strtol(optarg, &endptr, 10);
+         if (*endptr != ',') {
+            std::cerr << "Invalid range. Format: -r <t_begin>,<t_end>\n";
+            exit(0);
+         }
+         t_end = (time_t) strtol(endptr + 1, NULL, 10);
+         ranged = true;
+         break;
+
+      case '?':
+         displayHelp(argv[0]);
+         exit(0);
+
+      default:
+         break;
+      }
+   }
 
    // Check the command line input
-   if (argc < 4) {
+   if (args.size() < 3) {
       displayHelp(argv[0]);
       exit(0);
    }
 
    // Get the filenames for the input and output file
-   std::string input_file(argv[1]);
-   std::string output_file(argv[2]);
+   std::string input_file(args[0]);
+   std::string output_file(args[1]);
    
-   unsigned long node_id = strtol(argv[3], NULL, 10);
+   unsigned long node_id = strtol(args[2].c_str(), NULL, 10);
 
    std::cout << "Filtering to only node: " << node_id << "\n";
 
-   std::cout << "Reading in the CSV file.";
-
-   DronePlotDB db;
-   int count = 0;
-   if ((count = db.loadCSVFile(input_file.c_str())) < 0) {
-      std::cerr << "Either failed opening file for reading or file was corrupted.\n";
-      exit(-1);
-   }
+   std::cout << "Converting the CSV file to: " << output_file.c_str() << "\n";
 
-   // Filter by NodeID
-   for (unsigned int i=1; i<=3; i++) {
-      if (i != node_id)
-         db.removeNodeID(i);
-   }
+   // Parsed, filtered and written out a piece at a time, so the input can be any size
+   CSVConverter converter(input_file.c_str(), output_file.c_str(), verbosity);
+   converter.setNodeFilter(node_id);
 
-   if (count == 0) {
-      std::cout << "No data points in the file. Exiting without writing to output file.\n";
-      exit(0);
-   }
-
-   std::cout << "Read in " << count << " drone data points successfully.\n";
-   std::cout << "Size: " << db.size() << "\n";
-
-   std::cout << "Writing to: " << output_file.c_str() << "\n";
-   if (db.writeBinaryFile(output_file.c_str()) < 0) {
-      std::cerr << "Unable to open output file for writing.\n";
+   size_t count = 0;
+   try {
+      count = converter.convert(max_threads);
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      std::cerr << "Either failed opening a file or the input file was corrupted.\n";
       exit(-1);
    }
 
-   std::cout << "Wrote " << db.size() << " drone data points\n";
-   db.clear();
+   std::cout << "Read in " << converter.getPlotsRead() << " drone data points successfully.\n";
+   std::cout << "Wrote " << count << " drone data points\n";
 
    // Test the functions
-   db.loadBinaryFile(output_file.c_str());
-
-   std::cout << "Num: " << db.size() << "\n";
-   db.writeCSVFile("diditwork.csv");
+   if (check && ranged) {
+      PlotFile plotfile(output_file.c_str());
+      if (plotfile.open()) {
+         std::vector<size_t> blocks;
+         size_t scan = plotfile.findBlocks(t_begin, t_end, blocks);
+         std::cout << "Range " << t_begin << "-" << t_end << " needs " << blocks.size() <<
+                      " of " << plotfile.numBlocks() << " blocks (" << scan << " of " <<
+                      plotfile.numPlots() << " plots decoded).\n";
+      }
+
+      DronePlotDB db;
+      db.loadBinaryRange(output_file.c_str(), t_begin, t_end, all_drones, max_threads);
+
+      std::cout << "Num: " << db.size() << "\n";
+      db.writeCSVFile("diditwork.csv");
+   } else if (check) {
+      DronePlotDB db;
+      db.loadBinaryFile(output_file.c_str());
+
+      std::cout << "Num: " << db.size() << "\n";
+      db.writeCSVFile("diditwork.csv");
+   }
    
    return 0;
 }
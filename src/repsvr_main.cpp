@@ -13,11 +13,13 @@
 #include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
+#include <memory>
 #include "FileDesc.h"
 #include "DronePlotDB.h"
 #include "AntennaSim.h"
 #include "strfuncts.h"
 #include "ReplServer.h"
+#include "PlotWAL.h"
 
 using namespace std; 
 
@@ -65,6 +67,14 @@ void displayHelp(const char *execname) {
    std::cout << "   o: the file to write the DB dump CSV to (default: replication_db.cv)\n";
    std::cout << "   d: duration - seconds in \"sim time\" to run the sim\n";
    std::cout << "   v: verbosity - how much information to send to stdout (0-3, 3=max)\n";
+   std::cout << "   k: keep replication connections to peers open between batches\n";
+   std::cout << "   w: directory for the write-ahead log and checkpoints--plots are recovered\n";
+   std::cout << "      from it on startup (default: none, nothing is kept across restarts)\n";
+   std::cout << "   x: what to do with two nodes' plots of the same sighting: lowest (keep the\n";
+   std::cout << "      lowest node's, default), drop (keep our own and the first of a peer's\n";
+   std::cout << "      to arrive) or off\n";
+   std::cout << "   f: file to stream each drone's plots to in time order as they settle\n";
+   std::cout << "      (default: none)\n";
 }
 
 
@@ -77,6 +87,10 @@ int main(int argc, char *argv[]) {
    int sim_time = 900; // Default 900 seconds
    std::string ip_addr = "127.0.0.1";
    unsigned short port = 9999;
+   bool persistent = false;
+   std::string wal_dir;
+   std::string track_file;
+   DeconflictIndex::policy dc_policy = DeconflictIndex::dc_keep_lowest;
 
    // Filename to write the replication output
    std::string outfile("replication_db.csv");
@@ -87,7 +101,7 @@ int main(int argc, char *argv[]) {
    // will appear in case 1
    unsigned long portval;
    int c = 0;
-   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:")) != -1) {
+   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:kw:x:f:")) != -1) {
       switch (c) {
 
       // The inject database file specified in the command line
@@ -143,6 +157,29 @@ int main(int argc, char *argv[]) {
          outfile = optarg;
          break;
 
+      // Persistent peer connections
+      case 'k':
+         persistent = true;
+         break;
+
+      // Write-ahead log directory
+      case 'w':
+         wal_dir = optarg;
+         break;
+
+      // Deconfliction policy
+      case 'x':
+         if (!DeconflictIndex::parsePolicy(optarg, dc_policy)) {
+            std::cerr << "Invalid deconfliction policy. Use lowest, drop or off.\n";
+            exit(0);
+         }
+         break;
+
+      // Track stream file
+      case 'f':
+         track_file = optarg;
+         break;
+
       case '?':
               displayHelp(argv[0]);
               break;
@@ -162,6 +199,18 @@ int main(int argc, char *argv[]) {
    }
 
    DronePlotDB db;
+   db.setDeconflict(dc_policy);
+
+   // Bring back what was logged before a crash or restart, then log from here on
+   std::unique_ptr<PlotWAL> wal;
+   size_t recovered = 0;
+   uint64_t recovered_lsn = 0;
+   if (wal_dir.size() > 0) {
+      wal.reset(new PlotWAL(wal_dir.c_str(), verbosity));
+      recovered = wal->recover(db);
+      recovered_lsn = db.getLastLSN();
+      wal->start(db);
+   }
 
    // Kick off the simulation thread by creating the sim management object
    // This will raise a runtime_exception if the simdata database load fails
@@ -172,8 +221,15 @@ int main(int argc, char *argv[]) {
    if (pthread_create(&simthread, NULL, t_simulator, (void *) &sim) != 0)
       throw std::runtime_error("Unable to create simulator thread");
 
-   // Start the replication server
+   // Start the replication server. The clock correction is kept with the WAL
    ReplServer repl_server(db, ip_addr.c_str(), port, sim.getOffset(), time_mult, verbosity); 
+   repl_server.setPersistentConns(persistent);
+   if (wal_dir.size() > 0)
+      repl_server.setSkewFile((wal_dir + "/skew").c_str());
+   if (recovered > 0)
+      repl_server.setRecovered(recovered_lsn);
+   if (track_file.size() > 0)
+      repl_server.setTrackFile(track_file.c_str());
 
    pthread_t replthread;
    if (pthread_create(&replthread, NULL, t_replserver, (void *) &repl_server) != 0)
@@ -192,10 +248,14 @@ int main(int argc, char *argv[]) {
    pthread_join(simthread, NULL);
    pthread_join(replthread, NULL);
 
+   // Final commit and checkpoint, so the next start has no log to replay
+   if (wal)
+      wal->stop();
+
    // Write the replication database to a CSV file
    std::cout << "Writing results to: " << outfile << "\n";
    db.sortByTime();
-   db.writeCSVFile(outfile.c_str());
+   db.writeCSVFile(outfile.c_str(), DBFLAG_DUP);
    
    return 0;
 }